@@ -0,0 +1,115 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "arena.h"
+#include "valkeymodule.h"
+
+Arena *NewArena(size_t hint) {
+    Arena *a = ValkeyModule_Calloc(1, sizeof(Arena));
+    a->chunkSize = ARENA_ALIGN(hint);
+    if (a->chunkSize < ARENA_MIN_CHUNK_SIZE) a->chunkSize = ARENA_MIN_CHUNK_SIZE;
+    // a hint that overshoots would leave the rest of a huge chunk unused for the arena's lifetime
+    if (a->chunkSize > ARENA_MAX_CHUNK_SIZE) a->chunkSize = ARENA_MAX_CHUNK_SIZE;
+    return a;
+}
+
+void Arena_Free(Arena *a) {
+    if (!a) return;
+
+    ArenaChunk *c = a->chunks;
+    while (c) {
+        ArenaChunk *next = c->next;
+        ValkeyModule_Free(c);
+        c = next;
+    }
+    ValkeyModule_Free(a);
+}
+
+static ArenaChunk *newChunk(Arena *a, size_t size) {
+    ArenaChunk *c = ValkeyModule_Alloc(sizeof(ArenaChunk) + size);
+    c->size = size;
+    c->used = 0;
+    a->size += size;
+    return c;
+}
+
+void *Arena_Alloc(Arena *a, size_t size) {
+    ArenaChunk *c = a->chunks;
+    size = ARENA_ALIGN(size);
+
+    if (!c || c->size - c->used < size) {
+        if (size > a->chunkSize / 4) {
+            // big allocations get a chunk of their own, which is kept behind the current one
+            c = newChunk(a, size);
+            if (a->chunks) {
+                c->next = a->chunks->next;
+                a->chunks->next = c;
+            } else {
+                c->next = NULL;
+                a->chunks = c;
+            }
+        } else {
+            c = newChunk(a, a->chunkSize);
+            c->next = a->chunks;
+            a->chunks = c;
+            if (a->chunkSize < ARENA_MAX_CHUNK_SIZE) a->chunkSize *= 2;
+        }
+    }
+
+    void *p = &c->data[c->used];
+    c->used += size;
+    a->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+int Arena_Extend(Arena *a, void *p, size_t size, size_t newsize) {
+    ArenaChunk *c = a->chunks;
+    size = ARENA_ALIGN(size);
+    newsize = ARENA_ALIGN(newsize);
+
+    // only the last allocation in the current chunk can grow, and only if the chunk has room for it
+    if (!c || (char *)p + size != &c->data[c->used] || newsize < size ||
+        c->size - c->used < newsize - size)
+        return 0;
+
+    memset(&c->data[c->used], 0, newsize - size);
+    c->used += newsize - size;
+    a->used += newsize - size;
+    return 1;
+}
+
+void Arena_Merge(Arena *dst, Arena *src) {
+    if (src->chunks) {
+        // keep dst's current chunk first
+        ArenaChunk *last = src->chunks;
+        while (last->next) last = last->next;
+        if (dst->chunks) {
+            last->next = dst->chunks->next;
+            dst->chunks->next = src->chunks;
+        } else {
+            dst->chunks = src->chunks;
+        }
+    }
+
+    dst->size += src->size;
+    dst->used += src->used;
+    dst->dead += src->dead;
+    ValkeyModule_Free(src);
+}
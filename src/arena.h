@@ -0,0 +1,67 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* A chunk of memory that allocations are carved from */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;  // usable size
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+/*
+* A bump allocator. Allocations can't be freed individually, instead the arena keeps track of the
+* number of bytes that were released so its owner can tell when it is fragmented, and all of its
+* memory is freed at once.
+*/
+typedef struct {
+    ArenaChunk *chunks;  // the current chunk is the first
+    size_t chunkSize;    // size of the next chunk, chunks grow up to ARENA_MAX_CHUNK_SIZE
+    size_t size;         // total size of the chunks
+    size_t used;         // number of bytes allocated from the arena
+    size_t dead;         // number of bytes allocated and then released
+} Arena;
+
+#define ARENA_MIN_CHUNK_SIZE 256
+#define ARENA_MAX_CHUNK_SIZE (1 << 16)
+
+/* Allocations are rounded up to a multiple of 8 bytes */
+#define ARENA_ALIGN(s) (((s) + 7) & ~(size_t)7)
+
+/* Create a new arena, the size hint sets the size of its first chunk up to ARENA_MAX_CHUNK_SIZE */
+Arena *NewArena(size_t hint);
+
+/* Free an arena and all the memory allocated from it */
+void Arena_Free(Arena *a);
+
+/* Allocate zeroed, 8 byte aligned, memory from the arena */
+void *Arena_Alloc(Arena *a, size_t size);
+
+/* Grow an allocation in place to newsize bytes, which is only possible for the arena's last
+ * allocation. Returns 1 if the allocation was grown (and its new bytes zeroed), 0 otherwise. */
+int Arena_Extend(Arena *a, void *p, size_t size, size_t newsize);
+
+/* Move the chunks of src to dst, and free src */
+void Arena_Merge(Arena *dst, Arena *src);
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compact.h"
+
+#define ZIGZAG(v) (((uint64_t)(v) << 1) ^ (uint64_t)((v) >> 63))
+#define UNZIGZAG(u) ((int64_t)((u) >> 1) ^ -(int64_t)((u)&1))
+
+static inline const char *getVarint(const char *p, uint64_t *v) {
+    uint64_t ret = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        ret |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = ret | (uint64_t)*p++ << shift;
+    return p;
+}
+
+/* === Encoding === */
+
+/* An encoding that is being written, and that is given up once it outgrows its maximal size */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t max;
+} _CompactEncoder;
+
+/* Makes room for size more bytes, returns 0 if the encoding would be too big. */
+static int encoderMakeRoomFor(_CompactEncoder *e, size_t size) {
+    if (e->len + size > e->max) return 0;
+    if (e->len + size > e->cap) {
+        while (e->len + size > e->cap) e->cap *= 2;
+        e->buf = ValkeyModule_Realloc(e->buf, MIN(e->cap, e->max));
+        e->cap = MIN(e->cap, e->max);
+    }
+    return 1;
+}
+
+static int encodeTag(_CompactEncoder *e, char tag) {
+    if (!encoderMakeRoomFor(e, 1)) return 0;
+    e->buf[e->len++] = tag;
+    return 1;
+}
+
+static int encodeVarint(_CompactEncoder *e, uint64_t v) {
+    size_t size = 1;
+    for (uint64_t u = v; u >= 0x80; u >>= 7) size++;
+    if (!encoderMakeRoomFor(e, size)) return 0;
+
+    while (v >= 0x80) {
+        e->buf[e->len++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    e->buf[e->len++] = (char)v;
+    return 1;
+}
+
+static int encodeBytes(_CompactEncoder *e, const char *s, size_t len) {
+    if (!encodeVarint(e, len) || !encoderMakeRoomFor(e, len)) return 0;
+    memcpy(e->buf + e->len, s, len);
+    e->len += len;
+    return 1;
+}
+
+static int encodeValue(_CompactEncoder *e, const Node *n) {
+    if (!n) return encodeTag(e, COMPACT_NULL);
+
+    switch (n->type) {
+        case N_BOOLEAN:
+            return encodeTag(e, n->value.boolval ? COMPACT_TRUE : COMPACT_FALSE);
+        case N_INTEGER:
+            return encodeTag(e, COMPACT_INTEGER) && encodeVarint(e, ZIGZAG(n->value.intval));
+        case N_NUMBER:
+            if (!encodeTag(e, COMPACT_NUMBER) || !encoderMakeRoomFor(e, sizeof(double))) return 0;
+            memcpy(e->buf + e->len, &n->value.numval, sizeof(double));
+            e->len += sizeof(double);
+            return 1;
+        case N_STRING:
+        case N_BINARY:
+            return encodeTag(e, N_STRING == n->type ? COMPACT_STRING : COMPACT_BINARY) &&
+                   encodeBytes(e, NODE_STRDATA(n), NODE_STRLEN(n));
+        case N_ARRAY: {
+            int len = Node_Length(n);
+            if (!encodeTag(e, COMPACT_ARRAY) || !encodeVarint(e, len)) return 0;
+            for (int i = 0; i < len; i++) {
+                Node *item;
+                Node_ArrayItem((Node *)n, i, &item);
+                if (!encodeValue(e, item)) return 0;
+            }
+            return 1;
+        }
+        case N_DICT: {
+            int len = Node_Length(n);
+            if (!encodeTag(e, COMPACT_DICT) || !encodeVarint(e, len)) return 0;
+            for (int i = 0; i < len; i++) {
+                const char *key;
+                uint32_t keylen;
+                Node *val;
+                Node_DictItem(n, i, &key, &keylen, &val);
+                if (!encodeBytes(e, key, keylen) || !encodeValue(e, val)) return 0;
+            }
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+char *Compact_Encode(const Node *n, size_t max, size_t *len) {
+    _CompactEncoder e = {.cap = MIN(64, max), .max = max};
+    if (!max) return NULL;
+
+    e.buf = ValkeyModule_Alloc(e.cap);
+    if (!encodeValue(&e, n)) {
+        ValkeyModule_Free(e.buf);
+        return NULL;
+    }
+
+    *len = e.len;
+    return e.len < e.cap ? ValkeyModule_Realloc(e.buf, e.len) : e.buf;
+}
+
+/* === Decoding === */
+
+/* Returns the end of an encoded value. */
+static const char *skipValue(const char *c) {
+    uint64_t v;
+    switch (*c++) {
+        case COMPACT_INTEGER:
+            return getVarint(c, &v);
+        case COMPACT_NUMBER:
+            return c + sizeof(double);
+        case COMPACT_STRING:
+        case COMPACT_BINARY:
+            c = getVarint(c, &v);
+            return c + v;
+        case COMPACT_ARRAY:
+            c = getVarint(c, &v);
+            while (v--) c = skipValue(c);
+            return c;
+        case COMPACT_DICT:
+            c = getVarint(c, &v);
+            while (v--) {
+                uint64_t keylen;
+                c = getVarint(c, &keylen);
+                c = skipValue(c + keylen);
+            }
+            return c;
+        default:  // nulls and booleans are just their tag
+            return c;
+    }
+}
+
+/* Creates the nodes of the value at *c, and moves c past it. */
+static Node *decodeValue(const char **c) {
+    const char *p = *c;
+    char tag = *p++;
+    uint64_t v;
+    Node *ret = NULL;
+
+    switch (tag) {
+        case COMPACT_FALSE:
+        case COMPACT_TRUE:
+            ret = NewBoolNode(COMPACT_TRUE == tag);
+            break;
+        case COMPACT_INTEGER:
+            p = getVarint(p, &v);
+            ret = NewIntNode(UNZIGZAG(v));
+            break;
+        case COMPACT_NUMBER: {
+            double d;
+            memcpy(&d, p, sizeof(double));
+            p += sizeof(double);
+            ret = NewDoubleNode(d);
+        } break;
+        case COMPACT_STRING:
+        case COMPACT_BINARY:
+            p = getVarint(p, &v);
+            ret = COMPACT_STRING == tag ? NewStringNode(p, v) : NewBinaryNode(p, v);
+            p += v;
+            break;
+        case COMPACT_ARRAY:
+            p = getVarint(p, &v);
+            ret = NewArrayNode(v);
+            while (v--) Node_ArrayAppend(ret, decodeValue(&p));
+            // arrays of objects with the same keys are stored as tables
+            Node_ArrayTabulate(ret);
+            break;
+        case COMPACT_DICT:
+            p = getVarint(p, &v);
+            ret = NewDictNode(v);
+            while (v--) {
+                uint64_t keylen;
+                p = getVarint(p, &keylen);
+                const char *key = p;
+                p += keylen;
+                Node_DictSetLen(ret, key, keylen, decodeValue(&p));
+            }
+            break;
+        default:  // nulls are NULL nodes
+            break;
+    }
+
+    *c = p;
+    return ret;
+}
+
+Node *Compact_Decode(const char *c) { return decodeValue(&c); }
+
+NodeType Compact_Type(const char *c) {
+    static const NodeType types[] = {N_NULL,   N_BOOLEAN, N_BOOLEAN, N_INTEGER, N_NUMBER,
+                                     N_STRING, N_ARRAY,   N_DICT,    N_BINARY};
+    return types[(int)*c];
+}
+
+int Compact_Length(const char *c) {
+    uint64_t v;
+    switch (*c) {
+        case COMPACT_STRING:
+        case COMPACT_BINARY:
+        case COMPACT_ARRAY:
+        case COMPACT_DICT:
+            getVarint(c + 1, &v);
+            return v;
+        default:
+            return 0;
+    }
+}
+
+/* === Lookup === */
+
+PathError Compact_Find(const SearchPath *path, const char *root, const char **c, int *errlevel) {
+    const char *cur = root;
+    PathError err = E_OK;
+    uint64_t len;
+
+    for (int i = 0; i < path->len && E_OK == err; i++) {
+        PathNode *pn = &path->nodes[i];
+        if (COMPACT_ARRAY == *cur && NT_INDEX == pn->type) {
+            // translate negative indices
+            cur = getVarint(cur + 1, &len);
+            int64_t index = pn->value.index < 0 ? (int64_t)len + pn->value.index : pn->value.index;
+            if (index < 0 || (uint64_t)index >= len) {
+                err = E_NOINDEX;
+            } else {
+                while (index--) cur = skipValue(cur);
+            }
+        } else if (COMPACT_DICT == *cur && NT_KEY == pn->type) {
+            size_t keylen = strlen(pn->value.key);
+            cur = getVarint(cur + 1, &len);
+            err = E_NOKEY;
+            while (len--) {
+                uint64_t l;
+                cur = getVarint(cur, &l);
+                if (l == keylen && !memcmp(cur, pn->value.key, l)) {
+                    cur += l;
+                    err = E_OK;
+                    break;
+                }
+                cur = skipValue(cur + l);
+            }
+        } else {
+            err = E_BADTYPE;
+        }
+        if (E_OK != err) *errlevel = i;
+    }
+
+    *c = E_OK == err ? cur : NULL;
+    return err;
+}
+
+/* === Serialization === */
+
+#define _maskenabled(t, x) ((int)(t) & (x))
+
+/* Walks the value at c with the callbacks, and returns its end. */
+static const char *serializeValue(const char *c, const NodeSerializerOpt *o, void *ctx) {
+    NodeType type = Compact_Type(c);
+    uint64_t v = 0;
+
+    // containers are viewed through a header with just their length
+    t_array arr = {0};
+    t_dict dict = {0};
+    Node view = {.type = type};
+    Node *n = &view;
+
+    switch (*c++) {
+        case COMPACT_NULL:
+            n = NULL;
+            break;
+        case COMPACT_FALSE:
+        case COMPACT_TRUE:
+            view.value.boolval = COMPACT_TRUE == c[-1];
+            break;
+        case COMPACT_INTEGER:
+            c = getVarint(c, &v);
+            view.value.intval = UNZIGZAG(v);
+            break;
+        case COMPACT_NUMBER:
+            memcpy(&view.value.numval, c, sizeof(double));
+            c += sizeof(double);
+            break;
+        case COMPACT_STRING:
+        case COMPACT_BINARY:
+            c = getVarint(c, &v);
+            view.value.strval = (char *)c;
+            view.len = v;
+            c += v;
+            break;
+        case COMPACT_ARRAY:
+            c = getVarint(c, &v);
+            arr.len = v;
+            view.value.arrval = &arr;
+            break;
+        case COMPACT_DICT:
+            c = getVarint(c, &v);
+            dict.len = v;
+            view.value.dictval = &dict;
+            break;
+    }
+
+    if (_maskenabled(type, o->xBegin)) o->fBegin(n, ctx);
+    if (N_ARRAY == type || N_DICT == type) {
+        for (uint64_t i = 0; i < v; i++) {
+            if (i && _maskenabled(type, o->xDelim)) o->fDelim(ctx);
+            if (N_DICT == type) {
+                uint64_t keylen;
+                c = getVarint(c, &keylen);
+                if (o->fKey) o->fKey(c, keylen, ctx);
+                c += keylen;
+            }
+            c = serializeValue(c, o, ctx);
+        }
+    }
+    if (_maskenabled(type, o->xEnd)) o->fEnd(n, ctx);
+    return c;
+}
+
+void Compact_Serializer(const char *c, const NodeSerializerOpt *o, void *ctx) {
+    serializeValue(c, o, ctx);
+}
@@ -0,0 +1,76 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+#include <stddef.h>
+#include "object.h"
+#include "path.h"
+
+/*
+* The compact encoding of a value is a single buffer, in which the value is written in pre-order
+* much like in a listpack. Every value starts with a tag byte, that is followed by:
+*   - nothing for nulls and booleans
+*   - a zigzag varint for integers
+*   - 8 bytes for other numbers
+*   - a varint length and the bytes for strings and binary values
+*   - a varint count and the items for arrays
+*   - a varint count and the entries for objects, each one a varint key length, the key's bytes and
+*     the value
+* Varints are LEB128, 7 bits per byte with the least significant first. Values are found by
+* skipping over the ones before them, so the encoding is meant for small documents.
+*/
+#define COMPACT_NULL 0
+#define COMPACT_FALSE 1
+#define COMPACT_TRUE 2
+#define COMPACT_INTEGER 3
+#define COMPACT_NUMBER 4
+#define COMPACT_STRING 5
+#define COMPACT_ARRAY 6
+#define COMPACT_DICT 7
+#define COMPACT_BINARY 8
+
+/**
+* Encodes a value. Returns a buffer that is allocated to its exact size, which is stored in len, or
+* NULL if the encoding takes more than max bytes.
+*/
+char *Compact_Encode(const Node *n, size_t max, size_t *len);
+
+/** Creates the nodes of an encoded value, allocated according to the current arena */
+Node *Compact_Decode(const char *c);
+
+/** Returns the type of an encoded value */
+NodeType Compact_Type(const char *c);
+
+/** Returns the length of an encoded string, array or object, like Node_Length */
+int Compact_Length(const char *c);
+
+/**
+* Finds an encoded value by a path that isn't the root's, like SearchPath_FindEx: c is set to the
+* value that the path matches, or the error's level in the path is set to errlevel.
+*/
+PathError Compact_Find(const SearchPath *path, const char *root, const char **c, int *errlevel);
+
+/**
+* Walks an encoded value with callbacks like Node_Serializer does. The callbacks get nodes that are
+* views of the encoded values: scalars as they would be, and containers only with their length.
+*/
+void Compact_Serializer(const char *c, const NodeSerializerOpt *o, void *ctx);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "daemon.h"
+#include "json_type.h"
+
+long long jsonDaemonInterval_g = DAEMON_DEFAULT_INTERVAL;
+long long jsonDaemonBudget_g = DAEMON_DEFAULT_BUDGET;
+
+/* How often a disabled daemon checks whether it was enabled, in milliseconds */
+#define DAEMON_IDLE_INTERVAL 1000
+
+/* The scan's position, which is kept between ticks */
+static ValkeyModuleType *jsonType = NULL;
+static ValkeyModuleScanCursor *cursor = NULL;
+static int db = 0;
+
+/* What the daemon did so far, for INFO */
+static struct {
+    unsigned long long ticks;      // ticks that scanned keys
+    unsigned long long time;       // microseconds that were spent in them
+    unsigned long long passes;     // full scans of the keyspace
+    unsigned long long keys;       // documents that were visited
+    unsigned long long optimized;  // documents that were optimized
+    unsigned long long compacted;  // documents that were compacted by it
+    unsigned long long reclaimed;  // bytes that optimizing documents gave back
+} stats;
+
+static void visitKey(ValkeyModuleCtx *ctx, ValkeyModuleString *keyname, ValkeyModuleKey *key,
+                     void *privdata) {
+    if (!key || ValkeyModule_ModuleTypeGetType(key) != jsonType) return;
+    JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
+    stats.keys++;
+    JSONTypeSettle(jt);
+
+    // documents that are being written to are left alone until they settle
+    if (jt->changes) {
+        jt->changes = 0;
+        return;
+    }
+    if (jt->optimized || jt->compact || jt->tape || jt->memory > DAEMON_MAX_MEMORY) return;
+
+    size_t before = JSONTypeMemoryUsage(jt);
+    JSONTypeOptimize(jt);
+    size_t after = JSONTypeMemoryUsage(jt);
+
+    stats.optimized++;
+    if (jt->compact) stats.compacted++;
+    if (after < before) stats.reclaimed += before - after;
+}
+
+/* Returns the time until the next tick */
+static long long nextTick(void) {
+    return jsonDaemonInterval_g ? jsonDaemonInterval_g : DAEMON_IDLE_INTERVAL;
+}
+
+static void tick(ValkeyModuleCtx *ctx, void *data) {
+    ValkeyModule_CreateTimer(ctx, nextTick(), tick, NULL);
+    if (!jsonDaemonInterval_g ||
+        ValkeyModule_GetContextFlags(ctx) &
+            (VALKEYMODULE_CTX_FLAGS_LOADING | VALKEYMODULE_CTX_FLAGS_ACTIVE_CHILD))
+        return;
+
+    uint64_t start = ValkeyModule_MonotonicMicroseconds();
+    uint64_t elapsed = 0;
+    int passed = 0;
+    if (VALKEYMODULE_OK != ValkeyModule_SelectDb(ctx, db)) db = 0;
+    do {
+        if (!ValkeyModule_Scan(ctx, cursor, visitKey, NULL)) {
+            // the database was scanned, so move on to the next one or start over from the first
+            ValkeyModule_ScanCursorRestart(cursor);
+            if (VALKEYMODULE_OK != ValkeyModule_SelectDb(ctx, ++db)) {
+                db = 0;
+                stats.passes++;
+                ValkeyModule_SelectDb(ctx, db);
+                // a tick makes at most one pass, so small keyspaces don't take the whole budget
+                passed = 1;
+            }
+        }
+        elapsed = ValkeyModule_MonotonicMicroseconds() - start;
+    } while (!passed && elapsed < (uint64_t)jsonDaemonBudget_g);
+
+    stats.ticks++;
+    stats.time += elapsed;
+}
+
+void Daemon_Start(ValkeyModuleCtx *ctx, ValkeyModuleType *type) {
+    // older servers can't scan from a timer
+    if (!ValkeyModule_CreateTimer || !ValkeyModule_Scan || !ValkeyModule_MonotonicMicroseconds)
+        return;
+
+    jsonType = type;
+    cursor = ValkeyModule_ScanCursorCreate();
+    ValkeyModule_CreateTimer(ctx, nextTick(), tick, NULL);
+}
+
+void Daemon_Info(ValkeyModuleInfoCtx *ctx, int for_crash_report) {
+    ValkeyModule_InfoAddSection(ctx, "daemon");
+    ValkeyModule_InfoAddFieldULongLong(ctx, "ticks", stats.ticks);
+    ValkeyModule_InfoAddFieldULongLong(ctx, "time_us", stats.time);
+    ValkeyModule_InfoAddFieldULongLong(ctx, "passes", stats.passes);
+    ValkeyModule_InfoAddFieldULongLong(ctx, "keys_visited", stats.keys);
+    ValkeyModule_InfoAddFieldULongLong(ctx, "documents_optimized", stats.optimized);
+    ValkeyModule_InfoAddFieldULongLong(ctx, "documents_compacted", stats.compacted);
+    ValkeyModule_InfoAddFieldULongLong(ctx, "memory_reclaimed", stats.reclaimed);
+}
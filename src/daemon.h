@@ -0,0 +1,52 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include "valkeymodule.h"
+
+/*
+* The daemon is a timer on the main thread that scans the keyspace a few keys at a time, and
+* optimizes the documents that were changed and have since been left alone: their nodes are
+* re-encoded in the way that takes the least memory, and small ones are compacted. Documents are
+* only optimized once they weren't changed between two visits, so hot ones aren't converted back
+* and forth. Every tick takes up to a time budget, and there are no ticks while loading or when a
+* child process is forked, as converting documents would copy their pages.
+*/
+
+/* The default time between the daemon's ticks in milliseconds, 0 disables the daemon */
+#define DAEMON_DEFAULT_INTERVAL 100
+
+/* The default time that the daemon may take in every tick in microseconds */
+#define DAEMON_DEFAULT_BUDGET 1000
+
+/* Documents whose nodes take more memory than this are left as they are, as they take too long */
+#define DAEMON_MAX_MEMORY (1 << 20)
+
+/* The daemon's settings, set by the daemon-interval and daemon-budget configs */
+extern long long jsonDaemonInterval_g;
+extern long long jsonDaemonBudget_g;
+
+/** Starts the daemon, which visits the keys of the given type */
+void Daemon_Start(ValkeyModuleCtx *ctx, ValkeyModuleType *type);
+
+/** Adds the daemon's section to INFO */
+void Daemon_Info(ValkeyModuleInfoCtx *ctx, int for_crash_report);
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "json_index.h"
+#include "valkeymodule.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSONINDEX_X86
+#include <immintrin.h>
+#endif
+
+/* The bitmasks of a block's characters, a bit per byte */
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;     // braces, brackets, colons and commas
+    uint64_t space;  // whitespace
+    uint64_t ctrl;   // control characters, including whitespace other than spaces
+} _Block;
+
+/* An index that is being built, and what carries over from one block to the next */
+typedef struct {
+    uint32_t *pos;
+    size_t len;
+    size_t cap;
+    uint64_t escaped;   // the first character of the next block is escaped
+    uint64_t instring;  // all ones if the next block starts inside a string
+    uint64_t inscalar;  // the last character was part of a scalar
+    int bad;            // there's a control character in a string
+} _Indexer;
+
+/* === Classification === */
+
+static void classifyScalar(const char *p, _Block *b) {
+    *b = (_Block){0};
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (p[i]) {
+            case '"':
+                b->quote |= bit;
+                break;
+            case '\\':
+                b->backslash |= bit;
+                break;
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                b->op |= bit;
+                break;
+            case ' ':
+                b->space |= bit;
+                break;
+            case '\t':
+            case '\n':
+            case '\r':
+                b->space |= bit;
+                b->ctrl |= bit;
+                break;
+            default:
+                if ((unsigned char)p[i] < 0x20) b->ctrl |= bit;
+                break;
+        }
+    }
+}
+
+#ifdef JSONINDEX_X86
+/* SSE4.2 matches each 16 bytes against the sets of operators and whitespace at once */
+__attribute__((target("sse4.2"))) static void classifySse42(const char *p, _Block *b) {
+    const __m128i ops = _mm_setr_epi8('{', '}', '[', ']', ':', ',', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i spaces = _mm_setr_epi8(' ', '\t', '\n', '\r', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    *b = (_Block){0};
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        int shift = 16 * i;
+        b->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << shift;
+        b->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash))
+                        << shift;
+        b->op |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(
+                     _mm_cmpestrm(ops, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY))
+                 << shift;
+        b->space |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(
+                        _mm_cmpestrm(spaces, 4, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY))
+                    << shift;
+        // bytes below the space are the ones that the unsigned minimum with it changes
+        __m128i ctrl = _mm_cmpeq_epi8(_mm_max_epu8(v, space), v);
+        b->ctrl |= (uint64_t)(uint16_t)~_mm_movemask_epi8(ctrl) << shift;
+    }
+}
+
+__attribute__((target("avx2"))) static inline uint64_t matchAvx2(__m256i lo, __m256i hi,
+                                                                 char c) {
+    const __m256i m = _mm256_set1_epi8(c);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, m)) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, m)) << 32;
+}
+
+__attribute__((target("avx2"))) static void classifyAvx2(const char *p, _Block *b) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    b->quote = matchAvx2(lo, hi, '"');
+    b->backslash = matchAvx2(lo, hi, '\\');
+    b->op = matchAvx2(lo, hi, '{') | matchAvx2(lo, hi, '}') | matchAvx2(lo, hi, '[') |
+            matchAvx2(lo, hi, ']') | matchAvx2(lo, hi, ':') | matchAvx2(lo, hi, ',');
+    uint64_t spaces = matchAvx2(lo, hi, ' ');
+    b->space = spaces | matchAvx2(lo, hi, '\t') | matchAvx2(lo, hi, '\n') |
+               matchAvx2(lo, hi, '\r');
+
+    const __m256i space = _mm256_set1_epi8(' ');
+    uint64_t printable =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(lo, space), lo)) |
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(hi, space), hi))
+            << 32;
+    b->ctrl = ~printable;
+}
+#endif
+
+/* === Indexing === */
+
+/* Returns the characters that follow odd runs of backslashes, the first of which may be escaped by
+ * the previous block. Backslashes are rare enough to be resolved one run at a time. */
+static inline uint64_t findEscaped(_Indexer *ix, uint64_t backslash) {
+    uint64_t escaped = ix->escaped;
+    backslash &= ~escaped;
+    ix->escaped = 0;
+    while (backslash) {
+        uint64_t b = backslash & -backslash;
+        uint64_t next = b << 1;
+        if (!next) ix->escaped = 1;
+        escaped |= next;
+        backslash &= ~(b | next);
+    }
+    return escaped;
+}
+
+/* Sets every bit from a set bit up to the next one, excluding it. */
+static inline uint64_t prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/* Adds the structural characters of a classified block that starts at the given position. */
+static inline __attribute__((always_inline)) void indexBlock(_Indexer *ix, const _Block *b,
+                                                             size_t at) {
+    uint64_t quotes = b->quote & ~findEscaped(ix, b->backslash);
+    uint64_t instring = prefixXor(quotes) ^ ix->instring;
+    ix->instring = (uint64_t)((int64_t)instring >> 63);
+    if (b->ctrl & instring) ix->bad = 1;
+
+    // scalars start at characters that are neither structural nor whitespace, after ones that are
+    uint64_t scalar = ~(b->op | b->space | quotes | instring);
+    uint64_t structural = (b->op & ~instring) | quotes | (scalar & ~(scalar << 1 | ix->inscalar));
+    ix->inscalar = scalar >> 63;
+
+    if (ix->len + 64 > ix->cap) {
+        ix->cap *= 2;
+        ix->pos = ValkeyModule_Realloc(ix->pos, ix->cap * sizeof(uint32_t));
+    }
+    while (structural) {
+        ix->pos[ix->len++] = at + __builtin_ctzll(structural);
+        structural &= structural - 1;
+    }
+}
+
+#ifdef JSONINDEX_X86
+__attribute__((target("sse4.2"))) static size_t indexSse42(_Indexer *ix, const char *buf,
+                                                           size_t len) {
+    size_t at = 0;
+    for (_Block b; at + 64 <= len; at += 64) {
+        classifySse42(buf + at, &b);
+        indexBlock(ix, &b, at);
+    }
+    return at;
+}
+
+__attribute__((target("avx2"))) static size_t indexAvx2(_Indexer *ix, const char *buf,
+                                                        size_t len) {
+    size_t at = 0;
+    for (_Block b; at + 64 <= len; at += 64) {
+        classifyAvx2(buf + at, &b);
+        indexBlock(ix, &b, at);
+    }
+    return at;
+}
+#endif
+
+static size_t indexScalar(_Indexer *ix, const char *buf, size_t len) {
+    size_t at = 0;
+    for (_Block b; at + 64 <= len; at += 64) {
+        classifyScalar(buf + at, &b);
+        indexBlock(ix, &b, at);
+    }
+    return at;
+}
+
+/* Returns the fastest implementation that the CPU supports, up to the given one. */
+static JSONIndexImpl supportedImpl(JSONIndexImpl impl) {
+#ifdef JSONINDEX_X86
+    __builtin_cpu_init();
+    if (impl >= JSONINDEX_AVX2 && __builtin_cpu_supports("avx2")) return JSONINDEX_AVX2;
+    if (impl >= JSONINDEX_SSE42 && __builtin_cpu_supports("sse4.2")) return JSONINDEX_SSE42;
+#endif
+    return JSONINDEX_SCALAR;
+}
+
+uint32_t *JSONIndex_Build(const char *buf, size_t len, JSONIndexImpl impl, size_t *n) {
+    // positions are 32 bits
+    if (len > UINT32_MAX) return NULL;
+
+    static int best = -1;
+    if (best < 0) best = supportedImpl(JSONINDEX_BEST);
+    impl = JSONINDEX_BEST == impl ? (JSONIndexImpl)best : supportedImpl(impl);
+
+    // there are usually a lot fewer structural characters than bytes
+    _Indexer ix = {.cap = len / 8 + 64};
+    ix.pos = ValkeyModule_Alloc(ix.cap * sizeof(uint32_t));
+
+    size_t at;
+    switch (impl) {
+#ifdef JSONINDEX_X86
+        case JSONINDEX_AVX2:
+            at = indexAvx2(&ix, buf, len);
+            break;
+        case JSONINDEX_SSE42:
+            at = indexSse42(&ix, buf, len);
+            break;
+#endif
+        default:
+            at = indexScalar(&ix, buf, len);
+            break;
+    }
+
+    // the last block is padded with whitespace
+    if (at < len) {
+        char last[64];
+        _Block b;
+        memset(last, ' ', sizeof(last));
+        memcpy(last, buf + at, len - at);
+        classifyScalar(last, &b);
+        indexBlock(&ix, &b, at);
+    }
+
+    if (ix.bad || ix.instring) {
+        ValkeyModule_Free(ix.pos);
+        return NULL;
+    }
+    *n = ix.len;
+    return ix.pos;
+}
@@ -0,0 +1,55 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __JSON_INDEX_H__
+#define __JSON_INDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* The first stage of parsing big JSON texts, like simdjson's: the structural characters are found
+* 64 bytes at a time, and their positions are stored in an index that the second stage builds the
+* nodes from without looking at the bytes in between. The structural characters are the braces,
+* brackets, colons and commas outside strings, the quotes that start and end strings, and the
+* first characters of all other values.
+*
+* Every block is classified into bitmasks of quotes, backslashes, operators, whitespace and control
+* characters with SIMD instructions where the CPU has them. The escaped characters follow odd runs
+* of backslashes, and the characters inside strings are those between unescaped quotes, both of
+* which carry over from one block to the next.
+*/
+
+/* The implementations of the classification, from slowest to fastest */
+typedef enum {
+    JSONINDEX_NONE = 0,  // texts aren't indexed, jsonsl parses them
+    JSONINDEX_SCALAR,
+    JSONINDEX_SSE42,
+    JSONINDEX_AVX2,
+    JSONINDEX_BEST,  // the fastest one that the CPU supports
+} JSONIndexImpl;
+
+/**
+* Builds the structural index of a JSON text, with the fastest implementation that the CPU supports
+* up to the given one, and at least the scalar one. Returns the positions in an allocated array and
+* sets their count to n, or returns NULL if there are control characters in a string or the last
+* one isn't terminated, in which case the text is left to jsonsl.
+*/
+uint32_t *JSONIndex_Build(const char *buf, size_t len, JSONIndexImpl impl, size_t *n);
+
+#endif
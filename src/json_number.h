@@ -0,0 +1,46 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __JSON_NUMBER_H__
+#define __JSON_NUMBER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* Conversions of the numbers that the parser found, which are valid JSON numbers, without strtoll's
+* and strtod's locale handling. Integers are accumulated with overflow checks. Doubles are converted
+* exactly when the digits and the power of 10 are small enough for a double (Clinger's fast path),
+* and otherwise with the Eisel-Lemire algorithm, which multiplies the digits by a 128-bit
+* approximation of the power of 10. The few numbers that it can't round with certainty, those with
+* more than 19 significant digits and those that are subnormal or out of range are left to strtod.
+*/
+
+/**
+* Converts an integer, an optional minus sign followed by digits. Returns 0 if it isn't one or is
+* out of the range of int64_t, like strtoll would fail.
+*/
+int JSONNumber_ParseInt(const char *s, size_t len, int64_t *value);
+
+/**
+* Converts a number with a fraction and/or an exponent to the nearest double, the same as strtod.
+* Returns 0 if it isn't a number, if it is out of the range of a double or if it underflows to 0.
+*/
+int JSONNumber_ParseDouble(const char *s, size_t len, double *value);
+
+#endif
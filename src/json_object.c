@@ -31,6 +31,26 @@ static inline Node *_popNode(_JsonParserContext *ctx) {
     return ctx->nodes[ctx->nlen];
 }
 
+/* Numbers and booleans in arrays are appended right away, so packed arrays don't need nodes for
+ * them. Returns 1 if the value was appended. */
+static inline int _appendScalar(_JsonParserContext *ctx, const Node *n) {
+    if (!ctx->nlen || N_ARRAY != ctx->nodes[ctx->nlen - 1]->type) return 0;
+    Node_ArrayAppendCopy(ctx->nodes[ctx->nlen - 1], n);
+    return 1;
+}
+
+static inline void _pushKey(_JsonParserContext *ctx, const char *key, size_t len, char *buf) {
+    _JsonParserKey *k = &ctx->keys[ctx->klen++];
+    k->key = key;
+    k->len = len;
+    k->buf = buf;
+}
+
+static inline void _popKey(_JsonParserContext *ctx) {
+    ctx->klen--;
+    if (ctx->keys[ctx->klen].buf) ValkeyModule_Free(ctx->keys[ctx->klen].buf);
+}
+
 /* Decalre it. */
 static int _AllowedEscapes[];
 static int _IsAllowedWhitespace(unsigned c);
@@ -49,6 +69,13 @@ inline static void pushCallback(jsonsl_t jsn, jsonsl_action_t action, struct jso
                                 const jsonsl_char_t *at) {
     _JsonParserContext *jpctx = (_JsonParserContext *)jsn->data;
     Node *n = NULL;
+
+    // jsonsl goes on after the root when a comma follows it, but nothing may follow the root
+    if (1 == state->level && jpctx->nlen) {
+        errorCallback(jsn, JSONSL_ERROR_GARBAGE_TRAILING, state, NULL);
+        return;
+    }
+
     // only objects (dictionaries) and lists (arrays) create a container on push
     switch (state->type) {
         case JSONSL_T_OBJECT:
@@ -64,113 +91,401 @@ inline static void pushCallback(jsonsl_t jsn, jsonsl_action_t action, struct jso
     }
 }
 
+/* Sets the length of a string once its escapes are unescaped, which is always shorter. Fails with
+ * the error that jsonsl_util_unescape would fail with, so strings are unescaped right into their
+ * nodes. */
+static int _unescapedLen(const char *s, size_t len, size_t *newlen, jsonsl_error_t *err) {
+    const char *e = s + len;
+    int high = 0;  // a high surrogate awaits its low one
+    *newlen = len;
+
+    for (const char *esc = memchr(s, '\\', len); esc; esc = memchr(esc, '\\', e - esc)) {
+        if (e - esc < 2 || (unsigned char)esc[1] >= 0x80 || !_AllowedEscapes[(int)esc[1]]) {
+            *err = JSONSL_ERROR_ESCAPE_INVALID;
+            return 0;
+        }
+        if ('u' != esc[1]) {
+            *newlen -= 1;
+            esc += 2;
+            continue;
+        }
+
+        unsigned u = 0;
+        if (e - esc < 6) {
+            *err = JSONSL_ERROR_UESCAPE_TOOSHORT;
+            return 0;
+        }
+        for (int i = 2; i < 6; i++) {
+            if (!isxdigit((unsigned char)esc[i])) {
+                *err = JSONSL_ERROR_PERCENT_BADHEX;
+                return 0;
+            }
+            u = u << 4 | (esc[i] <= '9' ? esc[i] - '0' : (esc[i] | 0x20) - 'a' + 10);
+        }
+
+        // code points are written as UTF-8, and surrogate pairs as a single 4 byte one
+        if (high && u >= 0xdc00 && u <= 0xdfff) {
+            *newlen -= 6 - 4;
+            high = 0;
+        } else if (!high && (u < 0xd800 || u > 0xdfff)) {
+            *newlen -= 6 - (u < 0x80 ? 1 : u < 0x800 ? 2 : 3);
+        } else if (!high && u < 0xdc00) {
+            *newlen -= 6;
+            high = 1;
+        } else {
+            *err = JSONSL_ERROR_INVALID_CODEPOINT;
+            return 0;
+        }
+        esc += 6;
+    }
+
+    if (high) {
+        *err = JSONSL_ERROR_INVALID_CODEPOINT;
+        return 0;
+    }
+    return 1;
+}
+
+/* Creates the node of a string with escapes, which are unescaped right into it. */
+static Node *_newUnescapedStringNode(const char *s, size_t len, size_t newlen) {
+    jsonsl_error_t err;
+    char *data;
+    Node *n = NewStringNodeBuffer(newlen, &data);
+    jsonsl_util_unescape(s, data, len, _AllowedEscapes, &err);
+    return n;
+}
+
+/* Pushes a key with escapes, which is unescaped into the key itself or, if it's too long, into a
+ * buffer that the key owns. */
+static void _pushUnescapedKey(_JsonParserContext *ctx, const char *s, size_t len, size_t newlen) {
+    jsonsl_error_t err;
+    _JsonParserKey *k = &ctx->keys[ctx->klen];
+    char *buffer = newlen > sizeof(k->sso) ? ValkeyModule_Alloc(newlen) : NULL;
+    jsonsl_util_unescape(s, buffer ? buffer : k->sso, len, _AllowedEscapes, &err);
+    _pushKey(ctx, buffer ? buffer : k->sso, newlen, buffer);
+}
+
 inline static void popCallback(jsonsl_t jsn, jsonsl_action_t action, struct jsonsl_state_st *state,
                                const jsonsl_char_t *at) {
     _JsonParserContext *jpctx = (_JsonParserContext *)jsn->data;
     const char *pos = jsn->base + state->pos_begin;  // element starting position
     size_t len = state->pos_cur - state->pos_begin;  // element length
 
-    // popping string and key values means addingg them to the node stack
+    // popping string values means adding them to the node stack, keys go to the key stack
     if (JSONSL_T_STRING == state->type || JSONSL_T_HKEY == state->type) {
-        char *buffer = NULL;  // a temporary buffer for unescaped strings
-
         // ignore the quote marks
         pos++;
         len--;
 
-        // deal with escapes
-        if (state->nescapes) {
-            jsonsl_error_t err;
-            size_t newlen;
-
-            buffer = ValkeyModule_Calloc(len, sizeof(char));
-            newlen = jsonsl_util_unescape(pos, buffer, len, _AllowedEscapes, &err);
-            if (!newlen) {
-                ValkeyModule_Free(buffer);
-                errorCallback(jsn, err, state, NULL);
-                return;
-            }
-
-            pos = buffer;
-            len = newlen;
+        // escapes are unescaped straight into the node or the key
+        size_t newlen = len;
+        jsonsl_error_t err;
+        if (state->nescapes && !_unescapedLen(pos, len, &newlen, &err)) {
+            errorCallback(jsn, err, state, NULL);
+            return;
         }
 
-        // push it
-        Node *n;
-        if (JSONSL_T_STRING == state->type)
-            n = NewStringNode(pos, len);
-        else
-            n = NewKeyValNode(pos, len, NULL);  // NULL is a placeholder for now
-        _pushNode(jpctx, n);
-
-        if (buffer) ValkeyModule_Free(buffer);
+        // push it, keys keep referencing the input until set
+        if (JSONSL_T_STRING == state->type) {
+            _pushNode(jpctx, newlen < len ? _newUnescapedStringNode(pos, len, newlen)
+                                          : NewStringNode(pos, len));
+        } else if (newlen < len) {
+            _pushUnescapedKey(jpctx, pos, len, newlen);
+        } else {
+            _pushKey(jpctx, pos, len, NULL);
+        }
     }
 
     // popped special values are also added to the node stack
     if (JSONSL_T_SPECIAL == state->type) {
         if (state->special_flags & JSONSL_SPECIALf_NUMERIC) {
             if (state->special_flags & (JSONSL_SPECIALf_FLOAT | JSONSL_SPECIALf_EXPONENT)) {
-                // convert to double
+                // convert to double, in lieu of "ERR value is not a double or out of range"
                 double value;
-                char *eptr;
-
-                errno = 0;
-                value = strtod(pos, &eptr);
-                // in lieu of "ERR value is not a double or out of range"
-                if ((errno == ERANGE && (value == HUGE_VAL || value == -HUGE_VAL)) ||
-                    (errno != 0 && value == 0) || isnan(value) || (eptr != pos + len)) {
+                if (!JSONNumber_ParseDouble(pos, len, &value)) {
                     errorCallback(jsn, JSONSL_ERROR_INVALID_NUMBER, state, NULL);
                     return;
                 }
+                if (_appendScalar(jpctx, &(Node){.type = N_NUMBER, .value.numval = value})) return;
                 _pushNode(jpctx, NewDoubleNode(value));
             } else {
-                // convert long long (int64_t)
-                long long value;
-                char *eptr;
-
-                errno = 0;
-                value = strtoll(pos, &eptr, 10);
-                // in lieu of "ERR value is not an integer or out of range"
-                if ((errno == ERANGE && (value == LLONG_MAX || value == LLONG_MIN)) ||
-                    (errno != 0 && value == 0) || (eptr != pos + len)) {
+                // convert to int64_t, in lieu of "ERR value is not an integer or out of range"
+                int64_t value;
+                if (!JSONNumber_ParseInt(pos, len, &value)) {
                     errorCallback(jsn, JSONSL_ERROR_INVALID_NUMBER, state, NULL);
                     return;
                 }
 
-                _pushNode(jpctx, NewIntNode((int64_t)value));
+                if (_appendScalar(jpctx, &(Node){.type = N_INTEGER, .value.intval = value})) return;
+                _pushNode(jpctx, NewIntNode(value));
             }
         } else if (state->special_flags & JSONSL_SPECIALf_BOOLEAN) {
-            _pushNode(jpctx, NewBoolNode(state->special_flags & JSONSL_SPECIALf_TRUE));
+            int value = !!(state->special_flags & JSONSL_SPECIALf_TRUE);
+            if (_appendScalar(jpctx, &(Node){.type = N_BOOLEAN, .value.boolval = value})) return;
+            _pushNode(jpctx, NewBoolNode(value));
         } else if (state->special_flags & JSONSL_SPECIALf_NULL) {
             _pushNode(jpctx, NULL);
         }
     }
 
+    // complete arrays of objects that have the same keys are stored as tables, and complete
+    // objects have their duplicate keys resolved
+    if (JSONSL_T_LIST == state->type) Node_ArrayTabulate(jpctx->nodes[jpctx->nlen - 1]);
+    if (JSONSL_T_OBJECT == state->type) Node_DictDedupe(jpctx->nodes[jpctx->nlen - 1]);
+
     // anything that pops needs to be set in its parent, except the root element and keys
     if (jpctx->nlen > 1 && state->type != JSONSL_T_HKEY) {
         NodeType p = jpctx->nodes[jpctx->nlen - 2]->type;
         Node *n = NULL;
         switch (p) {
-            case N_DICT:
+            case N_DICT: {
+                _JsonParserKey *k = &jpctx->keys[jpctx->klen - 1];
                 n = _popNode(jpctx);
-                Node_DictSetKeyVal(jpctx->nodes[jpctx->nlen - 1], n);
-                break;
+                Node_DictAppendLen(jpctx->nodes[jpctx->nlen - 1], k->key, k->len, n);
+                _popKey(jpctx);
+            } break;
             case N_ARRAY:
                 n = _popNode(jpctx);
                 Node_ArrayAppend(jpctx->nodes[jpctx->nlen - 1], n);
                 break;
-            case N_KEYVAL:
-                n = _popNode(jpctx);
-                jpctx->nodes[jpctx->nlen - 1]->value.kvval.val = n;
-                n = _popNode(jpctx);
-                Node_DictSetKeyVal(jpctx->nodes[jpctx->nlen - 1], n);
-                break;
             default:
                 break;
         }
     }
 }
 
+/* === Structural index parser === */
+
+/* Sets a value in the container at the top of the node stack, like popCallback does. */
+static inline void _setValue(_JsonParserContext *ctx, Node *n) {
+    Node *parent = ctx->nodes[ctx->nlen - 1];
+    if (N_DICT == parent->type) {
+        _JsonParserKey *k = &ctx->keys[ctx->klen - 1];
+        Node_DictAppendLen(parent, k->key, k->len, n);
+        _popKey(ctx);
+    } else {
+        Node_ArrayAppend(parent, n);
+    }
+}
+
+/* Validates the string that starts with the quote at pos, and that ends with the one at end. The
+ * string is set to point into the input, and newlen to its length once it's unescaped, which is
+ * shorter if it has escapes. Returns 0 if it isn't strictly valid. */
+static int _indexedString(const char *buf, uint32_t pos, uint32_t end, const char **s, size_t *len,
+                          size_t *newlen) {
+    jsonsl_error_t err;
+    *s = buf + pos + 1;
+    *len = end - pos - 1;
+    return _unescapedLen(*s, *len, newlen, &err);
+}
+
+/* Returns 1 if an atom is a number as in RFC 8259, and sets whether it's an integer. */
+static int _isNumber(const char *atom, size_t len, int *integer) {
+    const unsigned char *s = (const unsigned char *)atom, *e = s + len;
+    if (s < e && '-' == *s) s++;
+    if (s == e) return 0;
+    if ('0' == *s) {
+        s++;
+    } else if (isdigit(*s)) {
+        while (s < e && isdigit(*s)) s++;
+    } else {
+        return 0;
+    }
+
+    *integer = 1;
+    if (s < e && '.' == *s) {
+        *integer = 0;
+        if (++s == e || !isdigit(*s)) return 0;
+        while (s < e && isdigit(*s)) s++;
+    }
+    if (s < e && ('e' == *s || 'E' == *s)) {
+        *integer = 0;
+        if (++s < e && ('-' == *s || '+' == *s)) s++;
+        if (s == e || !isdigit(*s)) return 0;
+        while (s < e && isdigit(*s)) s++;
+    }
+    return s == e;
+}
+
+/* Sets an atom, the literals and numbers, in the container at the top of the node stack. Returns
+ * 0 if it isn't strictly valid or can't be converted. */
+static int _indexedAtom(_JsonParserContext *ctx, const char *s, size_t len) {
+    Node n;
+    int integer;
+    if (4 == len && !memcmp(s, "null", 4)) {
+        _setValue(ctx, NULL);
+        return 1;
+    } else if (4 == len && !memcmp(s, "true", 4)) {
+        n = (Node){.type = N_BOOLEAN, .value.boolval = 1};
+    } else if (5 == len && !memcmp(s, "false", 5)) {
+        n = (Node){.type = N_BOOLEAN, .value.boolval = 0};
+    } else if (!_isNumber(s, len, &integer)) {
+        return 0;
+    } else if (integer) {
+        n = (Node){.type = N_INTEGER};
+        if (!JSONNumber_ParseInt(s, len, &n.value.intval)) return 0;
+    } else {
+        n = (Node){.type = N_NUMBER};
+        if (!JSONNumber_ParseDouble(s, len, &n.value.numval)) return 0;
+    }
+
+    if (_appendScalar(ctx, &n)) return 1;
+    switch (n.type) {
+        case N_BOOLEAN:
+            _setValue(ctx, NewBoolNode(n.value.boolval));
+            break;
+        case N_INTEGER:
+            _setValue(ctx, NewIntNode(n.value.intval));
+            break;
+        default:
+            _setValue(ctx, NewDoubleNode(n.value.numval));
+            break;
+    }
+    return 1;
+}
+
+/* Counts the items of the objects and arrays of a structural index from their commas, and stores
+ * them at the positions of their opening brackets. The counts are only capacities, the structure
+ * is validated while it's parsed. */
+static void _countItems(const char *buf, const uint32_t *idx, size_t n, uint32_t *counts) {
+    uint32_t open[JSONSL_MAX_LEVELS];
+    int depth = 0;
+    for (size_t i = 0; i < n; i++) {
+        switch (buf[idx[i]]) {
+            case '{':
+            case '[':
+                // deeper containers fail to parse anyway
+                if (depth == JSONSL_MAX_LEVELS) return;
+                open[depth++] = i;
+                counts[i] = i + 1 < n && '}' != buf[idx[i + 1]] && ']' != buf[idx[i + 1]];
+                break;
+            case ',':
+                if (depth) counts[open[depth - 1]]++;
+                break;
+            case '}':
+            case ']':
+                if (depth) depth--;
+                break;
+        }
+    }
+}
+
+/* Parses an object or an array from its structural index, and creates the same nodes that jsonsl's
+ * callbacks would, using the parser context's stacks. Returns 0 if the text isn't strictly valid
+ * JSON, after freeing what was created, so jsonsl can parse it and report the error. */
+static int _parseIndexed(JSONObjectCtx *ctx, const char *buf, size_t len, Node **node) {
+    _JsonParserContext *jpctx = ctx->pctx;
+    size_t n, i = 0;
+    uint32_t *idx = JSONIndex_Build(buf, len, ctx->index, &n);
+    if (!idx) return 0;
+
+    // containers are created with room for exactly their items
+    uint32_t *counts = ValkeyModule_Alloc((n + 1) * sizeof(uint32_t));
+    _countItems(buf, idx, n, counts);
+
+    jpctx->nlen = 0;
+    jpctx->klen = 0;
+    if (!n || ('{' != buf[idx[0]] && '[' != buf[idx[0]])) goto fail;
+
+value:
+    if (i == n) goto fail;
+    switch (buf[idx[i]]) {
+        case '{':
+        case '[':
+            if (jpctx->nlen >= ctx->levels - 2) goto fail;
+            if ('{' == buf[idx[i]]) {
+                _pushNode(jpctx, NewDictNode(counts[i]));
+            } else {
+                _pushNode(jpctx, NewArrayNode(counts[i]));
+            }
+            // empty containers close right away
+            if (++i < n && buf[idx[i]] == ('{' == buf[idx[i - 1]] ? '}' : ']')) goto close;
+            if (N_DICT == jpctx->nodes[jpctx->nlen - 1]->type) goto key;
+            goto value;
+        case '"': {
+            const char *s;
+            size_t slen, newlen;
+            if (i + 1 == n || !_indexedString(buf, idx[i], idx[i + 1], &s, &slen, &newlen))
+                goto fail;
+            _setValue(jpctx, newlen < slen ? _newUnescapedStringNode(s, slen, newlen)
+                                           : NewStringNode(s, slen));
+            i += 2;
+        } break;
+        case '}':
+        case ']':
+        case ':':
+        case ',':
+            goto fail;
+        default: {
+            // atoms end before the whitespace that's before the next structural character
+            size_t end = i + 1 < n ? idx[i + 1] : len;
+            while (end > idx[i] && _IsAllowedWhitespace(buf[end - 1])) end--;
+            if (i + 1 == n || !_indexedAtom(jpctx, buf + idx[i], end - idx[i])) goto fail;
+            i++;
+        } break;
+    }
+
+    // a value is followed by a comma or its container's end
+    if (i == n) goto fail;
+    if (',' == buf[idx[i]]) {
+        i++;
+        if (N_DICT == jpctx->nodes[jpctx->nlen - 1]->type) goto key;
+        goto value;
+    }
+    if (buf[idx[i]] != (N_DICT == jpctx->nodes[jpctx->nlen - 1]->type ? '}' : ']')) goto fail;
+
+close:
+    // i is at the end of the container at the top of the node stack
+    i++;
+    if (N_ARRAY == jpctx->nodes[jpctx->nlen - 1]->type) {
+        Node_ArrayTabulate(jpctx->nodes[jpctx->nlen - 1]);
+    } else {
+        Node_DictDedupe(jpctx->nodes[jpctx->nlen - 1]);
+    }
+    if (jpctx->nlen > 1) {
+        Node *c = _popNode(jpctx);
+        _setValue(jpctx, c);
+        if (i == n) goto fail;
+        if (',' == buf[idx[i]]) {
+            i++;
+            if (N_DICT == jpctx->nodes[jpctx->nlen - 1]->type) goto key;
+            goto value;
+        }
+        if (buf[idx[i]] != (N_DICT == jpctx->nodes[jpctx->nlen - 1]->type ? '}' : ']')) goto fail;
+        goto close;
+    }
+
+    // nothing but whitespace may follow the root
+    if (i != n) goto fail;
+    *node = _popNode(jpctx);
+    ValkeyModule_Free(counts);
+    ValkeyModule_Free(idx);
+    return 1;
+
+key:
+    // a key is a string that's followed by a colon
+    if (i + 2 >= n || '"' != buf[idx[i]] || ':' != buf[idx[i + 2]]) goto fail;
+    {
+        const char *s;
+        size_t slen, newlen;
+        if (!_indexedString(buf, idx[i], idx[i + 1], &s, &slen, &newlen)) goto fail;
+        if (newlen < slen) {
+            _pushUnescapedKey(jpctx, s, slen, newlen);
+        } else {
+            _pushKey(jpctx, s, slen, NULL);
+        }
+    }
+    i += 3;
+    goto value;
+
+fail:
+    while (jpctx->nlen) Node_Free(_popNode(jpctx));
+    while (jpctx->klen) _popKey(jpctx);
+    ValkeyModule_Free(counts);
+    ValkeyModule_Free(idx);
+    return 0;
+}
+
 int CreateNodeFromJSON(JSONObjectCtx *ctx, const char *buf, size_t len, Node **node, char **err) {
     size_t _off = 0, _len = len;
     char *_buf = (char *)buf;
@@ -189,6 +504,8 @@ int CreateNodeFromJSON(JSONObjectCtx *ctx, const char *buf, size_t len, Node **n
         _buf[0] = '[';
         _buf[_len - 1] = ']';
         memcpy(&_buf[1], &buf[_off], len - _off);
+    } else if (JSONINDEX_NONE != ctx->index && _off < _len && _parseIndexed(ctx, buf, len, node)) {
+        return JSONOBJECT_OK;
     }
 
     /* Reset all and feed the lexer. */
@@ -216,11 +533,17 @@ int CreateNodeFromJSON(JSONObjectCtx *ctx, const char *buf, size_t len, Node **n
         goto error;
     }
 
+    /* Verify that a scalar isn't followed by more values inside its wrapper. */
+    if (is_scalar && 1 != Node_Length(ctx->pctx->nodes[0])) {
+        serr = sdscatprintf(serr, "ERR JSON lexer error %s after the scalar value",
+                            jsonsl_strerror(JSONSL_ERROR_GARBAGE_TRAILING));
+        goto error;
+    }
+
     /* Finalize. */
     if (is_scalar) {
         // extract the scalar and discard the wrapper array
-        Node_ArrayItem(ctx->pctx->nodes[0], 0, node);
-        Node_ArraySet(ctx->pctx->nodes[0], 0, NULL);
+        *node = Node_ArrayTake(ctx->pctx->nodes[0], 0);
         Node_Free(_popNode(ctx->pctx));
         ValkeyModule_Free(_buf);
     } else {
@@ -237,8 +560,9 @@ error:
         *err = vkmstrndup(serr, strlen(serr));
     }
 
-    // free any nodes that are in the stack
+    // free any nodes and keys that are in the stacks
     while (ctx->pctx->nlen) Node_Free(_popNode(ctx->pctx));
+    while (ctx->pctx->klen) _popKey(ctx->pctx);
 
     // if this is a scalar, we need to release the temporary buffer
     if (is_scalar) ValkeyModule_Free(_buf);
@@ -312,9 +636,34 @@ sds JSONSerialize_String(sds buf, const char *s, size_t len, int noescape) {
     return buf;
 }
 
+sds JSONSerialize_Base64(sds buf, const char *s, size_t len) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)s;
+
+    size_t at = sdslen(buf);
+    buf = sdsMakeRoomFor(buf, (len + 2) / 3 * 4);
+    char *out = buf + at;
+    for (; len >= 3; p += 3, len -= 3) {
+        *out++ = digits[p[0] >> 2];
+        *out++ = digits[(p[0] & 0x03) << 4 | p[1] >> 4];
+        *out++ = digits[(p[1] & 0x0f) << 2 | p[2] >> 6];
+        *out++ = digits[p[2] & 0x3f];
+    }
+    // the last one or two bytes are padded
+    if (len) {
+        *out++ = digits[p[0] >> 2];
+        *out++ = digits[(p[0] & 0x03) << 4 | (len > 1 ? p[1] >> 4 : 0)];
+        *out++ = len > 1 ? digits[(p[1] & 0x0f) << 2] : '=';
+        *out++ = '=';
+    }
+    sdsIncrLen(buf, out - (buf + at));
+    return buf;
+}
+
 inline static void _JSONSerialize_StringValue(Node *n, void *ctx) {
     _JSONBuilderContext *b = (_JSONBuilderContext *)ctx;
-    b->buf = JSONSerialize_String(b->buf, n->value.strval.data, n->value.strval.len, b->noescape);
+    b->buf = JSONSerialize_String(b->buf, NODE_STRDATA(n), NODE_STRLEN(n), b->noescape);
 }
 
 inline static void _JSONSerialize_BeginValue(Node *n, void *ctx) {
@@ -340,15 +689,15 @@ inline static void _JSONSerialize_BeginValue(Node *n, void *ctx) {
             case N_STRING:
                 _JSONSerialize_StringValue(n, b);
                 break;
-            case N_KEYVAL:
-                b->buf = JSONSerialize_String(b->buf, n->value.kvval.key,
-                                              strlen(n->value.kvval.key), b->noescape);
-                b->buf = sdscatfmt(b->buf, ":%s", b->spacestr);
+            case N_BINARY:  // a base64 string
+                b->buf = sdscatlen(b->buf, "\"", 1);
+                b->buf = JSONSerialize_Base64(b->buf, NODE_STRDATA(n), NODE_STRLEN(n));
+                b->buf = sdscatlen(b->buf, "\"", 1);
                 break;
             case N_DICT:
                 b->buf = sdscatlen(b->buf, "{", 1);
                 b->depth++;
-                if (n->value.dictval.len) {
+                if (Node_Length(n)) {
                     b->buf = sdscatsds(b->buf, b->newlinestr);
                     _JSONSerialize_Indent(b);
                 }
@@ -356,12 +705,13 @@ inline static void _JSONSerialize_BeginValue(Node *n, void *ctx) {
             case N_ARRAY:
                 b->buf = sdscatlen(b->buf, "[", 1);
                 b->depth++;
-                if (n->value.arrval.len) {
+                if (n->value.arrval->len) {
                     b->buf = sdscatsds(b->buf, b->newlinestr);
                     _JSONSerialize_Indent(b);
                 }
                 break;
             case N_NULL:  // keeps the compiler from complaining
+            case N_KEYVAL:
                 break;
         }  // switch(n->type)
     }
@@ -372,7 +722,7 @@ inline static void _JSONSerialize_EndValue(Node *n, void *ctx) {
     if (n) {
         switch (n->type) {
             case N_DICT:
-                if (n->value.dictval.len) {
+                if (Node_Length(n)) {
                     b->buf = sdscatsds(b->buf, b->newlinestr);
                 }
                 b->depth--;
@@ -380,7 +730,7 @@ inline static void _JSONSerialize_EndValue(Node *n, void *ctx) {
                 b->buf = sdscatlen(b->buf, "}", 1);
                 break;
             case N_ARRAY:
-                if (n->value.arrval.len) {
+                if (n->value.arrval->len) {
                     b->buf = sdscatsds(b->buf, b->newlinestr);
                 }
                 b->depth--;
@@ -393,15 +743,21 @@ inline static void _JSONSerialize_EndValue(Node *n, void *ctx) {
     }
 }
 
+inline static void _JSONSerialize_Key(const char *key, uint32_t len, void *ctx) {
+    _JSONBuilderContext *b = (_JSONBuilderContext *)ctx;
+    b->buf = JSONSerialize_String(b->buf, key, len, b->noescape);
+    b->buf = sdscatfmt(b->buf, ":%s", b->spacestr);
+}
+
 inline static void _JSONSerialize_ContainerDelimiter(void *ctx) {
     _JSONBuilderContext *b = (_JSONBuilderContext *)ctx;
     b->buf = sdscat(b->buf, b->delimstr);
     _JSONSerialize_Indent(b);
 }
 
-void SerializeNodeToJSON(const Node *node, const JSONSerializeOpt *opt, sds *json) {
-
-    // set up the builder
+/* Sets up a builder that appends to buf, and the callbacks that serialize to it. */
+static _JSONBuilderContext *_JSONBuilder_New(const JSONSerializeOpt *opt, sds buf,
+                                             NodeSerializerOpt *nso) {
     _JSONBuilderContext *b = ValkeyModule_Calloc(1, sizeof(_JSONBuilderContext));
     b->indentstr = opt->indentstr ? sdsnew(opt->indentstr) : sdsempty();
     b->newlinestr = opt->newlinestr ? sdsnew(opt->newlinestr) : sdsempty();
@@ -410,24 +766,48 @@ void SerializeNodeToJSON(const Node *node, const JSONSerializeOpt *opt, sds *jso
     b->delimstr = sdsnewlen(",", 1);
     b->delimstr = sdscat(b->delimstr, b->newlinestr);
     b->noescape = opt->noescape;
+    b->buf = buf;
+
+    *nso = (NodeSerializerOpt){.fBegin = _JSONSerialize_BeginValue,
+                               .xBegin = 0xffff,
+                               .fEnd = _JSONSerialize_EndValue,
+                               .xEnd = (N_DICT | N_ARRAY),
+                               .fDelim = _JSONSerialize_ContainerDelimiter,
+                               .xDelim = (N_DICT | N_ARRAY),
+                               .fKey = _JSONSerialize_Key};
+    return b;
+}
 
-    NodeSerializerOpt nso = {.fBegin = _JSONSerialize_BeginValue,
-                             .xBegin = 0xffff,
-                             .fEnd = _JSONSerialize_EndValue,
-                             .xEnd = (N_DICT | N_ARRAY),
-                             .fDelim = _JSONSerialize_ContainerDelimiter,
-                             .xDelim = (N_DICT | N_ARRAY)};
-
-    // the real work
-    b->buf = *json;
-    Node_Serializer(node, &nso, b);
-    *json = b->buf;
-
+/* Frees a builder, and returns its buffer. */
+static sds _JSONBuilder_Free(_JSONBuilderContext *b) {
+    sds buf = b->buf;
     sdsfree(b->indentstr);
     sdsfree(b->newlinestr);
     sdsfree(b->spacestr);
     sdsfree(b->delimstr);
     ValkeyModule_Free(b);
+    return buf;
+}
+
+void SerializeNodeToJSON(const Node *node, const JSONSerializeOpt *opt, sds *json) {
+    NodeSerializerOpt nso;
+    _JSONBuilderContext *b = _JSONBuilder_New(opt, *json, &nso);
+    Node_Serializer(node, &nso, b);
+    *json = _JSONBuilder_Free(b);
+}
+
+void SerializeCompactToJSON(const char *c, const JSONSerializeOpt *opt, sds *json) {
+    NodeSerializerOpt nso;
+    _JSONBuilderContext *b = _JSONBuilder_New(opt, *json, &nso);
+    Compact_Serializer(c, &nso, b);
+    *json = _JSONBuilder_Free(b);
+}
+
+void SerializeTapeToJSON(const uint64_t *t, const JSONSerializeOpt *opt, sds *json) {
+    NodeSerializerOpt nso;
+    _JSONBuilderContext *b = _JSONBuilder_New(opt, *json, &nso);
+    Tape_Serializer(t, &nso, b);
+    *json = _JSONBuilder_Free(b);
 }
 
 /* JSONObjectContext */
@@ -450,7 +830,9 @@ JSONObjectCtx *NewJSONObjectCtx(int levels) {
     // Parser context setup
     ret->pctx = ValkeyModule_Calloc(1, sizeof(_JsonParserContext));
     ret->pctx->nodes = ValkeyModule_Calloc(ret->levels, sizeof(Node *));
+    ret->pctx->keys = ValkeyModule_Calloc(ret->levels, sizeof(_JsonParserKey));
     ret->parser->data = ret->pctx;
+    ret->index = JSONINDEX_BEST;
 
     return ret;
 }
@@ -460,6 +842,7 @@ void resetJSONObjectCtx(JSONObjectCtx *ctx) {
     jpctx->err = JSONSL_ERROR_SUCCESS;
     jpctx->errpos = 0;
     jpctx->nlen = 0;
+    jpctx->klen = 0;
     ctx->parser->stack[0].nelem = 0;
     jsonsl_reset(ctx->parser);
 }
@@ -467,6 +850,7 @@ void resetJSONObjectCtx(JSONObjectCtx *ctx) {
 void FreeJSONObjectCtx(JSONObjectCtx *ctx) {
     if (ctx) {
         ValkeyModule_Free(ctx->pctx->nodes);
+        ValkeyModule_Free(ctx->pctx->keys);
         ValkeyModule_Free(ctx->pctx);
         jsonsl_destroy(ctx->parser);
         ValkeyModule_Free(ctx);
@@ -25,7 +25,11 @@
 #include <math.h>
 #include <sds.h>
 #include <stdlib.h>
+#include "compact.h"
+#include "json_index.h"
+#include "json_number.h"
 #include "object.h"
+#include "tape.h"
 #include "vkmstrndup.h"
 #include "valkeymodule.h"
 
@@ -34,12 +38,22 @@
 
 #define JSONOBJECT_MAX_ERROR_STRING_LENGTH 256
 
+/* A dictionary key that awaits its value during parsing. */
+typedef struct {
+    const char *key;  // key (points into the input, or to sso or buf when unescaped)
+    size_t len;       // key length
+    char *buf;        // unescaped key buffer, owned by the parser
+    char sso[32];     // short unescaped keys
+} _JsonParserKey;
+
 /* A custom context for the JSON parser. */
 typedef struct {
-    jsonsl_error_t err;  // parser error
-    size_t errpos;       // error position
-    Node **nodes;        // stack of created nodes
-    int nlen;            // size of node stack
+    jsonsl_error_t err;     // parser error
+    size_t errpos;          // error position
+    Node **nodes;           // stack of created nodes
+    int nlen;               // size of node stack
+    _JsonParserKey *keys;   // stack of pending dictionary keys
+    int klen;               // size of key stack
 } _JsonParserContext;
 
 /* A context for JSON objects. */
@@ -47,6 +61,7 @@ typedef struct {
     int levels;                // the maximum number of levels up to JSONSL_MAX_LEVELS, 0 for that
     jsonsl_t parser;           // the parser
     _JsonParserContext *pctx;  // the parser's custom context
+    JSONIndexImpl index;       // how objects and arrays are indexed, JSONINDEX_BEST by default
 } JSONObjectCtx;
 
 JSONObjectCtx *NewJSONObjectCtx(int levels);
@@ -57,6 +72,9 @@ void FreeJSONObjectCtx(JSONObjectCtx *ctx);
  * The resulting object tree is stored in `node` and in case of error the optional `err` is set with
  * the relevant error message.
  *
+ * Objects and arrays are parsed from their structural index if they're strictly valid JSON, and
+ * anything else is parsed by jsonsl, which reports the errors.
+ *
  * Note: the JSONic 'null' is represented internally as NULL, so `node` can be NULL even when the
  *       return code is JSONOBJECT_OK.
  */
@@ -73,5 +91,15 @@ typedef struct {
  * Produces a JSON serialization from an object.
  */
 void SerializeNodeToJSON(const Node *node, const JSONSerializeOpt *opt, sds *json);
+
+/** Produces a JSON serialization from a compactly encoded value, the same as its nodes' */
+void SerializeCompactToJSON(const char *c, const JSONSerializeOpt *opt, sds *json);
+
+/** Produces a JSON serialization from a tape encoded value, the same as its nodes' */
+void SerializeTapeToJSON(const uint64_t *t, const JSONSerializeOpt *opt, sds *json);
+
 sds JSONSerialize_String(sds buf, const char *s, size_t len, int noescape);
+
+/* Appends the standard base64 encoding of binary data to buf, without quotes */
+sds JSONSerialize_Base64(sds buf, const char *s, size_t len);
 #endif
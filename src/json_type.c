@@ -17,6 +17,19 @@
 
 #include "json_type.h"
 #include "cache.h"
+#include "lazyfree.h"
+
+/* The memory that was allocated for nodes as of the last update of a document, everything that was
+ * allocated and released since belongs to the document that is updated next. Like the allocation
+ * counter it is kept per thread, as documents are also freed in the background. */
+static __thread size_t lastAllocated = 0;
+
+long long jsonCompactMaxSize_g = JSONTYPE_COMPACT_MAX_SIZE;
+
+/* The document that is being defragmented over several calls, and where its defragmentation
+ * stopped */
+static JSONType_t *defragDoc = NULL;
+static NodeDefragCursor defragCursor = {0};
 
 void *JSONTypeRdbLoad(ValkeyModuleIO *rdb, int encver) {
     if (encver < 0 || encver > JSONTYPE_ENCODING_VERSION) {
@@ -27,14 +40,128 @@ void *JSONTypeRdbLoad(ValkeyModuleIO *rdb, int encver) {
         return NULL;
     }
 
+    uint64_t flags = encver >= 1 ? ValkeyModule_LoadUnsigned(rdb) : 0;
+
+    // load the document into an arena, small documents are moved back to the heap
     JSONType_t *jt = ValkeyModule_Calloc(1, sizeof(JSONType_t));
+    jt->arena = NewArena(0);
+    Node_SetArena(jt->arena);
     jt->root = ObjectTypeRdbLoad(rdb);
+    Node_SetArena(NULL);
+    JSONTypeUpdate(jt);
+    if (flags & JSONTYPE_F_TAPE) {
+        JSONTypeTape(jt);
+    } else {
+        JSONTypeCompact(jt);
+    }
     return jt;
 }
 
 void JSONTypeRdbSave(ValkeyModuleIO *rdb, void *value) {
     JSONType_t *jt = (JSONType_t *)value;
-    ObjectTypeRdbSave(rdb, jt->root);
+    ValkeyModule_SaveUnsigned(rdb, jt->tape ? JSONTYPE_F_TAPE : 0);
+    if (jt->compact) {
+        ObjectTypeRdbSaveCompact(rdb, jt->compact);
+    } else if (jt->tape) {
+        ObjectTypeRdbSaveTape(rdb, jt->tape);
+    } else {
+        ObjectTypeRdbSave(rdb, jt->root);
+    }
+}
+
+/* An object or array that the AOF rewrite is in while it looks for binary values */
+typedef struct {
+    size_t pathlen;  // the length of the container's path
+    int64_t index;   // the index of an array's next item, or -1 in objects
+} _AofLevel;
+
+typedef struct {
+    ValkeyModuleIO *aof;
+    ValkeyModuleString *key;
+    sds path;
+    const char *k;  // the key of an object's next value
+    uint32_t klen;
+    _AofLevel *levels;
+    int depth;
+} _AofBinaries;
+
+/* Appends an object's key to a path, returns 0 if the path syntax can't express it. */
+static int appendPathKey(sds *path, const char *k, uint32_t klen) {
+    // a key ends at a quote that is followed by a bracket, so it's quoted with the other kind
+    int dquote = 0, squote = 0;
+    for (uint32_t i = 0; i + 1 < klen; i++) {
+        if (']' != k[i + 1]) continue;
+        if ('"' == k[i]) dquote = 1;
+        if ('\'' == k[i]) squote = 1;
+    }
+    if ((dquote && squote) || memchr(k, '\0', klen)) return 0;
+
+    const char *quote = dquote ? "'" : "\"";
+    *path = sdscatfmt(*path, "[%s", quote);
+    *path = sdscatlen(*path, k, klen);
+    *path = sdscatfmt(*path, "%s]", quote);
+    return 1;
+}
+
+static void aofBinariesBegin(Node *n, void *ctx) {
+    _AofBinaries *b = ctx;
+
+    // a value's path is its container's followed by its index or key
+    int found = 1;
+    if (b->depth) {
+        _AofLevel *l = &b->levels[b->depth - 1];
+        sdsIncrLen(b->path, (int)l->pathlen - (int)sdslen(b->path));
+        if (l->index >= 0) {
+            b->path = sdscatfmt(b->path, "[%I]", l->index++);
+        } else {
+            found = appendPathKey(&b->path, b->k, b->klen);
+        }
+    }
+
+    if (n && n->type & (N_DICT | N_ARRAY)) {
+        b->levels = ValkeyModule_Realloc(b->levels, (b->depth + 1) * sizeof(_AofLevel));
+        b->levels[b->depth++] = (_AofLevel){sdslen(b->path), N_ARRAY == n->type ? 0 : -1};
+    } else if (n && N_BINARY == n->type) {
+        if (!found) {
+            ValkeyModule_LogIOError(b->aof, VKM_LOGLEVEL_WARNING,
+                                    "A binary value can't be addressed by a path, it is rewritten "
+                                    "as a base64 string");
+            return;
+        }
+        ValkeyModule_EmitAOF(b->aof, "JSON.SETBIN", "scb", b->key,
+                             sdslen(b->path) ? b->path : OBJECT_ROOT_PATH, NODE_STRDATA(n),
+                             (size_t)NODE_STRLEN(n));
+    }
+}
+
+static void aofBinariesKey(const char *key, uint32_t len, void *ctx) {
+    _AofBinaries *b = ctx;
+    b->k = key;
+    b->klen = len;
+}
+
+static void aofBinariesEnd(Node *n, void *ctx) {
+    _AofBinaries *b = ctx;
+    b->depth--;
+}
+
+/* Emits a JSON.SETBIN for every binary value of a document, which its JSON has as a base64 string */
+static void aofRewriteBinaries(ValkeyModuleIO *aof, ValkeyModuleString *key, JSONType_t *jt) {
+    _AofBinaries b = {.aof = aof, .key = key, .path = sdsempty()};
+    NodeSerializerOpt nso = {.fBegin = aofBinariesBegin,
+                             .xBegin = 0xffff,
+                             .fEnd = aofBinariesEnd,
+                             .xEnd = (N_DICT | N_ARRAY),
+                             .fKey = aofBinariesKey};
+    if (jt->compact) {
+        Compact_Serializer(jt->compact, &nso, &b);
+    } else if (jt->tape) {
+        Tape_Serializer(jt->tape, &nso, &b);
+    } else {
+        Node_Serializer(jt->root, &nso, &b);
+    }
+    ValkeyModule_Free(b.levels);
+    sdsfree(b.path);
 }
 
 void JSONTypeAofRewrite(ValkeyModuleIO *aof, ValkeyModuleString *key, void *value) {
@@ -47,9 +174,23 @@ void JSONTypeAofRewrite(ValkeyModuleIO *aof, ValkeyModuleString *key, void *valu
     // serialize it
     JSONSerializeOpt jsopt = {.indentstr = "", .newlinestr = "", .spacestr = ""};
     sds json = sdsempty();
-    SerializeNodeToJSON(jt->root, &jsopt, &json);
-    ValkeyModule_EmitAOF(aof, "JSON.SET", "scb", key, OBJECT_ROOT_PATH, json, sdslen(json));
+    if (jt->compact) {
+        SerializeCompactToJSON(jt->compact, &jsopt, &json);
+    } else if (jt->tape) {
+        SerializeTapeToJSON(jt->tape, &jsopt, &json);
+    } else {
+        SerializeNodeToJSON(jt->root, &jsopt, &json);
+    }
+    if (jt->tape) {
+        ValkeyModule_EmitAOF(aof, "JSON.SET", "scbcc", key, OBJECT_ROOT_PATH, json, sdslen(json),
+                             "ENCODING", "TAPE");
+    } else {
+        ValkeyModule_EmitAOF(aof, "JSON.SET", "scb", key, OBJECT_ROOT_PATH, json, sdslen(json));
+    }
     sdsfree(json);
+
+    // JSON has no binary values, so they are set again (which decodes tape documents)
+    aofRewriteBinaries(aof, key, jt);
 }
 
 void JSONTypeFree(void *value) {
@@ -58,15 +199,237 @@ void JSONTypeFree(void *value) {
         if (jt->lruEntries) {
             LruCache_ClearKey(&jsonLruCache_g, jt);
         }
+        // the document's memory isn't part of the change that is accounted for by the next update
+        size_t allocated = Node_Allocated();
         Node_Free(jt->root);
+        lastAllocated -= allocated - Node_Allocated();
+        if (jt->arena) {
+            Node_ArenaReleased();  // the entire arena is freed anyway
+            Arena_Free(jt->arena);
+        }
+        ValkeyModule_Free(jt->compact);
+        ValkeyModule_Free(jt->tape);
+        LazyFree_Abandon(&jt->freeing);
         ValkeyModule_Free(jt);
     }
 }
 
+size_t JSONTypeFreeEffort(ValkeyModuleString *key, const void *value) {
+    const JSONType_t *jt = (JSONType_t *)value;
+    // encoded documents are a single allocation
+    return jt->compact || jt->tape ? 1 : LAZYFREE_EFFORT(jt->memory);
+}
+
+void JSONTypeUnlink(ValkeyModuleString *key, const void *value) {
+    // the cache isn't thread safe, so it is cleared before the document is freed in the background
+    JSONType_t *jt = (JSONType_t *)value;
+    if (jt->lruEntries) {
+        LruCache_ClearKey(&jsonLruCache_g, jt);
+    }
+}
+
+static void *defragMove(void *ctx, void *ptr) { return ValkeyModule_DefragAlloc(ctx, ptr); }
+
+static int defragShouldStop(void *ctx) { return ValkeyModule_DefragShouldStop(ctx); }
+
+int JSONTypeDefrag(ValkeyModuleDefragCtx *ctx, ValkeyModuleString *key, void **value) {
+    // the document is resumed by the pointer that it was left at, before it is moved again
+    JSONType_t *jt = *value, *doc = jt;
+    void *moved = ValkeyModule_DefragAlloc(ctx, jt);
+    if (moved) {
+        *value = jt = moved;
+        for (LruPathEntry *e = jt->lruEntries; e; e = e->key_next) e->parent = jt;
+    }
+
+    // big documents are defragmented over several calls, start over unless this one is resumed
+    unsigned long cursor = 0;
+    ValkeyModule_DefragCursorGet(ctx, &cursor);
+    if (!cursor || defragDoc != doc) defragCursor.depth = 0;
+
+    if (jt->compact) {
+        if ((moved = ValkeyModule_DefragAlloc(ctx, jt->compact))) jt->compact = moved;
+        return 0;
+    }
+    if (jt->tape) {
+        if ((moved = ValkeyModule_DefragAlloc(ctx, jt->tape))) jt->tape = moved;
+        return 0;
+    }
+
+    if (Node_Defrag(&jt->root, &defragCursor, defragMove, defragShouldStop, ctx)) {
+        defragDoc = NULL;
+        return 0;
+    }
+    defragDoc = jt;
+    ValkeyModule_DefragCursorSet(ctx, cursor + 1);
+    return 1;
+}
+
+void JSONTypeDefragGlobals(ValkeyModuleDefragCtx *ctx) {
+    KeyTable *kt = VALKEYJSON_KEYTABLE_GLOBAL;
+    ShapeTable *st = VALKEYJSON_SHAPETABLE_GLOBAL;
+    void *moved;
+
+    // keys and shapes are referenced by all the documents so they stay in place, but the tables'
+    // buckets and the shapes' indexes are only referenced by the tables
+    pthread_mutex_lock(&kt->lock);
+    if (kt->buckets && (moved = ValkeyModule_DefragAlloc(ctx, kt->buckets))) kt->buckets = moved;
+    pthread_mutex_unlock(&kt->lock);
+
+    pthread_mutex_lock(&st->lock);
+    if (st->buckets && (moved = ValkeyModule_DefragAlloc(ctx, st->buckets))) st->buckets = moved;
+    for (size_t i = 0; i < st->nbuckets; i++) {
+        for (t_shape *s = st->buckets[i]; s; s = s->next) {
+            if (s->index && (moved = ValkeyModule_DefragAlloc(ctx, s->index))) s->index = moved;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
 size_t JSONTypeMemoryUsage(const void *value) {
     const JSONType_t *jt = (JSONType_t *)value;
-    size_t memory = sizeof(JSONType_t);
+    size_t memory = sizeof(JSONType_t) + jt->memory;
 
-    memory += ObjectTypeMemoryUsage(jt->root);
+    // account for the arena's overhead and unused space
+    if (jt->arena) {
+        memory += sizeof(Arena) + jt->arena->size - (jt->arena->used - jt->arena->dead);
+    }
     return memory;
 }
+
+/* Accounts for the arena memory that was released by the last change to the document, and compacts
+ * the document if needed. */
+static void arenaUpdate(JSONType_t *jt) {
+    size_t released = Node_ArenaReleased();
+    if (!jt->arena) return;
+
+    Arena *a = jt->arena;
+    a->dead += released;
+
+    // small documents aren't worth an arena, and fragmented ones are copied to a new one
+    int toheap = a->used - a->dead < JSONTYPE_ARENA_MIN_SIZE;
+    if (!toheap && a->dead < a->used * JSONTYPE_ARENA_MAX_DEAD_RATIO) return;
+
+    Arena *compacted = toheap ? NULL : NewArena(a->used - a->dead);
+    Node_SetArena(compacted);
+    Node *root = Node_Clone(jt->root);
+    Node_SetArena(NULL);
+
+    Node_Free(jt->root);
+    Node_ArenaReleased();
+    Arena_Free(a);
+
+    jt->root = root;
+    jt->arena = compacted;
+}
+
+void JSONTypeSettle(JSONType_t *jt) {
+    // the freed memory isn't part of the change that is accounted for by the next update
+    size_t freed = LazyFree_Settle(&jt->freeing);
+    lastAllocated -= freed;
+    jt->memory -= freed;
+}
+
+void JSONTypeUpdate(JSONType_t *jt) {
+    JSONTypeSettle(jt);
+    arenaUpdate(jt);
+
+    size_t allocated = Node_Allocated();
+    jt->memory += allocated - lastAllocated;
+    lastAllocated = allocated;
+    jt->changes++;
+    jt->optimized = 0;
+}
+
+/* Frees the nodes of a document that was encoded, whose encoding takes size bytes. */
+static void freeEncodedTree(JSONType_t *jt, void *p, size_t size) {
+    // the nodes' memory isn't part of the change that is accounted for by the next update
+    size_t allocated = Node_Allocated();
+    Node_Free(jt->root);
+    lastAllocated -= allocated - Node_Allocated();
+    if (jt->arena) {
+        Node_ArenaReleased();
+        Arena_Free(jt->arena);
+    }
+    LazyFree_Abandon(&jt->freeing);
+
+    jt->root = NULL;
+    jt->arena = NULL;
+    jt->memory = Node_AllocSize(p, size, 0);
+}
+
+void JSONTypeCompact(JSONType_t *jt) {
+    size_t len;
+    char *compact = Compact_Encode(jt->root, jsonCompactMaxSize_g, &len);
+    if (!compact) return;
+
+    freeEncodedTree(jt, compact, len);
+    jt->compact = compact;
+}
+
+void JSONTypeTape(JSONType_t *jt) {
+    size_t len;
+    uint64_t *tape = Tape_Encode(jt->root, &len);
+    freeEncodedTree(jt, tape, len * sizeof(uint64_t));
+    jt->tape = tape;
+}
+
+void JSONTypeOptimize(JSONType_t *jt) {
+    Node_Optimize(jt->root);
+    JSONTypeUpdate(jt);
+    JSONTypeCompact(jt);
+    jt->changes = 0;
+    jt->optimized = 1;
+}
+
+Node *JSONTypeTree(JSONType_t *jt) {
+    if (jt->compact) {
+        jt->root = Compact_Decode(jt->compact);
+        ValkeyModule_Free(jt->compact);
+        jt->compact = NULL;
+    } else if (jt->tape) {
+        // big documents are decoded into an arena, like they are parsed
+        size_t size = Tape_Size(jt->tape) * sizeof(uint64_t);
+        jt->arena = size >= JSONTYPE_ARENA_MIN_SIZE ? NewArena(size * 2) : NULL;
+        Node_SetArena(jt->arena);
+        jt->root = Tape_Decode(jt->tape);
+        Node_SetArena(NULL);
+        ValkeyModule_Free(jt->tape);
+        jt->tape = NULL;
+    } else {
+        return jt->root;
+    }
+
+    // the decoded nodes are accounted for by the update, instead of the encoding
+    jt->memory = 0;
+    JSONTypeUpdate(jt);
+    return jt->root;
+}
+
+void JSONTypeFreeValue(JSONType_t *jt, Node *n) {
+    // scalars are freed right away, and so are arena nodes as the arena may be compacted
+    if (!n || jt->arena || (N_ARRAY != n->type && N_DICT != n->type)) {
+        Node_Free(n);
+        return;
+    }
+    LazyFree_FreeValue(n, &jt->freeing);
+}
+
+void JSONTypeClear(JSONType_t *jt) {
+    if (jt->compact || jt->tape) {
+        ValkeyModule_Free(jt->compact);
+        ValkeyModule_Free(jt->tape);
+        jt->compact = NULL;
+        jt->tape = NULL;
+        jt->memory = 0;
+        return;
+    }
+
+    // the document's memory isn't part of the change that is accounted for by the next update, and
+    // it still includes the values that are being freed
+    LazyFree_Abandon(&jt->freeing);
+    lastAllocated -= jt->memory;
+    LazyFree_Free(jt->root, jt->arena, jt->memory);
+    jt->root = NULL;
+    jt->arena = NULL;
+    jt->memory = 0;
+}
@@ -23,7 +23,8 @@
 #include "json_object.h"
 #include "valkeymodule.h"
 
-#define JSONTYPE_ENCODING_VERSION 0
+/* Version 1 saves flags before the document, and version 2 may have binary values */
+#define JSONTYPE_ENCODING_VERSION 2
 #define JSONTYPE_NAME "ValkeyJSON"
 
 #define VKM_LOGLEVEL_WARNING "warning"
@@ -31,11 +32,34 @@
 #define OBJECT_ROOT_PATH "."
 
 struct LruPathEntry;
+struct LazyFreeJob;
+
+/* Documents that are at least this big are built in an arena */
+#define JSONTYPE_ARENA_MIN_SIZE 1024
+
+/* An arena is compacted once at least this fraction of its allocations was released */
+#define JSONTYPE_ARENA_MAX_DEAD_RATIO 0.5
+
+/* Documents whose compact encoding takes at most this many bytes are kept encoded by default */
+#define JSONTYPE_COMPACT_MAX_SIZE 512
+
+/* The maximal size of compact documents, set by the compact-max-size config */
+extern long long jsonCompactMaxSize_g;
+
+/* Flags that are saved before the document since encoding version 1 */
+#define JSONTYPE_F_TAPE 0x1  // the document is kept in the tape encoding
 
 /* A wrapper for a JSON value. */
 typedef struct JSONType_t {
     Node *root;
+    Arena *arena;   // the arena the document was built in, NULL if it is on the heap
+    char *compact;  // the document's compact encoding, in which case it has no root nor arena
+    uint64_t *tape;  // the document's tape encoding, which it was set with, instead of a root
+    size_t memory;  // the memory that the document's nodes or encoding take, as of its last update
+    uint32_t changes;   // the number of updates since the daemon last visited the document
+    uint8_t optimized;  // the document wasn't changed since the daemon optimized it
     struct LruPathEntry *lruEntries;
+    struct LazyFreeJob *freeing;  // values that are freed in the background and aren't settled yet
 } JSONType_t;
 
 void *JSONTypeRdbLoad(ValkeyModuleIO *rdb, int encver);
@@ -43,5 +67,51 @@ void JSONTypeRdbSave(ValkeyModuleIO *rdb, void *value);
 void JSONTypeAofRewrite(ValkeyModuleIO *aof, ValkeyModuleString *key, void *value);
 void JSONTypeFree(void *value);
 size_t JSONTypeMemoryUsage(const void *value);
+size_t JSONTypeFreeEffort(ValkeyModuleString *key, const void *value);
+void JSONTypeUnlink(ValkeyModuleString *key, const void *value);
+int JSONTypeDefrag(ValkeyModuleDefragCtx *ctx, ValkeyModuleString *key, void **value);
+
+/** Defragments the module-wide tables of keys and shapes */
+void JSONTypeDefragGlobals(ValkeyModuleDefragCtx *ctx);
+
+/**
+* Accounts for the memory that was allocated and released by the last change to the document, which
+* must be called after every change. When the document's arena is fragmented enough, the document
+* is compacted into a new arena, and small documents are moved to the heap.
+*/
+void JSONTypeUpdate(JSONType_t *jt);
+
+/** Deducts the memory of the document's values that were freed in the background since */
+void JSONTypeSettle(JSONType_t *jt);
+
+/**
+* Frees a value that was removed from the document, in the background if it is big. Values of
+* documents that have an arena are always freed right away, as the arena may be compacted.
+*/
+void JSONTypeFreeValue(JSONType_t *jt, Node *n);
+
+/**
+* Converts a document that was updated to its compact encoding, if it is small enough. The
+* document's nodes are freed, so no references to them may be kept.
+*/
+void JSONTypeCompact(JSONType_t *jt);
+
+/**
+* Converts a document that was updated to the tape encoding, regardless of its size. The document's
+* nodes are freed, so no references to them may be kept.
+*/
+void JSONTypeTape(JSONType_t *jt);
+
+/**
+* Re-encodes the nodes of a document that isn't encoded in the way that takes the least memory, and
+* then converts it to its compact encoding if it is small enough.
+*/
+void JSONTypeOptimize(JSONType_t *jt);
+
+/** Returns the document's root, which is decoded first if the document is encoded */
+Node *JSONTypeTree(JSONType_t *jt);
+
+/** Frees the document's root and arena, in the background if it is big, and empties it */
+void JSONTypeClear(JSONType_t *jt);
 
 #endif
@@ -0,0 +1,140 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "keytable.h"
+#include "valkeymodule.h"
+
+// Extern
+KeyTable jsonKeyTable_g = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+uint32_t KeyTable_Hash(const char *key, uint32_t len) {
+    uint32_t h = 2166136261u;
+    while (len--) {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static t_key *findKey(KeyTable *kt, const char *key, uint32_t len, uint32_t hash) {
+    if (!kt->nbuckets) return NULL;
+
+    for (t_key *k = kt->buckets[hash & (kt->nbuckets - 1)]; k; k = k->next) {
+        if (k->hash == hash && k->len == len && !memcmp(k->data, key, len)) return k;
+    }
+    return NULL;
+}
+
+// Rehash the keys to twice the buckets (or the initial number of buckets)
+static void growTable(KeyTable *kt) {
+    size_t nbuckets = kt->nbuckets ? kt->nbuckets * 2 : KEYTABLE_INITIAL_BUCKETS;
+    t_key **buckets = ValkeyModule_Calloc(nbuckets, sizeof(t_key *));
+
+    for (size_t i = 0; i < kt->nbuckets; i++) {
+        t_key *k = kt->buckets[i];
+        while (k) {
+            t_key *next = k->next;
+            size_t b = k->hash & (nbuckets - 1);
+            k->next = buckets[b];
+            buckets[b] = k;
+            k = next;
+        }
+    }
+
+    if (kt->buckets) ValkeyModule_Free(kt->buckets);
+    kt->buckets = buckets;
+    kt->nbuckets = nbuckets;
+}
+
+t_key *KeyTable_Find(KeyTable *kt, const char *key, uint32_t len) {
+    uint32_t hash = KeyTable_Hash(key, len);
+    pthread_mutex_lock(&kt->lock);
+    t_key *k = findKey(kt, key, len, hash);
+    pthread_mutex_unlock(&kt->lock);
+    return k;
+}
+
+t_key *KeyTable_FindRetain(KeyTable *kt, const char *key, uint32_t len) {
+    uint32_t hash = KeyTable_Hash(key, len);
+    pthread_mutex_lock(&kt->lock);
+    t_key *k = findKey(kt, key, len, hash);
+    if (k) k->refcount++;
+    pthread_mutex_unlock(&kt->lock);
+    return k;
+}
+
+t_key *KeyTable_Intern(KeyTable *kt, const char *key, uint32_t len) {
+    uint32_t hash = KeyTable_Hash(key, len);
+    pthread_mutex_lock(&kt->lock);
+    t_key *k = findKey(kt, key, len, hash);
+
+    kt->lookups++;
+    if (k) {
+        kt->hits++;
+        k->refcount++;
+        pthread_mutex_unlock(&kt->lock);
+        return k;
+    }
+
+    // keep the load factor under 1
+    if (kt->numKeys >= kt->nbuckets) growTable(kt);
+
+    k = ValkeyModule_Alloc(sizeof(t_key) + len + 1);
+    k->refcount = 1;
+    k->hash = hash;
+    k->len = len;
+    memcpy(k->data, key, len);
+    k->data[len] = '\0';
+
+    size_t b = hash & (kt->nbuckets - 1);
+    k->next = kt->buckets[b];
+    kt->buckets[b] = k;
+    kt->numKeys++;
+    kt->numBytes += KEY_ALLOC_SIZE(k);
+
+    pthread_mutex_unlock(&kt->lock);
+    return k;
+}
+
+t_key *KeyTable_Retain(KeyTable *kt, t_key *k) {
+    pthread_mutex_lock(&kt->lock);
+    kt->lookups++;
+    kt->hits++;
+    k->refcount++;
+    pthread_mutex_unlock(&kt->lock);
+    return k;
+}
+
+void KeyTable_Release(KeyTable *kt, t_key *k) {
+    pthread_mutex_lock(&kt->lock);
+    if (--k->refcount) {
+        pthread_mutex_unlock(&kt->lock);
+        return;
+    }
+
+    // unlink the key from its bucket
+    t_key **pk = &kt->buckets[k->hash & (kt->nbuckets - 1)];
+    while (*pk != k) pk = &(*pk)->next;
+    *pk = k->next;
+
+    kt->numKeys--;
+    kt->numBytes -= KEY_ALLOC_SIZE(k);
+    pthread_mutex_unlock(&kt->lock);
+    ValkeyModule_Free(k);
+}
@@ -0,0 +1,85 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KEYTABLE_H__
+#define __KEYTABLE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* An interned key of an object.
+* Keys are length-prefixed so they are binary safe, the data is also NULL terminated for convenience.
+* Every key name is stored once in the module-wide key table and is shared by all the dictionaries
+* that use it, so two keys are equal if and only if they are the same pointer.
+*/
+typedef struct t_key {
+    struct t_key *next;  // next key in the table's bucket
+    uint32_t refcount;   // number of dictionary entries that use the key
+    uint32_t hash;
+    uint32_t len;
+    char data[];
+} t_key;
+
+/* The allocation size of an interned key */
+#define KEY_ALLOC_SIZE(k) (sizeof(t_key) + (k)->len + 1)
+
+/*
+* A refcounted intern table of keys, implemented as a chained hash table.
+*/
+typedef struct {
+    t_key **buckets;
+    size_t nbuckets;  // always a power of 2
+    size_t numKeys;   // number of unique keys in the table
+    size_t numBytes;  // number of bytes used by the keys
+
+    // statistics
+    size_t lookups;  // number of interning requests
+    size_t hits;     // number of interning requests that were satisfied by an existing key
+    // documents are also freed by background threads, which release their keys
+    pthread_mutex_t lock;
+} KeyTable;
+
+#define KEYTABLE_INITIAL_BUCKETS 256
+
+extern KeyTable jsonKeyTable_g;
+#define VALKEYJSON_KEYTABLE_GLOBAL (&jsonKeyTable_g)
+
+/* The hash function of keys (FNV-1a) */
+uint32_t KeyTable_Hash(const char *key, uint32_t len);
+
+/* Finds an interned key, returns NULL if no dictionary uses that key. Does not change refcounts. */
+t_key *KeyTable_Find(KeyTable *kt, const char *key, uint32_t len);
+
+/*
+* Finds an interned key and returns a reference to it, or NULL if no dictionary uses that key. The
+* reference keeps the key from being freed by other threads until it is released.
+*/
+t_key *KeyTable_FindRetain(KeyTable *kt, const char *key, uint32_t len);
+
+/* Returns a reference to the interned key, adding it to the table if needed. */
+t_key *KeyTable_Intern(KeyTable *kt, const char *key, uint32_t len);
+
+/* Returns another reference to an interned key. */
+t_key *KeyTable_Retain(KeyTable *kt, t_key *k);
+
+/* Releases a reference to an interned key, the last one removes it from the table. */
+void KeyTable_Release(KeyTable *kt, t_key *k);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include "lazyfree.h"
+#include "valkeymodule.h"
+
+/* A value that is waiting to be freed, which its owner (if it has one) settles once it is done */
+struct LazyFreeJob {
+    struct LazyFreeJob *next;
+    struct LazyFreeJob *sibling;  // the owner's next job
+    Node *n;
+    Arena *arena;
+    size_t freed;  // the memory that freeing the value released, set once it is done
+    int owned;     // the job is freed by its owner, who hasn't let go of it yet
+    int done;
+};
+
+/* The queue of values, which the background thread frees in order */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static LazyFreeJob *head = NULL;
+static LazyFreeJob **tail = &head;
+static size_t pending = 0;  // number of values that are queued or being freed
+
+/* The thread is started with the first big value, values are freed right away if it can't be */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int running = 0;
+
+static void freeValue(Node *n, Arena *a) {
+    Node_Free(n);
+    if (a) {
+        Node_ArenaReleased();  // the entire arena is freed anyway
+        Arena_Free(a);
+    }
+}
+
+static void *lazyFreeMain(void *arg) {
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!head) pthread_cond_wait(&queued, &lock);
+        LazyFreeJob *job = head;
+        head = job->next;
+        if (!head) tail = &head;
+        pthread_mutex_unlock(&lock);
+
+        // the thread's own count of allocated memory measures what the value took
+        size_t allocated = Node_Allocated();
+        freeValue(job->n, job->arena);
+        size_t freed = allocated - Node_Allocated();
+
+        pthread_mutex_lock(&lock);
+        job->freed = freed;
+        job->done = 1;
+        if (!job->owned) ValkeyModule_Free(job);
+        if (!--pending) pthread_cond_broadcast(&drained);
+    }
+    return NULL;
+}
+
+static void startThread(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, lazyFreeMain, NULL)) return;
+    pthread_detach(thread);
+    running = 1;
+}
+
+/* Queues a value to be freed by the thread, returns NULL if it isn't running */
+static LazyFreeJob *queueValue(Node *n, Arena *a, int owned) {
+    pthread_once(&once, startThread);
+    if (!running) return NULL;
+
+    LazyFreeJob *job = ValkeyModule_Calloc(1, sizeof(LazyFreeJob));
+    job->n = n;
+    job->arena = a;
+    job->owned = owned;
+
+    pthread_mutex_lock(&lock);
+    *tail = job;
+    tail = &job->next;
+    pending++;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+    return job;
+}
+
+void LazyFree_Free(Node *n, Arena *a, size_t memory) {
+    if (LAZYFREE_EFFORT(memory) < LAZYFREE_THRESHOLD) {
+        freeValue(n, a);
+        return;
+    }
+
+    if (!queueValue(n, a, 0)) {
+        freeValue(n, a);
+        return;
+    }
+    Node_HandOff(memory);
+}
+
+void LazyFree_FreeValue(Node *n, LazyFreeJob **jobs) {
+    // small values are measured on the way, big ones by the thread as it frees them
+    if (LAZYFREE_EFFORT(Node_MemoryUsageUpTo(n, LAZYFREE_THRESHOLD * sizeof(Node))) <
+        LAZYFREE_THRESHOLD) {
+        Node_Free(n);
+        return;
+    }
+
+    LazyFreeJob *job = queueValue(n, NULL, 1);
+    if (!job) {
+        Node_Free(n);
+        return;
+    }
+    job->sibling = *jobs;
+    *jobs = job;
+}
+
+size_t LazyFree_Settle(LazyFreeJob **jobs) {
+    if (!*jobs) return 0;
+
+    size_t freed = 0;
+    pthread_mutex_lock(&lock);
+    while (*jobs) {
+        LazyFreeJob *job = *jobs;
+        if (job->done) {
+            freed += job->freed;
+            *jobs = job->sibling;
+            ValkeyModule_Free(job);
+        } else {
+            jobs = &job->sibling;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    Node_HandOff(freed);
+    return freed;
+}
+
+void LazyFree_Abandon(LazyFreeJob **jobs) {
+    if (!*jobs) return;
+
+    // jobs that are still pending are freed by the thread once it is done with them
+    pthread_mutex_lock(&lock);
+    while (*jobs) {
+        LazyFreeJob *job = *jobs;
+        *jobs = job->sibling;
+        if (job->done) {
+            ValkeyModule_Free(job);
+        } else {
+            job->owned = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+size_t LazyFree_Pending(void) {
+    pthread_mutex_lock(&lock);
+    size_t ret = pending;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void LazyFree_Wait(void) {
+    pthread_mutex_lock(&lock);
+    while (pending) pthread_cond_wait(&drained, &lock);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,65 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LAZYFREE_H__
+#define __LAZYFREE_H__
+
+#include <stddef.h>
+#include "arena.h"
+#include "object.h"
+
+/* Values that take fewer allocations than this to free are freed right away, as in Valkey */
+#define LAZYFREE_THRESHOLD 64
+
+/* Estimates the number of allocations that freeing a value takes from its memory usage, which is
+ * an upper bound as every node takes at least that much */
+#define LAZYFREE_EFFORT(memory) ((memory) / sizeof(Node))
+
+/* A big value that is being freed on behalf of a document */
+typedef struct LazyFreeJob LazyFreeJob;
+
+/**
+* Frees a value that was detached from its document, and the arena that it was allocated from (if
+* any). Big values are queued to be freed by a background thread, small ones are freed right away.
+* Either way, memory is the value's memory usage and is deducted from Node_Allocated.
+*/
+void LazyFree_Free(Node *n, Arena *a, size_t memory);
+
+/**
+* Frees a value that was removed from a document, without measuring all of it first. Small values
+* are freed right away. Big ones are queued to be freed by a background thread, which measures them
+* as it goes, and their jobs are added to the document's jobs until it settles them.
+*/
+void LazyFree_FreeValue(Node *n, LazyFreeJob **jobs);
+
+/**
+* Removes the jobs whose values were freed since the last call, and returns the memory that those
+* values took, which is deducted from Node_Allocated.
+*/
+size_t LazyFree_Settle(LazyFreeJob **jobs);
+
+/* Lets go of the jobs of a document whose memory is accounted for otherwise */
+void LazyFree_Abandon(LazyFreeJob **jobs);
+
+/* Returns the number of values that are queued to be freed */
+size_t LazyFree_Pending(void);
+
+/* Waits until all the values that were queued so far are freed */
+void LazyFree_Wait(void);
+
+#endif
@@ -17,18 +17,146 @@
 
 #include "object.h"
 
+/* The arena that new nodes are allocated from, NULL for the heap */
+static Arena *__arena = NULL;
+
+/* Number of arena bytes that were released by freeing nodes, the counters are kept per thread as
+ * documents are also freed in the background */
+static __thread size_t __arenaReleased = 0;
+
+/* Net number of bytes that are allocated for nodes and their data, as counted by Node_AllocSize */
+static __thread size_t __allocated = 0;
+
+void Node_SetArena(Arena *a) { __arena = a; }
+
+size_t Node_ArenaReleased(void) {
+    size_t ret = __arenaReleased;
+    __arenaReleased = 0;
+    return ret;
+}
+
+size_t Node_Allocated(void) { return __allocated; }
+
+void Node_HandOff(size_t memory) { __allocated -= memory; }
+
+size_t Node_AllocSize(const void *p, size_t size, int arena) {
+    if (arena) return ARENA_ALIGN(size);
+    return ValkeyModule_MallocSize ? ValkeyModule_MallocSize((void *)p) : size;
+}
+
 Node *__newNode(NodeType t) {
-    Node *ret = ValkeyModule_Calloc(1, sizeof(Node));
+    Node *ret;
+    if (__arena) {
+        ret = Arena_Alloc(__arena, sizeof(Node));
+        ret->flags = NODE_F_ARENA;
+    } else {
+        ret = ValkeyModule_Calloc(1, sizeof(Node));
+    }
+    __allocated += Node_AllocSize(ret, sizeof(Node), ret->flags & NODE_F_ARENA);
     ret->type = t;
     return ret;
 }
 
-Node *NewBoolNode(int val) {
-    Node *ret = __newNode(N_BOOLEAN);
-    ret->value.boolval = val != 0;
+/* Frees the node itself, or releases it to its arena. */
+static inline void __node_Release(Node *n) {
+    __allocated -= Node_AllocSize(n, sizeof(Node), n->flags & NODE_F_ARENA);
+    if (n->flags & NODE_F_ARENA) {
+        __arenaReleased += sizeof(Node);
+    } else {
+        ValkeyModule_Free(n);
+    }
+}
+
+/* Allocates zeroed memory for a node's data, i.e. a string or a container's header. */
+static void *__node_DataAlloc(Node *n, size_t size) {
+    void *ret;
+    if (__arena) {
+        n->flags |= NODE_F_ARENADATA;
+        ret = Arena_Alloc(__arena, size);
+    } else {
+        n->flags &= ~NODE_F_ARENADATA;
+        ret = ValkeyModule_Calloc(1, size);
+    }
+    __allocated += Node_AllocSize(ret, size, n->flags & NODE_F_ARENADATA);
     return ret;
 }
 
+/* Frees data of the given size, or releases it to its arena. */
+static inline void __data_Free(int arenadata, void *p, size_t size) {
+    __allocated -= Node_AllocSize(p, size, arenadata);
+    if (arenadata) {
+        __arenaReleased += size;
+    } else {
+        ValkeyModule_Free(p);
+    }
+}
+
+/* Frees a node's data of the given size, or releases it to its arena. */
+static void __node_DataFree(Node *n, void *p, size_t size) {
+    __data_Free(n->flags & NODE_F_ARENADATA, p, size);
+}
+
+/* Resizes a node's data. Arena data is copied, unless it is the last allocation of the arena that
+ * is currently being built. */
+static void *__node_DataRealloc(Node *n, void *p, size_t size, size_t newsize) {
+    if (!__arena && !(n->flags & NODE_F_ARENADATA)) {
+        __allocated -= Node_AllocSize(p, size, 0);
+        p = ValkeyModule_Realloc(p, newsize);
+        __allocated += Node_AllocSize(p, newsize, 0);
+        return p;
+    }
+
+    int arenadata = n->flags & NODE_F_ARENADATA;
+    if (arenadata && __arena && Arena_Extend(__arena, p, size, newsize)) {
+        __allocated += ARENA_ALIGN(newsize) - ARENA_ALIGN(size);
+        return p;
+    }
+
+    void *ret = __node_DataAlloc(n, newsize);
+    memcpy(ret, p, MIN(size, newsize));
+    __data_Free(arenadata, p, size);
+    return ret;
+}
+
+/* Returns the number of bytes of a node's data of the given size that can be used. Heap data gets
+ * the whole size class the allocator rounded it up to, so containers that grow take that slack as
+ * capacity at no cost. */
+static size_t __node_DataUsable(Node *n, void *p, size_t size) {
+    if ((n->flags & NODE_F_ARENADATA) || !ValkeyModule_MallocUsableSize) return size;
+    return MAX(ValkeyModule_MallocUsableSize(p), size);
+}
+
+#define __arr_size(arr, cap) ARRAY_ALLOC_SIZE((arr)->flags, cap)
+
+/* Returns the capacity of an array's allocation of the given size, except for tables. */
+static uint32_t __arr_capOf(const Node *arr, size_t size) {
+    size -= sizeof(t_array);
+    switch (NODE_ENCODING(arr)) {
+        case NODE_ENC_PACKNUM:
+            return size / sizeof(Node);
+        case NODE_ENC_PACKBOOL:
+            return size / 8 * 64;
+        default:
+            return size / sizeof(Node *);
+    }
+}
+// the number of unused entries before an array's first item is kept in the array node
+#define __arr_head(arr) ((arr)->len)
+#define __obj_size(cap) (sizeof(t_dict) + (cap) * sizeof(t_keyval))
+#define __sobj_size(cap) (sizeof(t_sdict) + (cap) * sizeof(Node *))
+
+/* Shared static nodes for booleans and small integers, so they don't need an allocation each */
+static Node __boolNodes[2] = {
+    {.value.boolval = 0, .type = N_BOOLEAN, .flags = NODE_F_STATIC},
+    {.value.boolval = 1, .type = N_BOOLEAN, .flags = NODE_F_STATIC},
+};
+static Node __intNodes[NODE_SHARED_INT_MAX - NODE_SHARED_INT_MIN + 1] = {
+    [0 ... NODE_SHARED_INT_MAX - NODE_SHARED_INT_MIN] = {.type = N_INTEGER, .flags = NODE_F_STATIC},
+};
+static int __intNodesInit = 0;
+
+Node *NewBoolNode(int val) { return &__boolNodes[val != 0]; }
+
 Node *NewDoubleNode(double val) {
     Node *ret = __newNode(N_NUMBER);
     ret->value.numval = val;
@@ -36,73 +164,149 @@ Node *NewDoubleNode(double val) {
 }
 
 Node *NewIntNode(int64_t val) {
+    if (val >= NODE_SHARED_INT_MIN && val <= NODE_SHARED_INT_MAX) {
+        if (!__intNodesInit) {
+            for (int i = 0; i <= NODE_SHARED_INT_MAX - NODE_SHARED_INT_MIN; i++) {
+                __intNodes[i].value.intval = NODE_SHARED_INT_MIN + i;
+            }
+            __intNodesInit = 1;
+        }
+        return &__intNodes[val - NODE_SHARED_INT_MIN];
+    }
+
     Node *ret = __newNode(N_INTEGER);
     ret->value.intval = val;
     return ret;
 }
 
-Node *NewStringNode(const char *s, uint32_t len) {
+Node *NewStringNodeBuffer(uint32_t len, char **data) {
     Node *ret = __newNode(N_STRING);
-    ret->value.strval.data = vkmstrndup(s, len);
-    ret->value.strval.len = len;
+    if (len <= NODE_INLINE_STRLEN) {
+        // the node is zeroed, so the data is already terminated
+        ret->flags |= NODE_F_INLINE;
+        ret->slen = len;
+        *data = ret->sso;
+    } else {
+        ret->value.strval = __node_DataAlloc(ret, len + 1);
+        ret->len = len;
+        *data = ret->value.strval;
+    }
+    return ret;
+}
+
+Node *NewStringNode(const char *s, uint32_t len) {
+    char *data;
+    Node *ret = NewStringNodeBuffer(len, &data);
+    memcpy(data, s, len);
     return ret;
 }
 
 Node *NewCStringNode(const char *s) { return NewStringNode(s, strlen(s)); }
 
-Node *NewKeyValNode(const char *key, uint32_t len, Node *n) {
-    Node *ret = __newNode(N_KEYVAL);
-    ret->value.kvval.key = vkmstrndup(key, len);
-    ret->value.kvval.val = n;
+Node *NewBinaryNode(const char *s, uint32_t len) {
+    Node *ret = NewStringNode(s, len);
+    ret->type = N_BINARY;
     return ret;
 }
 
 Node *NewArrayNode(uint32_t cap) {
     Node *ret = __newNode(N_ARRAY);
-    ret->value.arrval.cap = cap;
-    ret->value.arrval.len = 0;
-    ret->value.arrval.entries = ValkeyModule_Calloc(cap, sizeof(Node *));
+    ret->value.arrval = __node_DataAlloc(ret, __arr_size(ret, cap));
+    ret->value.arrval->cap = cap;
+    return ret;
+}
+
+/* Creates a shaped dictionary with a reference to a shape, its values are set by the caller. */
+static Node *__sobj_new(t_shape *shape, uint32_t cap) {
+    Node *ret = __newNode(N_DICT);
+    ret->flags |= NODE_ENC_SHAPED;
+    ret->value.sdictval = __node_DataAlloc(ret, __sobj_size(cap));
+    ret->value.sdictval->cap = cap;
+    ret->value.sdictval->shape = shape;
     return ret;
 }
 
 Node *NewDictNode(uint32_t cap) {
+    // small dictionaries start with the empty shape
+    if (cap < SHAPE_MAX_KEYS) {
+        return __sobj_new(ShapeTable_Empty(VALKEYJSON_SHAPETABLE_GLOBAL), cap);
+    }
+
     Node *ret = __newNode(N_DICT);
-    ret->value.dictval.cap = cap;
-    ret->value.dictval.len = 0;
-    ret->value.dictval.entries = ValkeyModule_Calloc(cap, sizeof(Node *));
+    ret->value.dictval = __node_DataAlloc(ret, __obj_size(cap));
+    ret->value.dictval->cap = cap;
     return ret;
 }
 
-void __node_FreeKV(Node *n) {
-    Node_Free(n->value.kvval.val);
-    ValkeyModule_Free((char *)n->value.kvval.key);
-    ValkeyModule_Free(n);
+/* Frees the index of a dictionary, which is always allocated from the heap. */
+static void __obj_indexFree(t_dict *o) {
+    if (!o->index) return;
+    __allocated -= Node_AllocSize(o->index, o->icap * sizeof(uint32_t), 0);
+    ValkeyModule_Free(o->index);
+    o->index = NULL;
+}
+
+/* Frees a dictionary's keys (or shape), header and node, but not its values. */
+static void __obj_freeShell(Node *n) {
+    if (NODE_ENC_SHAPED == NODE_ENCODING(n)) {
+        t_sdict *d = n->value.sdictval;
+        ShapeTable_Release(VALKEYJSON_SHAPETABLE_GLOBAL, d->shape);
+        __node_DataFree(n, d, __sobj_size(d->cap));
+    } else {
+        t_dict *o = n->value.dictval;
+        for (int i = 0; i < o->len; i++) {
+            KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, o->entries[i].key);
+        }
+        __obj_indexFree(o);
+        __node_DataFree(n, o, __obj_size(o->cap));
+    }
+    __node_Release(n);
 }
 
 void __node_FreeObj(Node *n) {
-    for (int i = 0; i < n->value.dictval.len; i++) {
-        Node_Free(n->value.dictval.entries[i]);
+    if (NODE_ENC_SHAPED == NODE_ENCODING(n)) {
+        t_sdict *d = n->value.sdictval;
+        for (int i = 0; i < d->len; i++) {
+            Node_Free(d->vals[i]);
+        }
+    } else {
+        t_dict *o = n->value.dictval;
+        for (int i = 0; i < o->len; i++) {
+            Node_Free(o->entries[i].val);
+        }
     }
-    if (n->value.dictval.entries) ValkeyModule_Free(n->value.dictval.entries);
-    ValkeyModule_Free(n);
+    __obj_freeShell(n);
 }
 
+static void __tbl_free(Node *arr);
+
 void __node_FreeArr(Node *n) {
-    for (int i = 0; i < n->value.arrval.len; i++) {
-        Node_Free(n->value.arrval.entries[i]);
+    t_array *a = n->value.arrval;
+    switch (NODE_ENCODING(n)) {
+        case NODE_ENC_TABLE:
+            __tbl_free(n);
+            return;
+        case 0:
+            for (int i = 0; i < a->len; i++) {
+                Node_Free(a->entries[__arr_head(n) + i]);
+            }
+            break;
+        default:
+            // packed arrays have no nodes to free
+            break;
     }
-    ValkeyModule_Free(n->value.arrval.entries);
-    ValkeyModule_Free(n);
+    __node_DataFree(n, a, __arr_size(n, a->cap));
+    __node_Release(n);
 }
 
 void __node_FreeString(Node *n) {
-    ValkeyModule_Free((char *)n->value.strval.data);
-    ValkeyModule_Free(n);
+    if (!(n->flags & NODE_F_INLINE)) __node_DataFree(n, n->value.strval, STRING_ALLOC_SIZE(n));
+    __node_Release(n);
 }
 
 void Node_Free(Node *n) {
-    // ignore NULL nodes
-    if (!n) return;
+    // ignore NULL, shared nodes and the items of packed arrays
+    if (!n || n->flags & (NODE_F_STATIC | NODE_F_EMBEDDED)) return;
 
     switch (n->type) {
         case N_ARRAY:
@@ -112,13 +316,11 @@ void Node_Free(Node *n) {
             __node_FreeObj(n);
             break;
         case N_STRING:
+        case N_BINARY:
             __node_FreeString(n);
             break;
-        case N_KEYVAL:
-            __node_FreeKV(n);
-            break;
         default:
-            ValkeyModule_Free(n);
+            __node_Release(n);
     }
 }
 
@@ -127,13 +329,22 @@ int Node_Length(const Node *n) {
     if (n) {
         switch (n->type) {
             case N_ARRAY:
-                return n->value.arrval.len;
+                return n->value.arrval->len;
                 break;
             case N_DICT:
-                return n->value.dictval.len;
+                // rows have all of their table's keys
+                switch (NODE_ENCODING(n)) {
+                    case NODE_ENC_TABLE:
+                        return n->value.tblval->shape->len;
+                    case NODE_ENC_SHAPED:
+                        return n->value.sdictval->len;
+                    default:
+                        return n->value.dictval->len;
+                }
                 break;
             case N_STRING:
-                return n->value.strval.len;
+            case N_BINARY:
+                return NODE_STRLEN(n);
                 break;
             default:
                 break;
@@ -143,52 +354,163 @@ int Node_Length(const Node *n) {
     return -1;
 }
 
-int Node_StringAppend(Node *dst, Node *src) {
-    t_string *d = &dst->value.strval;
-    t_string *s = &src->value.strval;
+size_t Node_MemoryUsage(const Node *n) {
+    // the null node and shared nodes take no memory, packed items and rows are part of their array
+    if (!n || n->flags & NODE_F_STATIC) return 0;
+    if (n->flags & NODE_F_EMBEDDED && !NODE_HAS_BYTES(n)) return 0;
 
-    char *newval = ValkeyModule_Calloc(d->len + s->len, sizeof(char));
-    strncpy(newval, d->data, d->len);
-    strncpy(&newval[d->len], s->data, s->len);
+    // table cells are part of their table too, but long strings' data isn't
+    size_t ret = 0;
+    int arenadata = n->flags & NODE_F_ARENADATA;
+    if (!(n->flags & NODE_F_EMBEDDED)) {
+        ret += Node_AllocSize(n, sizeof(Node), n->flags & NODE_F_ARENA);
+    }
 
-    ValkeyModule_Free((char *)d->data);
-    d->data = newval;
-    d->len += s->len;
+    switch (n->type) {
+        case N_STRING:
+        case N_BINARY:
+            if (!(n->flags & NODE_F_INLINE)) {
+                ret += Node_AllocSize(n->value.strval, STRING_ALLOC_SIZE(n), arenadata);
+            }
+            break;
+        case N_DICT:
+            if (NODE_ENC_SHAPED == NODE_ENCODING(n)) {
+                t_sdict *d = n->value.sdictval;
+                ret += Node_AllocSize(d, __sobj_size(d->cap), arenadata);
+            } else {
+                t_dict *o = n->value.dictval;
+                ret += Node_AllocSize(o, __obj_size(o->cap), arenadata);
+                if (o->index) ret += Node_AllocSize(o->index, o->icap * sizeof(uint32_t), 0);
+            }
+            break;
+        case N_ARRAY:
+            if (NODE_ENC_TABLE == NODE_ENCODING(n)) {
+                t_table *t = n->value.tblval;
+                ret += Node_AllocSize(t, TABLE_ALLOC_SIZE(t->shape->len, t->cap), arenadata);
+            } else {
+                t_array *a = n->value.arrval;
+                ret += Node_AllocSize(a, __arr_size(n, a->cap), arenadata);
+            }
+            break;
+        default:
+            // the other scalars are stored in the node itself
+            break;
+    }
 
-    return OBJ_OK;
+    return ret;
 }
 
-int Node_ArrayDelRange(Node *arr, const int index, const int count) {
-    t_array *a = &arr->value.arrval;
-
-    if (count <= 0 || !a->len) return OBJ_OK;
+static void __node_MemoryUsageUpTo(const Node *n, size_t limit, size_t *memory) {
+    *memory += Node_MemoryUsage(n);
+    if (!n || (N_ARRAY != n->type && N_DICT != n->type)) return;
+
+    Node *item;
+    int len = Node_Length(n);
+    for (int i = 0; i < len && *memory < limit; i++) {
+        if (N_ARRAY == n->type) {
+            Node_ArrayItem((Node *)n, i, &item);
+        } else {
+            Node_DictItem(n, i, NULL, NULL, &item);
+        }
+        __node_MemoryUsageUpTo(item, limit, memory);
+    }
+}
 
-    int start = index < 0 ? MAX(a->len + index, 0) : MIN(index, a->len - 1);
-    int stop = MIN(start + count, a->len);  // stop is exclusive
+size_t Node_MemoryUsageUpTo(const Node *n, size_t limit) {
+    size_t memory = 0;
+    __node_MemoryUsageUpTo(n, limit, &memory);
+    return memory;
+}
 
-    // free range
-    for (int i = start; i < stop; i++) Node_Free(a->entries[i]);
+int Node_StringAppend(Node *dst, Node *src) {
+    uint32_t dlen = NODE_STRLEN(dst);
+    uint32_t slen = NODE_STRLEN(src);
+    uint32_t len = dlen + slen;
+
+    // short results stay inline, which means that the destination is inline too
+    if (len <= NODE_INLINE_STRLEN) {
+        memcpy(&dst->sso[dlen], NODE_STRDATA(src), slen);
+        dst->sso[len] = '\0';
+        dst->slen = len;
+        return OBJ_OK;
+    }
 
-    // move whatever remains on the left side
-    if (stop < a->len)
-        memmove(&a->entries[start], &a->entries[stop], (a->len - stop) * sizeof(Node *));
+    // grow to the next power of 2 when the result doesn't fit
+    uint8_t logcap = 4;
+    while (((size_t)1 << logcap) < (size_t)len + 1) logcap++;
+
+    char *newval;
+    if (dst->flags & NODE_F_INLINE) {
+        newval = __node_DataAlloc(dst, (size_t)1 << logcap);
+        memcpy(newval, dst->sso, dlen);
+        dst->flags &= ~NODE_F_INLINE;
+        dst->slen = logcap;
+    } else if (STRING_ALLOC_SIZE(dst) >= (size_t)len + 1) {
+        newval = dst->value.strval;
+    } else {
+        newval = __node_DataRealloc(dst, dst->value.strval, STRING_ALLOC_SIZE(dst),
+                                    (size_t)1 << logcap);
+        dst->slen = logcap;
+    }
+    memcpy(&newval[dlen], NODE_STRDATA(src), slen);
+    newval[len] = '\0';
 
-    // adjust length
-    a->len -= stop - start;
+    dst->value.strval = newval;
+    dst->len = len;
 
     return OBJ_OK;
 }
 
-/* Enlarge the capacity of an array to hold at least its current length + addlen. */
-void __node_ArrayMakeRoomFor(Node *arr, uint32_t addlen) {
-    t_array *a = &arr->value.arrval;
-    uint32_t newcap = a->len + addlen;
+/* Bitmap accessors for packed boolean arrays */
+#define __bit_get(bits, i) ((int)(((bits)[(i) >> 6] >> ((i)&63)) & 1))
 
-    // Nothing to do if enough capacity is already available
-    if (a->cap >= newcap) return;
+static inline void __bit_set(uint64_t *bits, uint32_t i, int val) {
+    if (val) {
+        bits[i >> 6] |= (uint64_t)1 << (i & 63);
+    } else {
+        bits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    }
+}
+
+/* Returns the packed array encoding that can hold the node, or 0 if it needs pointers. */
+static inline int __arr_encodingOf(const Node *n) {
+    if (!n) return 0;
+    if (n->type & (N_INTEGER | N_NUMBER)) return NODE_ENC_PACKNUM;
+    if (N_BOOLEAN == n->type) return NODE_ENC_PACKBOOL;
+    return 0;
+}
+
+/* Returns the item at the (physical) entry i of an array with the given encoding flags, i must be
+ * in range. */
+static inline Node *__arr_get(t_array *a, int flags, uint32_t i) {
+    switch (flags & NODE_ENC_MASK) {
+        case NODE_ENC_PACKNUM:
+            return &ARRAY_NUMS(a)[i];
+        case NODE_ENC_PACKBOOL:
+            return NewBoolNode(__bit_get(ARRAY_BITS(a), i));
+        case NODE_ENC_TABLE:
+            return &TABLE_ROWS((t_table *)a)[i];
+        default:
+            return a->entries[i];
+    }
+}
+
+#define __arr_item(arr, i) __arr_get((arr)->value.arrval, (arr)->flags, __arr_head(arr) + (i))
+
+/* Stores the value of a number or a boolean node at the (physical) entry i of a packed array. */
+static inline void __arr_set(t_array *a, int flags, uint32_t i, const Node *n) {
+    if (NODE_ENC_PACKNUM == (flags & NODE_ENC_MASK)) {
+        ARRAY_NUMS(a)[i] = (Node){.value = n->value, .type = n->type, .flags = NODE_F_EMBEDDED};
+    } else {
+        __bit_set(ARRAY_BITS(a), i, n->value.boolval);
+    }
+}
 
-    /* Find a reasonable next capacity.
-    * For small numbers we grow to the next power of 2:
+#define __arr_put(arr, i, n) __arr_set((arr)->value.arrval, (arr)->flags, __arr_head(arr) + (i), n)
+
+/* Returns a reasonable capacity for holding at least newcap items. */
+static uint32_t __arr_nextCap(uint32_t newcap) {
+    /* For small numbers we grow to the next power of 2:
     * http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
     */
     uint32_t nextcap = newcap;
@@ -206,25 +528,529 @@ void __node_ArrayMakeRoomFor(Node *arr, uint32_t addlen) {
         nextcap = ((newcap / CHUNK_SIZE) + 1) * CHUNK_SIZE;
     }
 
-    a->cap = nextcap;
-    a->entries = ValkeyModule_Realloc(a->entries, a->cap * sizeof(Node *));
+    return nextcap;
+}
+
+/* Returns the value of a table cell: NULL for a null, the container that the cell references, or
+ * the cell itself for the other scalars. */
+static inline Node *__cell_value(Node *cell) {
+    if (N_NULL == cell->type) return NULL;
+    if (cell->type & (N_DICT | N_ARRAY)) return cell->value.ref;
+    return cell;
+}
+
+/* Moves a node to a table cell. Scalars are stored in the cell, so their node is released. */
+static void __cell_set(Node *cell, Node *n) {
+    if (!n) {
+        *cell = (Node){.type = N_NULL, .flags = NODE_F_EMBEDDED};
+    } else if (n->type & (N_DICT | N_ARRAY)) {
+        *cell = (Node){.value.ref = n, .type = n->type, .flags = NODE_F_EMBEDDED};
+    } else {
+        *cell = *n;
+        cell->flags = (n->flags & (NODE_F_INLINE | NODE_F_ARENADATA)) | NODE_F_EMBEDDED;
+        if (!(n->flags & NODE_F_STATIC)) __node_Release(n);
+    }
+}
+
+/* Stores a copy of a node in a table cell. */
+static void __cell_copy(Node *cell, const Node *n) {
+    if (!n || n->type & (N_DICT | N_ARRAY)) {
+        __cell_set(cell, Node_Clone(n));
+    } else if (NODE_HAS_BYTES(n) && !(n->flags & NODE_F_INLINE)) {
+        *cell = (Node){.len = n->len, .type = n->type, .flags = NODE_F_EMBEDDED};
+        cell->value.strval = __node_DataAlloc(cell, n->len + 1);
+        memcpy(cell->value.strval, n->value.strval, n->len + 1);
+    } else {
+        *cell = *n;
+        cell->flags = (n->flags & NODE_F_INLINE) | NODE_F_EMBEDDED;
+    }
+}
+
+/* Frees the value of a table cell. */
+static void __cell_free(Node *cell) {
+    if (cell->type & (N_DICT | N_ARRAY)) {
+        Node_Free(cell->value.ref);
+    } else if (NODE_HAS_BYTES(cell) && !(cell->flags & NODE_F_INLINE)) {
+        __node_DataFree(cell, cell->value.strval, STRING_ALLOC_SIZE(cell));
+    }
+}
+
+/* Moves the value of a table cell out to a node of its own. */
+static Node *__cell_take(Node *cell) {
+    Node *v = __cell_value(cell);
+    if (v != cell) return v;
+    if (!NODE_HAS_BYTES(cell) || cell->flags & NODE_F_INLINE) return Node_Clone(cell);
+
+    // long strings keep their data
+    Node *n = __newNode(cell->type);
+    n->value.strval = cell->value.strval;
+    n->len = cell->len;
+    n->slen = cell->slen;
+    n->flags |= cell->flags & NODE_F_ARENADATA;
+    return n;
+}
+
+/* Checks if a node is an object with the table's shape. */
+static inline int __tbl_fits(const t_table *t, const Node *n) {
+    return n && N_DICT == n->type && NODE_ENC_SHAPED == NODE_ENCODING(n) &&
+           n->value.sdictval->shape == t->shape;
+}
+
+/* Points all the row nodes of a table, including the spare ones, to the table. */
+static void __tbl_initRows(t_table *t) {
+    Node *rows = TABLE_ROWS(t);
+    for (uint32_t r = 0; r < t->cap; r++) {
+        rows[r] = (Node){.value.tblval = t,
+                         .len = r,
+                         .type = N_DICT,
+                         .flags = NODE_F_EMBEDDED | NODE_ENC_TABLE};
+    }
+}
+
+/* Allocates an empty table for an array with a reference to a shape. */
+static t_table *__tbl_alloc(Node *arr, t_shape *shape, uint32_t cap) {
+    t_table *t = __node_DataAlloc(arr, TABLE_ALLOC_SIZE(shape->len, cap));
+    t->cap = cap;
+    t->shape = shape;
+    t->owner = arr;
+    __tbl_initRows(t);
+    return t;
+}
+
+/* Moves the values of an object, which must fit the table, to the (empty) row r and frees the
+ * object. */
+static void __tbl_setRow(t_table *t, uint32_t r, Node *n) {
+    t_sdict *d = n->value.sdictval;
+    for (uint32_t c = 0; c < d->len; c++) {
+        __cell_set(&TABLE_COL(t, c)[r], d->vals[c]);
+    }
+    __obj_freeShell(n);
+}
+
+/* Frees the values of the rows from start up to (but excluding) stop. */
+static void __tbl_freeRows(t_table *t, uint32_t start, uint32_t stop) {
+    for (uint32_t c = 0; c < t->shape->len; c++) {
+        Node *col = TABLE_COL(t, c);
+        for (uint32_t r = start; r < stop; r++) __cell_free(&col[r]);
+    }
+}
+
+/* Moves the values of a row out to an object of its own. */
+static Node *__tbl_rowToDict(t_table *t, uint32_t r) {
+    uint32_t len = t->shape->len;
+    Node *ret = __sobj_new(ShapeTable_Retain(VALKEYJSON_SHAPETABLE_GLOBAL, t->shape), len);
+    for (uint32_t c = 0; c < len; c++) {
+        ret->value.sdictval->vals[c] = __cell_take(&TABLE_COL(t, c)[r]);
+    }
+    ret->value.sdictval->len = len;
+    return ret;
+}
+
+/* Moves count rows of a table from src to dst, the ranges may overlap. Row nodes stay in place. */
+static void __tbl_move(t_table *t, uint32_t dst, uint32_t src, uint32_t count) {
+    for (uint32_t c = 0; c < t->shape->len; c++) {
+        memmove(&TABLE_COL(t, c)[dst], &TABLE_COL(t, c)[src], count * sizeof(Node));
+    }
+}
+
+/* Enlarge the capacity of a table to hold at least its current length + addlen rows. Returns the
+ * table, which may have moved. */
+static t_table *__tbl_makeRoomFor(Node *arr, uint32_t addlen) {
+    t_table *t = arr->value.tblval;
+    uint32_t cap = t->cap;
+    uint32_t newcap = t->len + addlen;
+
+    if (cap >= newcap) return t;
+
+    size_t size = TABLE_ALLOC_SIZE(t->shape->len, __arr_nextCap(newcap));
+    t = __node_DataRealloc(arr, t, TABLE_ALLOC_SIZE(t->shape->len, cap), size);
+    t->cap = (__node_DataUsable(arr, t, size) - sizeof(t_table)) /
+             ((1 + t->shape->len) * sizeof(Node));
+
+    // spread the columns out to their new places, the last one first since they all move forward
+    for (uint32_t c = t->shape->len; c > 0; c--) {
+        memmove(TABLE_COL(t, c - 1), TABLE_ROWS(t) + (size_t)cap * c, t->len * sizeof(Node));
+    }
+
+    __tbl_initRows(t);
+    arr->value.tblval = t;
+    return t;
+}
+
+/* Converts a table back to an array of pointers to objects. */
+static void __tbl_materialize(Node *arr) {
+    t_table *t = arr->value.tblval;
+    int arenadata = arr->flags & NODE_F_ARENADATA;
+
+    arr->flags &= ~NODE_ENC_MASK;
+    t_array *a = __node_DataAlloc(arr, __arr_size(arr, t->len));
+    a->len = a->cap = t->len;
+    for (uint32_t r = 0; r < t->len; r++) {
+        a->entries[r] = __tbl_rowToDict(t, r);
+    }
+
+    t_shape *shape = t->shape;
+    __data_Free(arenadata, t, TABLE_ALLOC_SIZE(shape->len, t->cap));
+    ShapeTable_Release(VALKEYJSON_SHAPETABLE_GLOBAL, shape);
+    arr->value.arrval = a;
+}
+
+/* Converts the table of a row node back to objects, and returns the object of the row. */
+static Node *__tbl_materializeRow(Node *row) {
+    Node *arr = row->value.tblval->owner;
+    uint32_t r = row->len;
+    __tbl_materialize(arr);
+    return arr->value.arrval->entries[r];
+}
+
+/* Inserts the objects of an array, which must all fit the table, as rows at index and frees the
+ * array. */
+static void __tbl_insert(Node *arr, uint32_t index, Node *sub) {
+    t_array *s = sub->value.arrval;
+    t_table *t = __tbl_makeRoomFor(arr, s->len);
+
+    if (index < t->len) __tbl_move(t, index + s->len, index, t->len - index);
+    for (uint32_t i = 0; i < s->len; i++) {
+        __tbl_setRow(t, index + i, __arr_item(sub, i));
+    }
+    t->len += s->len;
+
+    s->len = 0;
+    Node_Free(sub);
+}
+
+/* Copies an array that is a table. */
+static Node *__tbl_clone(const Node *arr) {
+    t_table *t = arr->value.tblval;
+    Node *ret = __newNode(N_ARRAY);
+    t_shape *shape = ShapeTable_Retain(VALKEYJSON_SHAPETABLE_GLOBAL, t->shape);
+    t_table *nt = __tbl_alloc(ret, shape, t->len);
+    ret->flags |= NODE_ENC_TABLE;
+    nt->len = t->len;
+
+    for (uint32_t c = 0; c < t->shape->len; c++) {
+        Node *col = TABLE_COL(t, c);
+        Node *ncol = TABLE_COL(nt, c);
+        for (uint32_t r = 0; r < t->len; r++) __cell_copy(&ncol[r], __cell_value(&col[r]));
+    }
+
+    ret->value.tblval = nt;
+    return ret;
+}
+
+/* Frees an array that is a table. */
+static void __tbl_free(Node *arr) {
+    t_table *t = arr->value.tblval;
+    t_shape *shape = t->shape;
+    __tbl_freeRows(t, 0, t->len);
+    __node_DataFree(arr, t, TABLE_ALLOC_SIZE(shape->len, t->cap));
+    ShapeTable_Release(VALKEYJSON_SHAPETABLE_GLOBAL, shape);
+    __node_Release(arr);
+}
+
+int Node_ArrayTabulate(Node *arr) {
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) return OBJ_OK;
+
+    t_array *a = arr->value.arrval;
+    if (NODE_ENCODING(arr) || a->len < TABLE_MIN_ROWS) return OBJ_ERR;
+
+    // the objects must have the same (non empty) shape
+    Node *first = __arr_item(arr, 0);
+    if (!first || N_DICT != first->type || NODE_ENC_SHAPED != NODE_ENCODING(first)) return OBJ_ERR;
+    t_shape *shape = first->value.sdictval->shape;
+    if (!shape->len) return OBJ_ERR;
+
+    for (uint32_t r = 1; r < a->len; r++) {
+        Node *n = __arr_item(arr, r);
+        if (!n || N_DICT != n->type || NODE_ENC_SHAPED != NODE_ENCODING(n) ||
+            n->value.sdictval->shape != shape)
+            return OBJ_ERR;
+    }
+
+    int arenadata = arr->flags & NODE_F_ARENADATA;
+    t_table *t = __tbl_alloc(arr, ShapeTable_Retain(VALKEYJSON_SHAPETABLE_GLOBAL, shape), a->len);
+    for (uint32_t r = 0; r < a->len; r++) {
+        __tbl_setRow(t, r, __arr_item(arr, r));
+    }
+    t->len = a->len;
+
+    __data_Free(arenadata, a, ARRAY_ALLOC_SIZE(0, a->cap));
+    __arr_head(arr) = 0;
+    arr->flags |= NODE_ENC_TABLE;
+    arr->value.tblval = t;
+    return OBJ_OK;
+}
+
+/* Moves count items of an array from the (physical) entry src to dst, the ranges may overlap. */
+static void __arr_move(Node *arr, uint32_t dst, uint32_t src, uint32_t count) {
+    t_array *a = arr->value.arrval;
+
+    switch (NODE_ENCODING(arr)) {
+        case NODE_ENC_TABLE:
+            __tbl_move(arr->value.tblval, dst, src, count);
+            break;
+        case NODE_ENC_PACKBOOL: {
+            uint64_t *bits = ARRAY_BITS(a);
+            if (dst < src) {
+                for (uint32_t i = 0; i < count; i++) {
+                    __bit_set(bits, dst + i, __bit_get(bits, src + i));
+                }
+            } else {
+                for (uint32_t i = count; i > 0; i--) {
+                    __bit_set(bits, dst + i - 1, __bit_get(bits, src + i - 1));
+                }
+            }
+        } break;
+        default: {
+            size_t size = NODE_ENC_PACKNUM == NODE_ENCODING(arr) ? sizeof(Node) : sizeof(Node *);
+            memmove((char *)a->entries + dst * size, (char *)a->entries + src * size, count * size);
+        } break;
+    }
+}
+
+/* Changes the encoding of an array to pointers or to a packed one. The items of packed arrays are
+ * boxed in nodes and tables are turned into objects when the array is converted to pointers, and
+ * the array's items must fit the encoding when it is packed. */
+static void __arr_encode(Node *arr, int enc) {
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) {
+        __tbl_materialize(arr);
+        if (!enc) return;
+    }
+
+    t_array *a = arr->value.arrval;
+    int flags = arr->flags;
+    int arenadata = flags & NODE_F_ARENADATA;
+
+    arr->flags = (flags & ~NODE_ENC_MASK) | enc;
+    t_array *na = __node_DataAlloc(arr, __arr_size(arr, a->cap));
+    na->len = a->len;
+    na->cap = a->cap;
+    for (uint32_t i = 0; i < a->len; i++) {
+        Node *n = __arr_get(a, flags, __arr_head(arr) + i);
+        if (enc) {
+            __arr_set(na, enc, i, n);
+            Node_Free(n);
+        } else {
+            na->entries[i] = Node_Clone(n);
+        }
+    }
+
+    __data_Free(arenadata, a, ARRAY_ALLOC_SIZE(flags, a->cap));
+    __arr_head(arr) = 0;
+    arr->value.arrval = na;
+}
+
+/* Makes sure that an array can hold items of the given encoding: empty arrays take on any encoding,
+ * and packed arrays are converted to pointers on the first item of another type. */
+static inline void __arr_prepare(Node *arr, int enc) {
+    int cur = NODE_ENCODING(arr);
+    if (cur == enc) return;
+
+    if (!arr->value.arrval->len) {
+        __arr_encode(arr, enc);
+    } else if (cur) {
+        __arr_encode(arr, 0);
+    }
+}
+
+/* Prepares an array for holding a node. Tables only hold objects that fit them, and empty arrays
+ * aren't packed for the shared small integers, since pointing to those is cheaper. */
+static inline void __arr_prepareFor(Node *arr, const Node *n) {
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) {
+        if (!__tbl_fits(arr->value.tblval, n)) __tbl_materialize(arr);
+        return;
+    }
+
+    int enc = __arr_encodingOf(n);
+    if (NODE_ENC_PACKNUM == enc && !arr->value.arrval->len && N_INTEGER == n->type &&
+        n->value.intval >= NODE_SHARED_INT_MIN && n->value.intval <= NODE_SHARED_INT_MAX)
+        enc = 0;
+    __arr_prepare(arr, enc);
+}
+
+/* Removes the (already freed or taken) items in the range [start, stop) of an array by moving the
+ * shorter side over them. The items before the range move right along with the head, so removing
+ * from the head doesn't move anything. */
+static void __arr_remove(Node *arr, uint32_t start, uint32_t stop) {
+    t_array *a = arr->value.arrval;
+    uint32_t head = __arr_head(arr);
+
+    if (NODE_ENC_TABLE != NODE_ENCODING(arr) && start < a->len - stop) {
+        if (start) __arr_move(arr, head + stop - start, head, start);
+        __arr_head(arr) += stop - start;
+    } else if (stop < a->len) {
+        __arr_move(arr, head + start, head + stop, a->len - stop);
+    }
+
+    // adjust length, empty arrays start over at their first entry
+    a->len -= stop - start;
+    if (!a->len) __arr_head(arr) = 0;
+}
+
+int Node_ArrayDelRange(Node *arr, const int index, const int count) {
+    t_array *a = arr->value.arrval;
+
+    if (count <= 0 || !a->len) return OBJ_OK;
+
+    int start = index < 0 ? MAX(a->len + index, 0) : MIN(index, a->len - 1);
+    int stop = MIN(start + count, a->len);  // stop is exclusive
+
+    // free range
+    uint32_t head = __arr_head(arr);
+    switch (NODE_ENCODING(arr)) {
+        case 0:
+            for (int i = start; i < stop; i++) Node_Free(a->entries[head + i]);
+            break;
+        case NODE_ENC_TABLE:
+            __tbl_freeRows(arr->value.tblval, start, stop);
+            break;
+        default:
+            break;
+    }
+
+    __arr_remove(arr, start, stop);
+    return OBJ_OK;
+}
+
+Node *Node_ArrayTakeRange(Node *arr, const int index, const int count) {
+    t_array *a = arr->value.arrval;
+
+    if (count <= 0 || !a->len) return NULL;
+
+    // the items of packed arrays are part of the array, and the rows of tables are freed with it
+    if (NODE_ENCODING(arr)) {
+        Node_ArrayDelRange(arr, index, count);
+        return NULL;
+    }
+
+    int start = index < 0 ? MAX(a->len + index, 0) : MIN(index, a->len - 1);
+    int stop = MIN(start + count, a->len);
+
+    Node *ret = NewArrayNode(stop - start);
+    memcpy(ret->value.arrval->entries, &a->entries[__arr_head(arr) + start],
+           (stop - start) * sizeof(Node *));
+    ret->value.arrval->len = stop - start;
+    __arr_remove(arr, start, stop);
+    return ret;
+}
+
+/* Reallocates an array to a capacity for holding at least newcap entries. Returns the array's
+ * header, which may have moved. */
+static t_array *__arr_grow(Node *arr, uint32_t newcap) {
+    t_array *a = arr->value.arrval;
+    uint32_t nextcap = __arr_nextCap(newcap);
+
+    // bitmaps are allocated in words anyway
+    if (NODE_ENC_PACKBOOL == NODE_ENCODING(arr)) nextcap = (nextcap + 63) & ~63;
+
+    size_t size = __arr_size(arr, nextcap);
+    a = __node_DataRealloc(arr, a, __arr_size(arr, a->cap), size);
+    a->cap = __arr_capOf(arr, __node_DataUsable(arr, a, size));
+    arr->value.arrval = a;
+    return a;
+}
+
+/* Enlarge the capacity of an array to hold at least its current length + addlen after its last
+ * item. Returns the array's header, which may have moved. */
+t_array *__node_ArrayMakeRoomFor(Node *arr, uint32_t addlen) {
+    t_array *a = arr->value.arrval;
+    uint32_t head = __arr_head(arr);
+    uint32_t newcap = a->len + addlen;
+
+    // Nothing to do if enough capacity is already available
+    if (a->cap - head >= newcap) return a;
+
+    // reclaim the entries before the head once there are enough of them to hold all the items, so
+    // the items are moved at most once for as many removals from the head
+    if (head >= newcap) {
+        __arr_move(arr, 0, head, a->len);
+        __arr_head(arr) = 0;
+        return a;
+    }
+
+    return __arr_grow(arr, head + newcap);
+}
+
+/* Makes room for addlen items before the first item of an array, which must not be a table. The
+ * items are moved to the middle of the free entries, growing the array if less than a third of it
+ * would be free, so the head has room for more items after them. Returns the array's header, which
+ * may have moved. */
+static t_array *__arr_makeRoomAtHead(Node *arr, uint32_t addlen) {
+    t_array *a = arr->value.arrval;
+    uint32_t head = __arr_head(arr);
+    if (head >= addlen) return a;
+
+    uint32_t newlen = a->len + addlen;
+    if (a->cap < newlen + newlen / 2) a = __arr_grow(arr, newlen + newlen / 2);
+
+    uint32_t newhead = addlen + (a->cap - newlen) / 2;
+    __arr_move(arr, newhead, head, a->len);
+    __arr_head(arr) = newhead;
+    return a;
 }
 
 int Node_ArrayInsert(Node *arr, int index, Node *sub) {
-    t_array *a = &arr->value.arrval;
-    t_array *s = &sub->value.arrval;
+    t_array *a = arr->value.arrval;
+    t_array *s = sub->value.arrval;
 
     if (index < 0) index = (int)a->len + index;     // translate negative index value
     if (index < 0) index = 0;                       // not in range always start at the beginning
     if (index > (int)a->len) index = (int)a->len;   // or appended at the end
 
-    __node_ArrayMakeRoomFor(arr, s->len);
-    if (index < (int) a->len) {                     //  shift contents to the right
-        memmove(&a->entries[index + s->len], &a->entries[index], (a->len - index) * sizeof(Node *));
+    // tables take objects that fit them as rows, anything else turns them back into objects
+    if (NODE_ENC_TABLE == NODE_ENCODING(sub)) __arr_encode(sub, 0);
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) {
+        s = sub->value.arrval;
+        uint32_t i = 0;
+        while (i < s->len && __tbl_fits(arr->value.tblval, __arr_item(sub, i))) i++;
+        if (i == s->len) {
+            __tbl_insert(arr, index, sub);
+            return OBJ_OK;
+        }
+        __arr_encode(arr, 0);
     }
 
-    // copy the references
-    memcpy(&a->entries[index], s->entries, s->len * sizeof(Node *));
+    // the items are copied as they are if both arrays are encoded the same, otherwise as pointers
+    s = sub->value.arrval;
+    if (s->len) {
+        int enc = NODE_ENCODING(arr);
+        if (enc && !NODE_ENCODING(sub)) {
+            // items that fit in the packed array are packed first
+            uint32_t i = 0;
+            while (i < s->len && __arr_encodingOf(__arr_item(sub, i)) == enc) i++;
+            if (i == s->len) __arr_encode(sub, enc);
+        }
+        __arr_prepare(arr, NODE_ENCODING(sub));
+        __arr_prepare(sub, NODE_ENCODING(arr));
+        s = sub->value.arrval;
+    }
+
+    a = arr->value.arrval;
+    if ((!index && a->len) || (index < (int)a->len / 2 && __arr_head(arr) >= s->len)) {
+        // shift the contents before index to the left, into the room at the head
+        a = __arr_makeRoomAtHead(arr, s->len);
+        uint32_t head = __arr_head(arr);
+        if (index) __arr_move(arr, head - s->len, head, index);
+        __arr_head(arr) -= s->len;
+    } else {
+        a = __node_ArrayMakeRoomFor(arr, s->len);
+        if (index < (int) a->len) {                 //  shift contents to the right
+            uint32_t head = __arr_head(arr);
+            __arr_move(arr, head + index + s->len, head + index, a->len - index);
+        }
+    }
+
+    // copy the references, or the packed items
+    uint32_t start = __arr_head(arr) + index;
+    if (NODE_ENC_PACKBOOL == NODE_ENCODING(arr)) {
+        for (uint32_t i = 0; i < s->len; i++) {
+            __bit_set(ARRAY_BITS(a), start + i, __bit_get(ARRAY_BITS(s), __arr_head(sub) + i));
+        }
+    } else {
+        size_t size = NODE_ENC_PACKNUM == NODE_ENCODING(arr) ? sizeof(Node) : sizeof(Node *);
+        memcpy((char *)a->entries + start * size, (char *)s->entries + __arr_head(sub) * size,
+               s->len * size);
+    }
     a->len += s->len;
 
     // destroy all traces
@@ -235,51 +1061,126 @@ int Node_ArrayInsert(Node *arr, int index, Node *sub) {
 }
 
 int Node_ArrayAppend(Node *arr, Node *n) {
-    t_array *a = &arr->value.arrval;
-    __node_ArrayMakeRoomFor(arr, 1);
-    a->entries[a->len++] = n;
+    __arr_prepareFor(arr, n);
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) {
+        t_table *t = __tbl_makeRoomFor(arr, 1);
+        __tbl_setRow(t, t->len++, n);
+        return OBJ_OK;
+    }
+
+    t_array *a = __node_ArrayMakeRoomFor(arr, 1);
+    if (NODE_ENCODING(arr)) {
+        __arr_put(arr, a->len++, n);
+        Node_Free(n);
+    } else {
+        a->entries[__arr_head(arr) + a->len++] = n;
+    }
+
+    return OBJ_OK;
+}
+
+int Node_ArrayAppendCopy(Node *arr, const Node *n) {
+    __arr_prepareFor(arr, n);
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) return Node_ArrayAppend(arr, Node_Clone(n));
+
+    t_array *a = __node_ArrayMakeRoomFor(arr, 1);
+    if (NODE_ENCODING(arr)) {
+        __arr_put(arr, a->len++, n);
+    } else {
+        a->entries[__arr_head(arr) + a->len++] = Node_Clone(n);
+    }
 
     return OBJ_OK;
 }
 
 int Node_ArrayPrepend(Node *arr, Node *n) {
-    Node *sub = NewArrayNode(1);
-    Node_ArrayAppend(sub, n);
-    return Node_ArrayInsert(arr, 0, sub);
+    __arr_prepareFor(arr, n);
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) {
+        Node *sub = NewArrayNode(1);
+        Node_ArrayAppend(sub, n);
+        return Node_ArrayInsert(arr, 0, sub);
+    }
+
+    t_array *a = __arr_makeRoomAtHead(arr, 1);
+    __arr_head(arr)--;
+    a->len++;
+    if (NODE_ENCODING(arr)) {
+        __arr_put(arr, 0, n);
+        Node_Free(n);
+    } else {
+        a->entries[__arr_head(arr)] = n;
+    }
+
+    return OBJ_OK;
 }
 
 int Node_ArraySet(Node *arr, int index, Node *n) {
-    t_array *a = &arr->value.arrval;
-
     // invalid index!
-    if (index < 0 || index >= a->len) {
+    if (index < 0 || index >= arr->value.arrval->len) {
         return OBJ_ERR;
     }
-    a->entries[index] = n;
+
+    __arr_prepareFor(arr, n);
+    t_array *a = arr->value.arrval;
+    switch (NODE_ENCODING(arr)) {
+        case 0:
+            Node_Free(a->entries[__arr_head(arr) + index]);
+            a->entries[__arr_head(arr) + index] = n;
+            break;
+        case NODE_ENC_TABLE:
+            __tbl_freeRows(arr->value.tblval, index, index + 1);
+            __tbl_setRow(arr->value.tblval, index, n);
+            break;
+        default:
+            __arr_put(arr, index, n);
+            Node_Free(n);
+            break;
+    }
 
     return OBJ_OK;
 }
 
 int Node_ArrayItem(Node *arr, int index, Node **n) {
-    t_array *a = &arr->value.arrval;
+    t_array *a = arr->value.arrval;
 
     // invalid index!
     if (index < 0 || index >= a->len) {
         *n = NULL;
         return OBJ_ERR;
     }
-    *n = a->entries[index];
+    *n = __arr_item(arr, index);
     return OBJ_OK;
 }
 
+Node *Node_ArrayTake(Node *arr, int index) {
+    t_array *a = arr->value.arrval;
+
+    // invalid index!
+    if (index < 0 || index >= a->len) return NULL;
+
+    Node *ret = __arr_item(arr, index);
+    if (NODE_ENC_TABLE == NODE_ENCODING(arr)) {
+        ret = __tbl_rowToDict(arr->value.tblval, index);
+    } else if (NODE_ENCODING(arr)) {
+        ret = Node_Clone(ret);
+    }
+    __arr_remove(arr, index, index + 1);
+    return ret;
+}
+
 int Node_ArrayIndex(Node *arr, Node *n, int start, int stop) {
-    t_array *a = &arr->value.arrval;
+    t_array *a = arr->value.arrval;
 
     // Break early for empty arrays or non scalar nodes
     if (!a->len || !NODE_IS_SCALAR(n)) {
         return -1;
     }
 
+    // packed arrays can only have numbers or booleans, and tables only have objects
+    if (NODE_ENCODING(arr) && __arr_encodingOf(n) != NODE_ENCODING(arr)) {
+        return -1;
+    }
+
     // convert negative indices
     if (start < 0) start = a->len + start;
     if (stop < 0) stop = a->len + stop;
@@ -293,27 +1194,28 @@ int Node_ArrayIndex(Node *arr, Node *n, int start, int stop) {
 
     // search for the value
     for (int i = start; i < stop; i++) {
-        if (!n && !a->entries[i]) return i;             // both are nulls
-        if (!n || !a->entries[i]) continue;             // just one null
-        if (a->entries[i]->type != n->type) continue;   // types not the same
+        Node *e = __arr_item(arr, i);
+        if (!n && !e) return i;             // both are nulls
+        if (!n || !e) continue;             // just one null
+        if (e->type != n->type) continue;   // types not the same
 
         // Check equality per scalar type
         switch (n->type) {
             case N_STRING:
-                if ((n->value.strval.len == a->entries[i]->value.strval.len) &&
-                    !strncmp(n->value.strval.data, a->entries[i]->value.strval.data,
-                             n->value.strval.len)) {
+            case N_BINARY:
+                if ((NODE_STRLEN(n) == NODE_STRLEN(e)) &&
+                    !memcmp(NODE_STRDATA(n), NODE_STRDATA(e), NODE_STRLEN(n))) {
                     return i;
                 }
                 break;
             case N_NUMBER:
-                if (n->value.numval == a->entries[i]->value.numval) return i;
+                if (n->value.numval == e->value.numval) return i;
                 break;
             case N_INTEGER:
-                if (n->value.intval == a->entries[i]->value.intval) return i;
+                if (n->value.intval == e->value.intval) return i;
                 break;
             case N_BOOLEAN:
-                if (n->value.boolval == a->entries[i]->value.boolval) return i;
+                if (n->value.boolval == e->value.boolval) return i;
                 break;
             default:
                 break;
@@ -323,120 +1225,741 @@ int Node_ArrayIndex(Node *arr, Node *n, int start, int stop) {
     return -1;  // unfound
 }
 
-Node *__obj_find(t_dict *o, const char *key, int *idx) {
+/* Keys are interned, so they carry their hash and are compared by pointer */
+#define __obj_key(o, pos) ((o)->entries[pos].key)
+#define __obj_keyHash(o, pos) (__obj_key(o, pos)->hash)
+
+/* Returns the index slot that holds the entry at pos. */
+static uint32_t __obj_indexSlot(t_dict *o, uint32_t pos) {
+    uint32_t mask = o->icap - 1;
+    uint32_t slot = __obj_keyHash(o, pos) & mask;
+    while (o->index[slot] != pos + 1) slot = (slot + 1) & mask;
+    return slot;
+}
+
+/* Adds the entry at pos to the index, the index must have room for it. */
+static void __obj_indexAdd(t_dict *o, uint32_t pos) {
+    uint32_t mask = o->icap - 1;
+    uint32_t slot = __obj_keyHash(o, pos) & mask;
+    while (o->index[slot]) slot = (slot + 1) & mask;
+    o->index[slot] = pos + 1;
+}
+
+/* Empties an index slot, shifting back any entries in the probe chain that follow it. */
+static void __obj_indexRemove(t_dict *o, uint32_t slot) {
+    uint32_t mask = o->icap - 1;
+    uint32_t next = slot;
+    o->index[slot] = 0;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (!o->index[next]) return;
+        uint32_t home = __obj_keyHash(o, o->index[next] - 1) & mask;
+        // move the entry back if its home slot isn't in the (cyclic) range (slot, next]
+        if ((next > slot && (home <= slot || home > next)) ||
+            (next < slot && (home <= slot && home > next))) {
+            o->index[slot] = o->index[next];
+            o->index[next] = 0;
+            slot = next;
+        }
+    }
+}
+
+/* (Re)builds the index so it can hold at least cap entries at a load factor of 1/2. */
+static void __obj_indexBuild(t_dict *o, uint32_t cap) {
+    uint32_t icap = 16;
+    while (icap < cap * 2) icap <<= 1;
+
+    __obj_indexFree(o);
+    o->icap = icap;
+    o->index = ValkeyModule_Calloc(icap, sizeof(uint32_t));
+    __allocated += Node_AllocSize(o->index, icap * sizeof(uint32_t), 0);
+    for (uint32_t i = 0; i < o->len; i++) __obj_indexAdd(o, i);
+}
+
+t_keyval *__obj_find(t_dict *o, const t_key *key, int *idx) {
+    if (o->index) {
+        uint32_t mask = o->icap - 1;
+        uint32_t slot = key->hash & mask;
+        uint32_t pos;
+        while ((pos = o->index[slot])) {
+            if (__obj_key(o, pos - 1) == key) {
+                if (idx) *idx = pos - 1;
+                return &o->entries[pos - 1];
+            }
+            slot = (slot + 1) & mask;
+        }
+        return NULL;
+    }
+
     for (int i = 0; i < o->len; i++) {
-        if (!strcmp(key, o->entries[i]->value.kvval.key)) {
+        if (o->entries[i].key == key) {
             if (idx) *idx = i;
-            return o->entries[i];
+            return &o->entries[i];
         }
     }
 
     return NULL;
 }
 
-void __obj_insert(t_dict *o, Node *n) {
+void __obj_insert(Node *obj, t_key *key, Node *n);
+
+/* Converts a shaped dictionary to one with keys of its own. */
+static void __obj_unshape(Node *obj) {
+    t_sdict *d = obj->value.sdictval;
+    int arenadata = obj->flags & NODE_F_ARENADATA;
+
+    obj->flags &= ~NODE_ENC_MASK;
+    obj->value.dictval = __node_DataAlloc(obj, __obj_size(d->cap));
+    obj->value.dictval->cap = d->cap;
+    for (uint32_t i = 0; i < d->len; i++) {
+        t_key *k = KeyTable_Retain(VALKEYJSON_KEYTABLE_GLOBAL, d->shape->keys[i]);
+        __obj_insert(obj, k, d->vals[i]);
+    }
+
+    ShapeTable_Release(VALKEYJSON_SHAPETABLE_GLOBAL, d->shape);
+    __data_Free(arenadata, d, __sobj_size(d->cap));
+}
+
+/* Adds an entry to a dictionary, which takes over the reference to the key. */
+void __obj_insert(Node *obj, t_key *key, Node *n) {
+    if (NODE_ENC_SHAPED == NODE_ENCODING(obj)) {
+        t_sdict *d = obj->value.sdictval;
+        if (d->len + 1 < SHAPE_MAX_KEYS) {
+            // move on to the shape with the key
+            t_shape *shape = ShapeTable_Add(VALKEYJSON_SHAPETABLE_GLOBAL, d->shape, key);
+            ShapeTable_Release(VALKEYJSON_SHAPETABLE_GLOBAL, d->shape);
+            if (d->len >= d->cap) {
+                uint32_t cap = d->cap ? MIN(d->cap * 2, SHAPE_MAX_KEYS - 1) : 1;
+                d = __node_DataRealloc(obj, d, __sobj_size(d->cap), __sobj_size(cap));
+                size_t usable = __node_DataUsable(obj, d, __sobj_size(cap));
+                d->cap = MIN((usable - sizeof(t_sdict)) / sizeof(Node *), SHAPE_MAX_KEYS - 1);
+                obj->value.sdictval = d;
+            }
+            d->shape = shape;
+            d->vals[d->len++] = n;
+            return;
+        }
+        __obj_unshape(obj);
+    }
+
+    t_dict *o = obj->value.dictval;
     if (o->len >= o->cap) {
-        o->cap += o->cap ? MIN(o->cap, 1024 * 1024) : 1;
-        o->entries = ValkeyModule_Realloc(o->entries, o->cap * sizeof(t_keyval *));
+        uint32_t cap = o->cap + (o->cap ? MIN(o->cap, 1024 * 1024) : 1);
+        o = __node_DataRealloc(obj, o, __obj_size(o->cap), __obj_size(cap));
+        o->cap = (__node_DataUsable(obj, o, __obj_size(cap)) - sizeof(t_dict)) / sizeof(t_keyval);
+        obj->value.dictval = o;
+    }
+
+    t_keyval *kv = &o->entries[o->len++];
+    kv->key = key;
+    kv->val = n;
+
+    // switch to the indexed encoding once the dictionary is big enough, and keep it in shape
+    if (o->index && o->len * 2 <= o->icap) {
+        __obj_indexAdd(o, o->len - 1);
+    } else if (o->len >= DICT_INDEX_THRESHOLD) {
+        __obj_indexBuild(o, o->len);
     }
-    o->entries[o->len++] = n;    
 }
 
-int Node_DictSet(Node *obj, const char *key, Node *n) {
-    t_dict *o = &obj->value.dictval;
+/* Returns the key and the value of the entry at pos of a dictionary or a row, which must exist. */
+static inline t_key *__obj_entry(const Node *obj, uint32_t pos, Node **val) {
+    switch (NODE_ENCODING(obj)) {
+        case NODE_ENC_TABLE: {
+            t_table *t = obj->value.tblval;
+            *val = __cell_value(&TABLE_COL(t, pos)[obj->len]);
+            return t->shape->keys[pos];
+        }
+        case NODE_ENC_SHAPED:
+            *val = obj->value.sdictval->vals[pos];
+            return obj->value.sdictval->shape->keys[pos];
+        default:
+            *val = obj->value.dictval->entries[pos].val;
+            return obj->value.dictval->entries[pos].key;
+    }
+}
 
+int Node_DictSetLen(Node *obj, const char *key, uint32_t len, Node *n) {
     if (key == NULL) return OBJ_ERR;
 
-    int idx;
-    Node *kv = __obj_find(o, key, &idx);
+    /* The key is interned before it's looked up, so other threads can't free it in between. A new
+     * entry keeps the reference, and a replaced one gives it back since it has its own. */
+    t_key *k = KeyTable_Intern(VALKEYJSON_KEYTABLE_GLOBAL, key, len);
+
     // first find a replacement possiblity
-    if (kv) {
-        if (kv->value.kvval.val) {
-            Node_Free(kv->value.kvval.val);
-        }
-        kv->value.kvval.val = n;
-        return OBJ_OK;
+    switch (NODE_ENCODING(obj)) {
+        case NODE_ENC_TABLE: {
+            // rows have their values replaced in place
+            t_table *t = obj->value.tblval;
+            int pos = Shape_Find(t->shape, k);
+            if (pos >= 0) {
+                Node *cell = &TABLE_COL(t, pos)[obj->len];
+                __cell_free(cell);
+                __cell_set(cell, n);
+                KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, k);
+                return OBJ_OK;
+            }
+        } break;
+        case NODE_ENC_SHAPED: {
+            t_sdict *d = obj->value.sdictval;
+            int pos = Shape_Find(d->shape, k);
+            if (pos >= 0) {
+                Node_Free(d->vals[pos]);
+                d->vals[pos] = n;
+                KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, k);
+                return OBJ_OK;
+            }
+        } break;
+        default: {
+            t_keyval *kv = __obj_find(obj->value.dictval, k, NULL);
+            if (kv) {
+                Node_Free(kv->val);
+                kv->val = n;
+                KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, k);
+                return OBJ_OK;
+            }
+        } break;
     }
 
+    // another key in a row turns its table back into objects
+    if (NODE_IS_ROW(obj)) obj = __tbl_materializeRow(obj);
+
     // append another entry
-    kv = NewKeyValNode(key, strlen(key), n);
-    __obj_insert(o, kv);
+    __obj_insert(obj, k, n);
 
     return OBJ_OK;
 }
 
-int Node_DictSetKeyVal(Node *obj, Node *kv) {
-    t_dict *o = &obj->value.dictval;
-
-    if (kv->value.kvval.key == NULL) return OBJ_ERR;
+int Node_DictAppendLen(Node *obj, const char *key, uint32_t len, Node *n) {
+    // shapes keep their keys unique, and are small enough to check
+    if (key == NULL || N_DICT != obj->type || NODE_ENCODING(obj))
+        return Node_DictSetLen(obj, key, len, n);
 
-    int idx;
-    Node *_kv = __obj_find(o, kv->value.kvval.key, &idx);
-    // first find a replacement possiblity
-    if (_kv) {
-        o->entries[idx] = kv;
-        Node_Free(_kv);
-        return OBJ_OK;
+    // the index is rebuilt when the duplicates are resolved
+    t_dict *o = obj->value.dictval;
+    __obj_indexFree(o);
+    if (o->len >= o->cap) {
+        uint32_t cap = o->cap + (o->cap ? MIN(o->cap, 1024 * 1024) : 1);
+        o = __node_DataRealloc(obj, o, __obj_size(o->cap), __obj_size(cap));
+        o->cap = (__node_DataUsable(obj, o, __obj_size(cap)) - sizeof(t_dict)) / sizeof(t_keyval);
+        obj->value.dictval = o;
     }
 
-    // append another entry
-    __obj_insert(o, kv);
-
+    t_keyval *kv = &o->entries[o->len++];
+    kv->key = KeyTable_Intern(VALKEYJSON_KEYTABLE_GLOBAL, key, len);
+    kv->val = n;
     return OBJ_OK;
 }
 
-int Node_DictDel(Node *obj, const char *key) {
+void Node_DictDedupe(Node *obj) {
+    if (N_DICT != obj->type || NODE_ENCODING(obj)) return;
+
+    t_dict *o = obj->value.dictval;
+    if (o->index) return;
+
+    // the entries are moved back over the duplicates while they're indexed from scratch
+    uint32_t len = o->len;
+    o->len = 0;
+    __obj_indexBuild(o, len);
+    uint32_t mask = o->icap - 1;
+    for (uint32_t i = 0; i < len; i++) {
+        t_keyval kv = o->entries[i];
+        uint32_t slot = kv.key->hash & mask;
+        uint32_t pos;
+        while ((pos = o->index[slot]) && __obj_key(o, pos - 1) != kv.key) slot = (slot + 1) & mask;
+        if (pos) {
+            KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, kv.key);
+            Node_Free(o->entries[pos - 1].val);
+            o->entries[pos - 1].val = kv.val;
+        } else {
+            o->entries[o->len++] = kv;
+            o->index[slot] = o->len;
+        }
+    }
+
+    if (o->len < DICT_INDEX_THRESHOLD) __obj_indexFree(o);
+}
+
+int Node_DictSet(Node *obj, const char *key, Node *n) {
     if (key == NULL) return OBJ_ERR;
 
-    t_dict *o = &obj->value.dictval;
+    return Node_DictSetLen(obj, key, strlen(key), n);
+}
+
+/* Removes the entry of a key, its value is returned in val if given and freed otherwise. */
+static int __obj_delKey(Node *obj, t_key *k, Node **val) {
+    // rows can't lose a key, so the table is turned back into objects
+    if (NODE_IS_ROW(obj)) {
+        if (Shape_Find(obj->value.tblval->shape, k) < 0) return OBJ_ERR;
+        obj = __tbl_materializeRow(obj);
+    }
+
+    // shaped dictionaries move on to the shape without the key
+    if (NODE_ENC_SHAPED == NODE_ENCODING(obj)) {
+        t_sdict *d = obj->value.sdictval;
+        int pos = Shape_Find(d->shape, k);
+        if (pos < 0) return OBJ_ERR;
+
+        if (val) {
+            *val = d->vals[pos];
+        } else {
+            Node_Free(d->vals[pos]);
+        }
+        memmove(&d->vals[pos], &d->vals[pos + 1], (d->len - pos - 1) * sizeof(Node *));
+        d->len--;
+
+        t_shape *shape = ShapeTable_Remove(VALKEYJSON_SHAPETABLE_GLOBAL, d->shape, pos);
+        ShapeTable_Release(VALKEYJSON_SHAPETABLE_GLOBAL, d->shape);
+        d->shape = shape;
+        return OBJ_OK;
+    }
 
     int idx = -1;
-    Node *kv = __obj_find(o, key, &idx);
+    t_dict *o = obj->value.dictval;
+    t_keyval *kv = __obj_find(o, k, &idx);
 
     // tried to delete a non existing node
     if (!kv) return OBJ_ERR;
 
-    // free the kv node
-    Node_Free(kv);
+    // remove the entry and the top entry from the index before their keys are gone
+    uint32_t last = o->len - 1;
+    uint32_t lastslot = 0;
+    if (o->index) {
+        __obj_indexRemove(o, __obj_indexSlot(o, idx));
+        if (idx < last) lastslot = __obj_indexSlot(o, last);
+    }
+
+    // release the entry's key and hand over or free its value
+    KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, kv->key);
+    if (val) {
+        *val = kv->val;
+    } else {
+        Node_Free(kv->val);
+    }
 
     // replace the deleted entry and the top entry to avoid holes
-    if (idx < o->len - 1) {
-        o->entries[idx] = o->entries[o->len - 1];
+    if (idx < last) {
+        o->entries[idx] = o->entries[last];
+        if (o->index) o->index[lastslot] = idx + 1;
     }
     o->len--;
 
     return OBJ_OK;
 }
 
+/* Removes an entry from a dictionary, its value is returned in val if given and freed otherwise. */
+static int __obj_del(Node *obj, const char *key, Node **val) {
+    if (key == NULL) return OBJ_ERR;
+
+    // a key that isn't interned can't be in the dictionary, the reference keeps it while it's used
+    t_key *k = KeyTable_FindRetain(VALKEYJSON_KEYTABLE_GLOBAL, key, strlen(key));
+    if (!k) return OBJ_ERR;
+
+    int ret = __obj_delKey(obj, k, val);
+    KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, k);
+    return ret;
+}
+
+int Node_DictDel(Node *obj, const char *key) { return __obj_del(obj, key, NULL); }
+
+Node *Node_DictTake(Node *obj, const char *key) {
+    Node *ret = NULL;
+    __obj_del(obj, key, &ret);
+    return ret;
+}
+
 int Node_DictGet(Node *obj, const char *key, Node **val) {
     if (key == NULL) return OBJ_ERR;
 
-    t_dict *o = &obj->value.dictval;
+    // not found! the reference keeps the key while it's compared
+    t_key *k = KeyTable_FindRetain(VALKEYJSON_KEYTABLE_GLOBAL, key, strlen(key));
+    if (!k) return OBJ_ERR;
+
+    // shaped dictionaries and rows are looked up through their shape
+    int ret = OBJ_ERR;
+    switch (NODE_ENCODING(obj)) {
+        case NODE_ENC_TABLE: {
+            t_table *t = obj->value.tblval;
+            int pos = Shape_Find(t->shape, k);
+            if (pos < 0) break;
+            *val = __cell_value(&TABLE_COL(t, pos)[obj->len]);
+            ret = OBJ_OK;
+        } break;
+        case NODE_ENC_SHAPED: {
+            int pos = Shape_Find(obj->value.sdictval->shape, k);
+            if (pos < 0) break;
+            *val = obj->value.sdictval->vals[pos];
+            ret = OBJ_OK;
+        } break;
+        default: {
+            t_keyval *kv = __obj_find(obj->value.dictval, k, NULL);
+            if (!kv) break;
+            *val = kv->val;
+            ret = OBJ_OK;
+        } break;
+    }
 
-    int idx = -1;
-    Node *kv = __obj_find(o, key, &idx);
+    KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, k);
+    return ret;
+}
 
-    // not found!
-    if (!kv) return OBJ_ERR;
+int Node_DictItem(const Node *obj, int index, const char **key, uint32_t *len, Node **val) {
+    // invalid index!
+    if (index < 0 || index >= Node_Length(obj)) return OBJ_ERR;
 
-    *val = kv->value.kvval.val;
+    Node *v;
+    t_key *k = __obj_entry(obj, index, &v);
+    if (key) *key = k->data;
+    if (len) *len = k->len;
+    if (val) *val = v;
     return OBJ_OK;
 }
 
+/* Containers give back their unused capacity once it's at least this many bytes, and more than
+ * half of their data */
+#define SHRINK_MIN_SLACK 4096
+
+/* Returns 1 if data of the given (allocated) size is worth shrinking to newsize bytes. */
+static inline int __shrink_worth(size_t size, size_t newsize) {
+    return size >= newsize + SHRINK_MIN_SLACK && size >= newsize * 2;
+}
+
+void Node_ShrinkToFit(Node *n) {
+    // arena data isn't freed on its own, and rows are part of their table
+    if (!n || n->flags & NODE_F_ARENADATA || NODE_IS_ROW(n)) return;
+
+    if (N_ARRAY == n->type && NODE_ENC_TABLE == NODE_ENCODING(n)) {
+        t_table *t = n->value.tblval;
+        uint32_t ncols = t->shape->len;
+        uint32_t cap = __arr_nextCap(t->len);
+        size_t newsize = TABLE_ALLOC_SIZE(ncols, cap);
+        if (!__shrink_worth(Node_AllocSize(t, TABLE_ALLOC_SIZE(ncols, t->cap), 0), newsize)) return;
+
+        // gather the columns at their new places, the first one first since they all move back
+        for (uint32_t c = 0; c < ncols; c++) {
+            memmove(TABLE_ROWS(t) + (size_t)cap * (1 + c), TABLE_COL(t, c), t->len * sizeof(Node));
+        }
+        t = __node_DataRealloc(n, t, TABLE_ALLOC_SIZE(ncols, t->cap), newsize);
+        t->cap = cap;
+        __tbl_initRows(t);
+        n->value.tblval = t;
+    } else if (N_ARRAY == n->type) {
+        t_array *a = n->value.arrval;
+        uint32_t cap = __arr_nextCap(a->len);
+        if (NODE_ENC_PACKBOOL == NODE_ENCODING(n)) cap = (cap + 63) & ~63;
+        size_t newsize = __arr_size(n, cap);
+        if (!__shrink_worth(Node_AllocSize(a, __arr_size(n, a->cap), 0), newsize)) return;
+
+        // the entries before the head are let go along with the ones after the last item
+        if (__arr_head(n)) {
+            __arr_move(n, 0, __arr_head(n), a->len);
+            __arr_head(n) = 0;
+        }
+        a = __node_DataRealloc(n, a, __arr_size(n, a->cap), newsize);
+        a->cap = __arr_capOf(n, __node_DataUsable(n, a, newsize));
+        n->value.arrval = a;
+    } else if (N_DICT == n->type && NODE_ENC_SHAPED != NODE_ENCODING(n)) {
+        t_dict *o = n->value.dictval;
+
+        // the index is rebuilt for the entries that are left once it's mostly empty, and dropped
+        // when the dictionary is too small to need one
+        if (o->index && o->len * 8 <= o->icap) {
+            if (o->len < DICT_INDEX_THRESHOLD) {
+                __obj_indexFree(o);
+            } else {
+                __obj_indexBuild(o, o->len);
+            }
+        }
+
+        // the positions of the entries don't change, so the index stays valid
+        uint32_t cap = __arr_nextCap(o->len);
+        size_t newsize = __obj_size(cap);
+        if (!__shrink_worth(Node_AllocSize(o, __obj_size(o->cap), 0), newsize)) return;
+        o = __node_DataRealloc(n, o, __obj_size(o->cap), newsize);
+        o->cap = (__node_DataUsable(n, o, newsize) - sizeof(t_dict)) / sizeof(t_keyval);
+        n->value.dictval = o;
+    }
+}
+
+/* Returns the packed encoding that fits all of an array's items if it takes less memory than the
+ * pointers, or 0. Booleans are always worth packing, numbers only when most aren't shared nodes. */
+static int __arr_bestEncoding(Node *arr) {
+    t_array *a = arr->value.arrval;
+    if (!a->len) return 0;
+
+    int enc = __arr_encodingOf(__arr_item(arr, 0));
+    uint32_t unshared = 0;
+    for (uint32_t i = 0; i < a->len && enc; i++) {
+        Node *n = __arr_item(arr, i);
+        if (__arr_encodingOf(n) != enc) return 0;
+        if (!(n->flags & NODE_F_STATIC)) unshared++;
+    }
+    return NODE_ENC_PACKNUM == enc && unshared * 2 <= a->len ? 0 : enc;
+}
+
+void Node_Optimize(Node *n) {
+    if (!n) return;
+
+    if (N_DICT == n->type) {
+        int len = Node_Length(n);
+        for (int i = 0; i < len; i++) {
+            const char *key;
+            uint32_t keylen;
+            Node *val;
+            Node_DictItem(n, i, &key, &keylen, &val);
+            Node_Optimize(val);
+        }
+    } else if (N_ARRAY == n->type) {
+        // packed arrays only hold scalars
+        int enc = NODE_ENCODING(n);
+        if (NODE_ENC_PACKNUM == enc || NODE_ENC_PACKBOOL == enc) {
+            Node_ShrinkToFit(n);
+            return;
+        }
+
+        int len = Node_Length(n);
+        for (int i = 0; i < len; i++) {
+            Node *item;
+            Node_ArrayItem(n, i, &item);
+            Node_Optimize(item);
+        }
+
+        // pointer arrays that were appended mixed items to may hold a single type by now
+        if (!enc && OBJ_OK != Node_ArrayTabulate(n) && (enc = __arr_bestEncoding(n))) {
+            __arr_encode(n, enc);
+        }
+    }
+    Node_ShrinkToFit(n);
+}
+
+Node *Node_Clone(const Node *n) {
+    // shared nodes (and null) are never copied
+    if (!n || n->flags & NODE_F_STATIC) return (Node *)n;
+
+    Node *ret = NULL;
+    switch (n->type) {
+        case N_BOOLEAN:
+            ret = NewBoolNode(n->value.boolval);
+            break;
+        case N_INTEGER:
+            ret = NewIntNode(n->value.intval);
+            break;
+        case N_NUMBER:
+            ret = NewDoubleNode(n->value.numval);
+            break;
+        case N_STRING:
+            ret = NewStringNode(NODE_STRDATA(n), NODE_STRLEN(n));
+            break;
+        case N_BINARY:
+            ret = NewBinaryNode(NODE_STRDATA(n), NODE_STRLEN(n));
+            break;
+        case N_ARRAY: {
+            t_array *a = n->value.arrval;
+            if (NODE_ENC_TABLE == NODE_ENCODING(n)) {
+                ret = __tbl_clone(n);
+            } else if (NODE_ENCODING(n)) {
+                // packed items are plain values that are copied at once
+                ret = __newNode(N_ARRAY);
+                ret->flags |= NODE_ENCODING(n);
+                t_array *na = __node_DataAlloc(ret, __arr_size(ret, a->len));
+                na->len = na->cap = a->len;
+                if (__arr_head(n)) {
+                    // the copy starts at its first entry
+                    for (uint32_t i = 0; i < a->len; i++) {
+                        __arr_set(na, n->flags, i, __arr_item(n, i));
+                    }
+                } else {
+                    memcpy(na->entries, a->entries, __arr_size(ret, a->len) - sizeof(t_array));
+                }
+                ret->value.arrval = na;
+            } else {
+                ret = NewArrayNode(a->len);
+                for (uint32_t i = 0; i < a->len; i++) Node_ArrayAppendCopy(ret, __arr_item(n, i));
+            }
+        } break;
+        case N_DICT: {
+            uint32_t len = Node_Length(n);
+            if (NODE_ENCODING(n)) {
+                // shaped dictionaries and rows are copied to a dictionary of the same shape
+                t_shape *shape = NODE_IS_ROW(n) ? n->value.tblval->shape : n->value.sdictval->shape;
+                ret = __sobj_new(ShapeTable_Retain(VALKEYJSON_SHAPETABLE_GLOBAL, shape), len);
+                for (uint32_t i = 0; i < len; i++) {
+                    Node *val;
+                    __obj_entry(n, i, &val);
+                    ret->value.sdictval->vals[i] = Node_Clone(val);
+                }
+                ret->value.sdictval->len = len;
+            } else {
+                ret = NewDictNode(len);
+                for (uint32_t i = 0; i < len; i++) {
+                    Node *val;
+                    t_key *k = KeyTable_Retain(VALKEYJSON_KEYTABLE_GLOBAL, __obj_entry(n, i, &val));
+                    __obj_insert(ret, k, Node_Clone(val));
+                }
+            }
+        } break;
+        default:
+            break;
+    }
+    return ret;
+}
+
+/* Number of containers' items that are defragmented between checks of the stop function */
+#define DEFRAG_STOP_INTERVAL 64
+
+typedef struct {
+    NodeDefragCursor *cursor;
+    NodeDefragFunc move;
+    NodeDefragStopFunc stop;
+    void *ctx;
+    int resuming;  // descending along the cursor's positions
+    int stopped;
+    uint32_t visited;
+} __defragState;
+
+/* Moves an allocation, returns its new address or the old one if it stayed in place. */
+static inline void *__defrag_alloc(__defragState *s, void *p) {
+    void *ret = s->move(s->ctx, p);
+    return ret ? ret : p;
+}
+
+/* Moves a node and its data, but not its children. Returns the node, which may have moved. */
+static Node *__defrag_node(__defragState *s, Node *n) {
+    if (!n || n->flags & NODE_F_STATIC) return n;
+
+    int heapdata = !(n->flags & NODE_F_ARENADATA);
+    switch (n->type) {
+        case N_STRING:
+        case N_BINARY:
+            if (heapdata && !(n->flags & NODE_F_INLINE)) {
+                n->value.strval = __defrag_alloc(s, n->value.strval);
+            }
+            break;
+        case N_DICT:
+            if (NODE_ENC_SHAPED == NODE_ENCODING(n)) {
+                if (heapdata) n->value.sdictval = __defrag_alloc(s, n->value.sdictval);
+            } else {
+                if (heapdata) n->value.dictval = __defrag_alloc(s, n->value.dictval);
+                // indexes are always on the heap
+                t_dict *o = n->value.dictval;
+                if (o->index) o->index = __defrag_alloc(s, o->index);
+            }
+            break;
+        case N_ARRAY:
+            if (heapdata) n->value.arrval = __defrag_alloc(s, n->value.arrval);
+            // the rows of a table point back to it
+            if (heapdata && NODE_ENC_TABLE == NODE_ENCODING(n)) __tbl_initRows(n->value.tblval);
+            break;
+        default:
+            break;
+    }
+
+    if (!(n->flags & (NODE_F_ARENA | NODE_F_EMBEDDED))) n = __defrag_alloc(s, n);
+    if (N_ARRAY == n->type && NODE_ENC_TABLE == NODE_ENCODING(n)) n->value.tblval->owner = n;
+    return n;
+}
+
+static Node *__defrag_tree(__defragState *s, Node *n, uint32_t depth);
+
+/* Defragments the item at index i of a container, and the items' descendants. */
+static void __defrag_item(__defragState *s, Node *n, uint32_t i, uint32_t depth) {
+    if (N_DICT == n->type) {
+        if (NODE_ENC_SHAPED == NODE_ENCODING(n)) {
+            t_sdict *d = n->value.sdictval;
+            d->vals[i] = __defrag_tree(s, d->vals[i], depth);
+        } else {
+            t_dict *o = n->value.dictval;
+            o->entries[i].val = __defrag_tree(s, o->entries[i].val, depth);
+        }
+    } else if (NODE_ENC_TABLE == NODE_ENCODING(n)) {
+        // a row's cells hold scalars in place and reference containers
+        t_table *t = n->value.tblval;
+        for (uint32_t c = 0; c < t->shape->len; c++) {
+            Node *cell = &TABLE_COL(t, c)[i];
+            if (cell->type & (N_DICT | N_ARRAY)) {
+                cell->value.ref = __defrag_tree(s, cell->value.ref, depth);
+            } else {
+                __defrag_node(s, cell);
+            }
+        }
+    } else {
+        t_array *a = n->value.arrval;
+        a->entries[__arr_head(n) + i] = __defrag_tree(s, a->entries[__arr_head(n) + i], depth);
+    }
+}
+
+/* Defragments a node and its descendants depth-first, until the stop function says otherwise.
+ * Returns the node, which may have moved. */
+static Node *__defrag_tree(__defragState *s, Node *n, uint32_t depth) {
+    n = __defrag_node(s, n);
+
+    // the items of packed arrays are part of the array
+    if (!n || !(n->type & (N_DICT | N_ARRAY)) ||
+        (N_ARRAY == n->type && NODE_ENCODING(n) && NODE_ENC_TABLE != NODE_ENCODING(n))) {
+        return n;
+    }
+
+    // when resuming, the cursor holds the item that was being defragmented at every level, and the
+    // next item to defragment at the last one
+    uint32_t i = 0;
+    int resume = s->resuming;
+    if (resume) {
+        i = s->cursor->pos[depth];
+        if (depth + 1 == s->cursor->depth) s->resuming = resume = 0;
+    }
+
+    uint32_t len = Node_Length(n);
+    for (; i < len; i++) {
+        // the cursor only has room for the top levels, deeper containers are defragmented at once
+        if (!resume && depth < NODE_DEFRAG_MAX_DEPTH &&
+            !(++s->visited % DEFRAG_STOP_INTERVAL) && s->stop(s->ctx)) {
+            s->cursor->depth = depth + 1;
+            s->cursor->pos[depth] = i;
+            s->stopped = 1;
+            return n;
+        }
+        resume = 0;
+
+        __defrag_item(s, n, i, depth + 1);
+        s->resuming = 0;
+        if (s->stopped) {
+            s->cursor->pos[depth] = i;
+            return n;
+        }
+    }
+    return n;
+}
+
+int Node_Defrag(Node **root, NodeDefragCursor *cursor, NodeDefragFunc move,
+                NodeDefragStopFunc stop, void *ctx) {
+    __defragState s = {.cursor = cursor,
+                       .move = move,
+                       .stop = stop,
+                       .ctx = ctx,
+                       .resuming = cursor->depth > 0};
+    *root = __defrag_tree(&s, *root, 0);
+    if (s.stopped) return 0;
+
+    cursor->depth = 0;
+    return 1;
+}
+
 void __objTraverse(Node *n, NodeVisitor f, void *ctx) {
-    t_dict *o = &n->value.dictval;
+    int len = Node_Length(n);
 
     f(n, ctx);
-    for (int i = 0; i < o->len; i++) {
-        Node_Traverse(o->entries[i], f, ctx);
+    for (int i = 0; i < len; i++) {
+        Node *val;
+        __obj_entry(n, i, &val);
+        Node_Traverse(val, f, ctx);
     }
 }
 void __arrTraverse(Node *n, NodeVisitor f, void *ctx) {
-    t_array *a = &n->value.arrval;
+    t_array *a = n->value.arrval;
     f(n, ctx);
 
     for (int i = 0; i < a->len; i++) {
-        Node_Traverse(a->entries[i], f, ctx);
+        Node_Traverse(__arr_item(n, i), f, ctx);
     }
 }
 
@@ -472,13 +1995,14 @@ void Node_Print(Node *n, int depth) {
     }
     switch (n->type) {
         case N_NULL:    // stop the compiler from complaining
+        case N_KEYVAL:
             break;
         case N_ARRAY: {
             printf("[\n");
-            for (int i = 0; i < n->value.arrval.len; i++) {
+            for (int i = 0; i < n->value.arrval->len; i++) {
                 __node_indent(depth + 1);
-                Node_Print(n->value.arrval.entries[i], depth + 1);
-                if (i < n->value.arrval.len - 1) printf(",");
+                Node_Print(__arr_item(n, i), depth + 1);
+                if (i < n->value.arrval->len - 1) printf(",");
                 printf("\n");
             }
             __node_indent(depth);
@@ -486,11 +2010,15 @@ void Node_Print(Node *n, int depth) {
         } break;
 
         case N_DICT: {
+            int len = Node_Length(n);
             printf("{\n");
-            for (int i = 0; i < n->value.dictval.len; i++) {
+            for (int i = 0; i < len; i++) {
+                Node *val;
+                t_key *k = __obj_entry(n, i, &val);
                 __node_indent(depth + 1);
-                Node_Print(n->value.dictval.entries[i], depth + 1);
-                if (i < n->value.dictval.len - 1) printf(",");
+                printf("\"%.*s\": ", k->len, k->data);
+                Node_Print(val, depth + 1);
+                if (i < len - 1) printf(",");
                 printf("\n");
             }
             __node_indent(depth);
@@ -505,12 +2033,11 @@ void Node_Print(Node *n, int depth) {
         case N_INTEGER:
             printf("%lld", (long long)n->value.intval);
             break;
-        case N_KEYVAL: {
-            printf("\"%s\": ", n->value.kvval.key);
-            Node_Print(n->value.kvval.val, depth);
-        } break;
         case N_STRING:
-            printf("\"%.*s\"", n->value.strval.len, n->value.strval.data);
+            printf("\"%.*s\"", NODE_STRLEN(n), NODE_STRDATA(n));
+            break;
+        case N_BINARY:
+            printf("<%u bytes>", NODE_STRLEN(n));
     }
 }
 
@@ -553,7 +2080,6 @@ void Node_Serializer(const Node *n, const NodeSerializerOpt *o, void *ctx) {
     Node *curr_node = NULL;
     int curr_len = 0;
     int curr_index = 0;
-    Node **curr_entries = NULL;
     NodeSerializerStack stack = {0};
     NodeSerializerState state = S_INIT;
 
@@ -574,16 +2100,10 @@ void Node_Serializer(const Node *n, const NodeSerializerOpt *o, void *ctx) {
                 break;
             case S_CONT_VALUE:  // container values
                 if (N_DICT == curr_node->type) {
-                    curr_len = curr_node->value.dictval.len;
-                    curr_entries = curr_node->value.dictval.entries;
+                    curr_len = Node_Length(curr_node);
                     state = S_CONTAINER;
                 } else if (N_ARRAY == curr_node->type) {
-                    curr_len = curr_node->value.arrval.len;
-                    curr_entries = curr_node->value.arrval.entries;
-                    state = S_CONTAINER;
-                } else if (N_KEYVAL == curr_node->type) {
-                    curr_len = 1;
-                    curr_entries = &curr_node->value.kvval.val;
+                    curr_len = curr_node->value.arrval->len;
                     state = S_CONTAINER;
                 } else {
                     state = S_END_VALUE;  // must be non-container
@@ -594,7 +2114,14 @@ void Node_Serializer(const Node *n, const NodeSerializerOpt *o, void *ctx) {
                 if (curr_index < curr_len) {
                     if (curr_index && _maskenabled(curr_node, o->xDelim)) o->fDelim(ctx);
                     Vector_Put(stack.indices, stack.level - 1, curr_index + 1);
-                    _serializerPush(&stack, curr_entries[curr_index]);
+                    if (N_DICT == curr_node->type) {
+                        Node *val;
+                        t_key *k = __obj_entry(curr_node, curr_index, &val);
+                        if (o->fKey) o->fKey(k->data, k->len, ctx);
+                        _serializerPush(&stack, val);
+                    } else {
+                        _serializerPush(&stack, __arr_item(curr_node, curr_index));
+                    }
                     state = S_BEGIN_VALUE;
                 } else {
                     state = S_END_VALUE;
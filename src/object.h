@@ -24,6 +24,9 @@
 #include <string.h>
 #include <sys/param.h>
 #include <vector.h>
+#include "arena.h"
+#include "keytable.h"
+#include "shape.h"
 #include "valkeymodule.h"
 #include "vkmstrndup.h"
 
@@ -43,76 +46,188 @@ typedef enum {
     N_BOOLEAN = 0x10,
     N_DICT = 0x20,
     N_ARRAY = 0x40,
-    N_KEYVAL = 0x80
+    N_KEYVAL = 0x80,    // tags dict keys in serializations (e.g. RDB), not an actual node
     // N_DATETIME = 0x100
-    // N_BINARY = 0x200
+    N_BINARY = 0x200    // raw bytes, which are stored like strings and are base64 in JSON
 } NodeType;
 
-#define NODE_IS_SCALAR(n) (!n ? 1 : (int)(n->type & (N_STRING | N_NUMBER | N_INTEGER | N_BOOLEAN)))
+#define NODE_IS_SCALAR(n) \
+    (!n ? 1 : (int)(n->type & (N_STRING | N_NUMBER | N_INTEGER | N_BOOLEAN | N_BINARY)))
 
-struct t_node;
+/* Strings and binary values keep their data the same way */
+#define NODE_HAS_BYTES(n) ((n)->type & (N_STRING | N_BINARY))
 
-/*
-* Internal representation of a string with data and length
-*/
-typedef struct {
-    const char *data;
-    uint32_t len;
-} t_string;
+struct t_node;
 
 /*
-* Internal representation of an array, that has a length and capacity
+* Internal representation of an array, a header that has a length and capacity and is followed by
+* the entries.
+* The items don't necessarily start at the first entry: arrays are double-ended, and the array node
+* keeps the number of unused entries before the first item, so items are added and removed at the
+* head without moving the rest. Tables always start at their first row.
+* Arrays of numbers and arrays of booleans are packed, per the array node's encoding: numbers are
+* stored as a contiguous array of nodes instead of pointers to them, and booleans as a bitmap. The
+* first element of another type converts the array back to pointers.
 */
 typedef struct {
-    struct t_node **entries;
     uint32_t len;
     uint32_t cap;
+    struct t_node *entries[];
 } t_array;
 
 /*
 * Internal representation of a key-value pair in an object.
-* The key is a NULL terminated C-string, the value is another node
+* Pairs are stored inline in the dictionary's entries, the key is interned and the value is another
+* node
 */
 typedef struct {
-    const char *key;
+    t_key *key;
     struct t_node *val;
 } t_keyval;
 
+/* Dictionaries with at least this many entries are indexed by a hash table */
+#define DICT_INDEX_THRESHOLD 32
+
+/*
+* Internal representation of a table, an array of objects that have the same shape that is stored
+* column-wise.
+* The header is followed by a row node for every object and a column of cells for every key of the
+* shape, all in a single allocation. Row nodes are dictionary nodes that point back to the table, so
+* objects are looked up without being materialized. Cells are nodes that hold scalars in place and
+* reference containers. The first element of another shape converts the table back to an array of
+* pointers to dictionaries.
+*/
+typedef struct {
+    uint32_t len;  // number of rows, the same as an array's length
+    uint32_t cap;
+    t_shape *shape;
+    struct t_node *owner;  // the array node
+} t_table;
+
+/* Arrays of at least this many objects are stored as tables, if the objects have the same shape */
+#define TABLE_MIN_ROWS 4
+
 /*
 * Internal representation of a dictionary node.
-* Currently implemented as a list of key-value pairs, will be converted
-* to a hash-table on big objects in the future
+* Implemented as an insertion-ordered list of key-value pairs that follows the header. Once a
+* dictionary grows past DICT_INDEX_THRESHOLD entries it also keeps an open-addressing (linear
+* probing) index of entry positions, so lookups in big objects don't need to scan all keys. An index
+* slot holds the position of the entry plus one, and 0 marks an empty slot.
 */
 typedef struct {
-    struct t_node **entries;
     uint32_t len;
     uint32_t cap;
+    uint32_t *index;  // NULL for small dictionaries
+    uint32_t icap;    // index capacity, always a power of 2
+    t_keyval entries[];
 } t_dict;
 
+/*
+* Internal representation of a shaped dictionary node, an object with fewer than SHAPE_MAX_KEYS
+* keys. The keys are those of the shared shape, so the dictionary only holds the values in the
+* order of the shape's keys. Adding or removing a key moves the dictionary to another shape, and it
+* gets keys of its own (as a t_dict) once it has too many.
+*/
+typedef struct {
+    uint32_t len;  // the shape's number of keys
+    uint32_t cap;
+    t_shape *shape;
+    struct t_node *vals[];
+} t_sdict;
+
+/* The longest string that is stored in the node itself, sans the terminating NULL */
+#define NODE_INLINE_STRLEN 11
+
+/* Node flags */
+#define NODE_F_INLINE 0x1  // the string's data is stored inline
+#define NODE_F_STATIC 0x2  // a shared immutable node that is never freed
+#define NODE_F_ARENA 0x4      // the node is allocated from an arena
+#define NODE_F_ARENADATA 0x8  // the string's data or container's header is allocated from an arena
+#define NODE_F_EMBEDDED 0x40  // the node is stored in its container and is never freed by itself
+
+/* Container encodings, in the node's flags */
+#define NODE_ENC_MASK 0x30
+#define NODE_ENC_PACKNUM 0x10   // an array of number nodes that are stored inline
+#define NODE_ENC_PACKBOOL 0x20  // an array of booleans that are stored as a bitmap
+#define NODE_ENC_TABLE 0x30     // an array of objects that is stored column-wise, or its rows
+#define NODE_ENC_SHAPED 0x10    // a dictionary whose keys are those of a shape
+#define NODE_ENCODING(n) ((n)->flags & NODE_ENC_MASK)
+
+/* Integers in this range are represented by shared static nodes */
+#define NODE_SHARED_INT_MIN -128
+#define NODE_SHARED_INT_MAX 1023
+
 /*
 * A node in an object can be any one of the types we support.
 * Basically an object is just a treee of nodes that can have children
 * if they are of type dict or array.
+*
+* Nodes are 16 bytes: an 8 byte value, the length of heap strings and a 4 byte tag with the type,
+* flags and the length of inline strings. Short strings are stored in place of the value and the
+* length, and containers point to a header that is allocated along with their entries.
 */
 typedef struct t_node {
-    // the actual value of the node
     union {
-        int boolval;
-        double numval;
-        int64_t intval;
-        t_string strval;
-        t_array arrval;
-        t_dict dictval;
-        t_keyval kvval;
-    } value;
-
-    // type specifier
-    NodeType type;
+        struct {
+            // the actual value of the node
+            union {
+                int boolval;
+                double numval;
+                int64_t intval;
+                char *strval;  // NULL terminated
+                t_array *arrval;
+                t_dict *dictval;
+                t_sdict *sdictval;
+                t_table *tblval;     // the table of a table array or of a row node
+                struct t_node *ref;  // the container that a table cell references
+            } value;
+
+            uint32_t len;   // string length, the index of a row node, or an array's head offset
+            uint16_t type;  // type specifier
+            uint8_t flags;
+            uint8_t slen;  // inline string length, or log2 of an appended string's capacity
+        };
+        char sso[NODE_INLINE_STRLEN + 1];  // inline string data (overlays the value and length)
+    };
 } Node;
 
+/* String and binary node accessors */
+#define NODE_STRDATA(n) ((n)->flags & NODE_F_INLINE ? (const char *)(n)->sso : (n)->value.strval)
+#define NODE_STRLEN(n) ((n)->flags & NODE_F_INLINE ? (uint32_t)(n)->slen : (n)->len)
+
+/* The allocation size of a heap string's data. Strings are allocated with just their terminator,
+ * until they are appended to, from then on they have a power of 2 capacity so appending is
+ * amortized. */
+#define STRING_ALLOC_SIZE(n) ((n)->slen ? (size_t)1 << (n)->slen : (size_t)(n)->len + 1)
+
 typedef Node Object;
 
-/** Create a new boolean node, with 0 as false 1 as true */
+/* Packed array accessors */
+#define ARRAY_NUMS(a) ((Node *)(a)->entries)
+#define ARRAY_BITS(a) ((uint64_t *)(a)->entries)
+
+/* The allocation size of an array's header and entries, per the encoding in the array node's flags,
+ * except for tables */
+#define ARRAY_ALLOC_SIZE(flags, cap)                                                  \
+    (sizeof(t_array) +                                                                \
+     (((flags)&NODE_ENC_MASK) == NODE_ENC_PACKNUM                                     \
+          ? (size_t)(cap) * sizeof(Node)                                              \
+          : ((flags)&NODE_ENC_MASK) == NODE_ENC_PACKBOOL ? ((size_t)(cap) + 63) / 64 * 8 \
+                                                        : (size_t)(cap) * sizeof(Node *)))
+
+/* Table accessors */
+#define TABLE_ROWS(t) ((Node *)((t) + 1))
+#define TABLE_COL(t, c) (TABLE_ROWS(t) + (size_t)(t)->cap * (1 + (c)))
+#define TABLE_ALLOC_SIZE(ncols, cap) \
+    (sizeof(t_table) + (size_t)(cap) * (1 + (ncols)) * sizeof(Node))
+
+/* A row node is a view of an object in a table */
+#define NODE_IS_ROW(n) (N_DICT == (n)->type && NODE_ENC_TABLE == NODE_ENCODING(n))
+
+/**
+* Create a new boolean node, with 0 as false 1 as true.
+* NOTE: booleans and small integers are shared static nodes, so scalar nodes must never be modified
+*/
 Node *NewBoolNode(int val);
 
 /** Create a new double node with the given value */
@@ -123,22 +238,25 @@ Node *NewIntNode(int64_t val);
 
 /**
 * Create a new string node with the given c-string and its length.
-* NOTE: The string's value will be copied to a newly allocated string
+* NOTE: The string's value will be copied, either into the node if it is short enough or to a newly
+* allocated string
 */
 Node *NewStringNode(const char *s, uint32_t len);
 
 /**
-* Create a new string node from a NULL terminated c-string. #ifdef 0
-* NOTE: The string's value will be copied to a newly allocated string
+* Create a new string node of the given length, and set data to where the caller writes its value.
+* The data is zeroed and terminated, like that of NewStringNode.
 */
-Node *NewCStringNode(const char *su);
+Node *NewStringNodeBuffer(uint32_t len, char **data);
+
+/** Create a new binary node with a copy of the given bytes, which are stored like a string's */
+Node *NewBinaryNode(const char *s, uint32_t len);
 
 /**
-* Create a new keyval node from a C-string and its length as key and a pointer
-* to a Node as value.
+* Create a new string node from a NULL terminated c-string. #ifdef 0
 * NOTE: The string's value will be copied to a newly allocated string
 */
-Node *NewKeyValNode(const char *key, uint32_t len, Node *n);
+Node *NewCStringNode(const char *su);
 
 /** Create a new zero length array node with the given capacity */
 Node *NewArrayNode(uint32_t cap);
@@ -149,6 +267,87 @@ Node *NewDictNode(uint32_t cap);
 /** Free a node, and if needed free its allocated data and its children recursively */
 void Node_Free(Node *n);
 
+/**
+* Set the arena that new nodes (and their data) are allocated from, NULL for the heap.
+* Nodes that are allocated from an arena are released to it when freed, and the arena itself is
+* freed by its owner.
+*/
+void Node_SetArena(Arena *a);
+
+/** Returns the number of arena bytes that were released since the last call, and resets it */
+size_t Node_ArenaReleased(void);
+
+/**
+* Returns the net number of bytes that are allocated for nodes and their data by the calling
+* thread. The difference between two calls is the memory that the nodes created and freed in between
+* take up.
+*/
+size_t Node_Allocated(void);
+
+/** Deducts the memory of nodes that are going to be freed by another thread from Node_Allocated */
+void Node_HandOff(size_t memory);
+
+/**
+* Returns the memory that an allocation of size bytes for a node or its data takes up: the aligned
+* size of an arena allocation, or the allocator's actual size of a heap one (when it reports it).
+*/
+size_t Node_AllocSize(const void *p, size_t size, int arena);
+
+/**
+* Returns the memory that a node and its data take up, excluding its children's, as counted by
+* Node_Allocated. Interned keys and shapes are shared by all the documents and aren't included.
+*/
+size_t Node_MemoryUsage(const Node *n);
+
+/**
+* Returns the memory that a node and its children take up, as ObjectTypeMemoryUsage does, but stops
+* visiting them once it reaches limit bytes, so big values are cheap to tell apart from small ones.
+*/
+size_t Node_MemoryUsageUpTo(const Node *n, size_t limit);
+
+/**
+* Give a container's unused capacity back to the allocator when there is enough of it to be worth
+* a reallocation, e.g. after many of its items were removed. Scalars, objects of fewer than
+* SHAPE_MAX_KEYS keys and arena data are left as they are.
+*/
+void Node_ShrinkToFit(Node *n);
+
+/**
+* Re-encode a value and its children in the way that takes the least memory, as if it was built
+* from scratch: arrays of objects of the same shape become tables, arrays of numbers or booleans are
+* packed, and containers are shrunk to fit.
+*/
+void Node_Optimize(Node *n);
+
+/** Create a deep copy of a node, allocated according to the current arena */
+Node *Node_Clone(const Node *n);
+
+/* Moves an allocation, returns its new address or NULL if it stayed in place */
+typedef void *(*NodeDefragFunc)(void *ctx, void *ptr);
+
+/* Returns nonzero when defragmentation should stop for now */
+typedef int (*NodeDefragStopFunc)(void *ctx);
+
+/* Levels of containers that a defragmentation cursor can resume in */
+#define NODE_DEFRAG_MAX_DEPTH 16
+
+/* Where the defragmentation of a tree stopped, zero it to start from the root */
+typedef struct {
+    uint32_t depth;
+    uint32_t pos[NODE_DEFRAG_MAX_DEPTH];  // the position of the item at every level
+} NodeDefragCursor;
+
+/**
+* Defragments a tree of nodes by moving the nodes, strings and containers' headers with the move
+* function. Arena allocations, shared nodes and the interned keys and shapes stay in place. The stop
+* function is checked every so often, and once it returns nonzero the cursor records where the walk
+* stopped, so the next call resumes from there. As the cursor holds positions rather than pointers,
+* the tree may change between calls. Returns 1 once the whole tree is done, and 0 otherwise. The
+* root may move.
+*/
+int Node_Defrag(Node **root, NodeDefragCursor *cursor, NodeDefragFunc move,
+                NodeDefragStopFunc stop, void *ctx);
+
 /** Reports the length of the node's value if defined. Return a positive integer, and -1 otherwise.
  */
 int Node_Length(const Node *n);
@@ -162,6 +361,13 @@ int Node_StringAppend(Node *dst, Node *src);
 /** Deletes (and frees) the count of nodes from an array starting at index. */
 int Node_ArrayDelRange(Node *arr, const int index, const int count);
 
+/**
+* Removes the count of nodes from an array starting at index, and returns them as a new array to be
+* freed by the caller. Returns NULL if there's nothing to free, as the items of packed arrays and
+* the rows of tables are deleted right away.
+*/
+Node *Node_ArrayTakeRange(Node *arr, const int index, const int count);
+
 /** Insert nodes in sub to an array before the node at index. If the index is geq the array's
  * length the nodes are appended to the end of the array. Negative index values are interpreted as
  * beginning from the end. A negative index geq to the length is assumed as 0.
@@ -171,21 +377,41 @@ int Node_ArrayInsert(Node *arr, int index, Node *sub);
 /** Append a node to an array node. */
 int Node_ArrayAppend(Node *arr, Node *n);
 
+/**
+* Append a copy of a scalar node to an array node, e.g. one that's on the stack. Packed arrays store
+* numbers and booleans without allocating a node for them.
+*/
+int Node_ArrayAppendCopy(Node *arr, const Node *n);
+
 /** Prepend a node to an array node. */
 int Node_ArrayPrepend(Node *arr, Node *n);
 
 /**
-* Set an array's member at a given index to a new node.
-* If the index is out of range, we will return an error
+* Set an array's member at a given index to a new node, and free the old one.
+* If the index is out of range, we will return an error.
+* NOTE: packed arrays copy the node's value and free it, so use Node_ArrayItem to get the new member
 */
 int Node_ArraySet(Node *arr, int index, Node *n);
 
 /**
 * Retrieve an array item into Node n's pointer by index
-* Returns OBJ_ERR if the index is out of range
+* Returns OBJ_ERR if the index is out of range.
+* NOTE: items of packed arrays are stored in the array, so they are valid until it is modified
 */
 int Node_ArrayItem(Node *arr, int index, Node **n);
 
+/**
+* Store an array of objects that have the same keys, in the same order, as a table. Returns OBJ_OK
+* if the array is a table, or OBJ_ERR if it can't be one.
+*/
+int Node_ArrayTabulate(Node *arr);
+
+/**
+* Remove an item from an array and return it, or NULL if the index is out of range (or the item is
+* null). Items of packed arrays and rows of tables are returned as new nodes.
+*/
+Node *Node_ArrayTake(Node *arr, int index);
+
 /** Searches for the scalar n in arr between indices the inclusive start index and the exclusive
 * stop index. Index values can be negative. Out of range errors are treated by rounding the index to
 * the arrays start/end. An inverse index range will return unfound.
@@ -200,10 +426,24 @@ int Node_ArrayIndex(Node *arr, Node *n, int start, int stop);
 int Node_DictSet(Node *obj, const char *key, Node *n);
 
 /**
-* Set a keyval node in a dictionary.
-* If an existing node has the same key, we replace it and free the old keyval node
+* Like Node_DictSet, but with a binary safe key of the given length.
+* NOTE: The key is interned in the module-wide key table if a new entry is made
 */
-int Node_DictSetKeyVal(Node *obj, Node *kv);
+int Node_DictSetLen(Node *obj, const char *key, uint32_t len, Node *n);
+
+/**
+* Like Node_DictSetLen, but for dictionaries that are being built: big dictionaries get the entry
+* appended without looking for its key, so they may hold duplicate keys and must not be used until
+* Node_DictDedupe is called.
+*/
+int Node_DictAppendLen(Node *obj, const char *key, uint32_t len, Node *n);
+
+/**
+* Resolves the duplicate keys of a dictionary that was built with Node_DictAppendLen in a single
+* hashed pass. Like with Node_DictSetLen, the last value of a key replaces the others at the
+* position of the key's first entry.
+*/
+void Node_DictDedupe(Node *obj);
 
 /**
 * Delete an item from the dict node by key. Returns OBJ_ERR if the key was
@@ -211,6 +451,12 @@ int Node_DictSetKeyVal(Node *obj, Node *kv);
 */
 int Node_DictDel(Node *objm, const char *key);
 
+/**
+* Remove an item from the dict node by key and return its value, which isn't freed. Returns NULL if
+* the key was not found (or the value is null)
+*/
+Node *Node_DictTake(Node *obj, const char *key);
+
 /**
 * Get a dict node item by key, and put it Node val's pointer.
 * Return OBJ_ERR if the key was not found. Can put NULL into val
@@ -218,6 +464,12 @@ int Node_DictDel(Node *objm, const char *key);
 */
 int Node_DictGet(Node *obj, const char *key, Node **val);
 
+/**
+* Get the key (and its length) and the value of a dict node's item by its position.
+* Returns OBJ_ERR if the index is out of range
+*/
+int Node_DictItem(const Node *obj, int index, const char **key, uint32_t *len, Node **val);
+
 /* The type signature of visitor callbacks for node trees */
 typedef void (*NodeVisitor)(Node *, void *);
 void __objTraverse(Node *n, NodeVisitor f, void *ctx);
@@ -232,12 +484,14 @@ void Node_Traverse(Node *n, NodeVisitor f, void *ctx);
 /* The type signature of serializer callbacks for node trees */
 typedef void (*NodeSerializerValue)(Node *, void *);
 typedef void (*NodeSerializerContainer)(void *);
+typedef void (*NodeSerializerKey)(const char *, uint32_t, void *);
 
 /* The options container for the serializer */
 typedef struct {
     NodeSerializerValue fBegin;      // begin node serializer callback
     NodeSerializerValue fEnd;        // end node serializer callback
     NodeSerializerContainer fDelim;  // container node delimiter callback
+    NodeSerializerKey fKey;          // dict key callback, called before the key's value (optional)
     int xBegin, xEnd, xDelim;        // node type bitmasks
 } NodeSerializerOpt;
 
@@ -23,18 +23,23 @@ void *ObjectTypeRdbLoad(ValkeyModuleIO *rdb) {
     // IMPORTANT: no encoding version check here, this is up to the calller
     Vector *nodes = NULL;
     Vector *indices = NULL;
+    Vector *keys = NULL;
+    Vector *keylens = NULL;
     Node *node = NULL;
+    Node scalar = {0};  // a loaded number or boolean
     uint64_t len = 0;
     NodeType type = 0;
     size_t strlen = 0;
     char *str = NULL;
-    enum { S_INIT, S_BEGIN_VALUE, S_END_VALUE, S_CONTAINER, S_END } state = S_INIT;
+    enum { S_INIT, S_BEGIN_VALUE, S_END_SCALAR, S_END_VALUE, S_CONTAINER, S_END } state = S_INIT;
 
     while (S_END != state) {
         switch (state) {
             case S_INIT:  // Initial state
                 nodes = NewVector(Node *, 1);
                 indices = NewVector(uint64_t, 1);
+                keys = NewVector(char *, 1);
+                keylens = NewVector(size_t, 1);
                 type = (NodeType)ValkeyModule_LoadUnsigned(rdb);
                 state = S_BEGIN_VALUE;
                 break;
@@ -46,31 +51,31 @@ void *ObjectTypeRdbLoad(ValkeyModuleIO *rdb) {
                         break;
                     case N_BOOLEAN:
                         str = ValkeyModule_LoadStringBuffer(rdb, &strlen);
-                        node = NewBoolNode('1' == str[0]);
+                        scalar = (Node){.type = N_BOOLEAN, .value.boolval = '1' == str[0]};
                         ValkeyModule_Free(str);
-                        state = S_END_VALUE;
+                        state = S_END_SCALAR;
                         break;
                     case N_INTEGER:
-                        node = NewIntNode(ValkeyModule_LoadSigned(rdb));
-                        state = S_END_VALUE;
+                        scalar = (Node){.type = N_INTEGER, .value.intval = ValkeyModule_LoadSigned(rdb)};
+                        state = S_END_SCALAR;
                         break;
                     case N_NUMBER:
-                        node = NewDoubleNode(ValkeyModule_LoadDouble(rdb));
-                        state = S_END_VALUE;
+                        scalar = (Node){.type = N_NUMBER, .value.numval = ValkeyModule_LoadDouble(rdb)};
+                        state = S_END_SCALAR;
                         break;
                     case N_STRING:
+                    case N_BINARY:
                         str = ValkeyModule_LoadStringBuffer(rdb, &strlen);
-                        node = NewStringNode(str, strlen);
+                        node = N_STRING == type ? NewStringNode(str, strlen)
+                                                : NewBinaryNode(str, strlen);
                         ValkeyModule_Free(str);
                         state = S_END_VALUE;
                         break;
-                    case N_KEYVAL:
+                    case N_KEYVAL:  // a dict's key, followed by its value
                         str = ValkeyModule_LoadStringBuffer(rdb, &strlen);
-                        node = NewKeyValNode(str, strlen, NULL);
-                        Vector_Push(nodes, node);
-                        Vector_Push(indices, (uint64_t)1);
-                        ValkeyModule_Free(str);
-                        state = S_CONTAINER;
+                        Vector_Push(keys, str);
+                        Vector_Push(keylens, strlen);
+                        type = (NodeType)ValkeyModule_LoadUnsigned(rdb);
                         break;
                     case N_DICT:
                         len = ValkeyModule_LoadUnsigned(rdb);
@@ -88,16 +93,29 @@ void *ObjectTypeRdbLoad(ValkeyModuleIO *rdb) {
                         break;
                 }  // switch (type)
                 break;
+            case S_END_SCALAR:
+                // packed arrays store numbers and booleans without a node
+                if (Vector_Size(nodes)) {
+                    Vector_Get(nodes, Vector_Last(nodes), &node);
+                    if (N_ARRAY == node->type) {
+                        Node_ArrayAppendCopy(node, &scalar);
+                        state = S_CONTAINER;
+                        break;
+                    }
+                }
+                node = Node_Clone(&scalar);
+                state = S_END_VALUE;
+                break;
             case S_END_VALUE:
                 if (Vector_Size(nodes)) {  // in case the new node has a parent
                     Node *container;
                     Vector_Get(nodes, Vector_Last(nodes), &container);
                     switch (container->type) {  // add it
-                        case N_KEYVAL:
-                            container->value.kvval.val = node;
-                            break;
                         case N_DICT:
-                            Node_DictSetKeyVal(container, node);
+                            Vector_Pop(keys, &str);
+                            Vector_Pop(keylens, &strlen);
+                            Node_DictSetLen(container, str, strlen, node);
+                            ValkeyModule_Free(str);
                             break;
                         case N_ARRAY:
                             Node_ArrayAppend(container, node);
@@ -118,6 +136,8 @@ void *ObjectTypeRdbLoad(ValkeyModuleIO *rdb) {
                 } else {
                     Vector_Pop(indices, NULL);
                     Vector_Pop(nodes, &node);
+                    // arrays of objects with the same keys are stored as tables
+                    if (N_ARRAY == node->type) Node_ArrayTabulate(node);
                     state = S_END_VALUE;
                 }
                 break;
@@ -126,6 +146,8 @@ void *ObjectTypeRdbLoad(ValkeyModuleIO *rdb) {
         }  // switch (state)
     }      //    while (S_END != state)
 
+    Vector_Free(keylens);
+    Vector_Free(keys);
     Vector_Free(indices);
     Vector_Free(nodes);
     return (void *)node;
@@ -150,32 +172,59 @@ void _ObjectTypeSave_Begin(Node *n, void *ctx) {
                 ValkeyModule_SaveDouble(rdb, n->value.numval);
                 break;
             case N_STRING:
-                ValkeyModule_SaveStringBuffer(rdb, n->value.strval.data, n->value.strval.len);
-                break;
-            case N_KEYVAL:
-                ValkeyModule_SaveStringBuffer(rdb, n->value.kvval.key, strlen(n->value.kvval.key));
+            case N_BINARY:
+                ValkeyModule_SaveStringBuffer(rdb, NODE_STRDATA(n), NODE_STRLEN(n));
                 break;
             case N_DICT:
-                ValkeyModule_SaveUnsigned(rdb, n->value.dictval.len);
+                ValkeyModule_SaveUnsigned(rdb, Node_Length(n));
                 break;
             case N_ARRAY:
-                ValkeyModule_SaveUnsigned(rdb, n->value.arrval.len);
+                ValkeyModule_SaveUnsigned(rdb, n->value.arrval->len);
                 break;
             case N_NULL:  // keeps the compiler from complaining
+            case N_KEYVAL:
                 break;
         }
     }
 }
 
+void _ObjectTypeSave_Key(const char *key, uint32_t len, void *ctx) {
+    ValkeyModuleIO *rdb = (ValkeyModuleIO *)ctx;
+
+    // keys are saved as keyval tags, followed by the value
+    ValkeyModule_SaveUnsigned(rdb, N_KEYVAL);
+    ValkeyModule_SaveStringBuffer(rdb, key, len);
+}
+
 void ObjectTypeRdbSave(ValkeyModuleIO *rdb, void *value) {
     Node *node = (Node *)value;
     NodeSerializerOpt nso = {0};
 
     nso.fBegin = _ObjectTypeSave_Begin;
-    nso.xBegin = 0xff;  // mask for all basic types
+    nso.xBegin = 0xffff;  // mask for all basic types
+    nso.fKey = _ObjectTypeSave_Key;
     Node_Serializer(node, &nso, rdb);
 }
 
+void ObjectTypeRdbSaveCompact(ValkeyModuleIO *rdb, const char *c) {
+    NodeSerializerOpt nso = {0};
+
+    // saved exactly as the nodes it encodes
+    nso.fBegin = _ObjectTypeSave_Begin;
+    nso.xBegin = 0xffff;
+    nso.fKey = _ObjectTypeSave_Key;
+    Compact_Serializer(c, &nso, rdb);
+}
+
+void ObjectTypeRdbSaveTape(ValkeyModuleIO *rdb, const uint64_t *t) {
+    NodeSerializerOpt nso = {0};
+
+    nso.fBegin = _ObjectTypeSave_Begin;
+    nso.xBegin = 0xffff;
+    nso.fKey = _ObjectTypeSave_Key;
+    Tape_Serializer(t, &nso, rdb);
+}
+
 void ObjectTypeFree(void *value) {
     if (value) Node_Free(value);
 }
@@ -197,64 +246,61 @@ void _ObjectTypeToResp_Begin(Node *n, void *ctx) {
                 ValkeyModule_ReplyWithDouble(rctx, n->value.numval);
                 break;
             case N_STRING:
-                ValkeyModule_ReplyWithStringBuffer(rctx, n->value.strval.data, n->value.strval.len);
-                break;
-            case N_KEYVAL:
-                ValkeyModule_ReplyWithArray(rctx, 2);
-                ValkeyModule_ReplyWithStringBuffer(rctx, n->value.kvval.key, strlen(n->value.kvval.key));
+            case N_BINARY:  // the raw bytes
+                ValkeyModule_ReplyWithStringBuffer(rctx, NODE_STRDATA(n), NODE_STRLEN(n));
                 break;
             case N_DICT:
-                ValkeyModule_ReplyWithArray(rctx, n->value.dictval.len + 1);
+                ValkeyModule_ReplyWithArray(rctx, Node_Length(n) + 1);
                 ValkeyModule_ReplyWithSimpleString(rctx, "{");
                 break;
             case N_ARRAY:
-                ValkeyModule_ReplyWithArray(rctx, n->value.arrval.len + 1);
+                ValkeyModule_ReplyWithArray(rctx, n->value.arrval->len + 1);
                 ValkeyModule_ReplyWithSimpleString(rctx, "[");
                 break;
             case N_NULL:  // keeps the compiler from complaining
+            case N_KEYVAL:
                 break;
         }
     }
 }
 
+void _ObjectTypeToResp_Key(const char *key, uint32_t len, void *ctx) {
+    ValkeyModuleCtx *rctx = (ValkeyModuleCtx *)ctx;
+
+    ValkeyModule_ReplyWithArray(rctx, 2);
+    ValkeyModule_ReplyWithStringBuffer(rctx, key, len);
+}
+
 void ObjectTypeToRespReply(ValkeyModuleCtx *ctx, const Node *node) {
     NodeSerializerOpt nso = {0};
 
     nso.fBegin = _ObjectTypeToResp_Begin;
-    nso.xBegin = 0xff;  // mask for all basic types
+    nso.xBegin = 0xffff;  // mask for all basic types
+    nso.fKey = _ObjectTypeToResp_Key;
     Node_Serializer(node, &nso, ctx);
 }
 
+void ObjectTypeCompactToRespReply(ValkeyModuleCtx *ctx, const char *c) {
+    NodeSerializerOpt nso = {0};
+
+    nso.fBegin = _ObjectTypeToResp_Begin;
+    nso.xBegin = 0xffff;
+    nso.fKey = _ObjectTypeToResp_Key;
+    Compact_Serializer(c, &nso, ctx);
+}
+
+void ObjectTypeTapeToRespReply(ValkeyModuleCtx *ctx, const uint64_t *t) {
+    NodeSerializerOpt nso = {0};
+
+    nso.fBegin = _ObjectTypeToResp_Begin;
+    nso.xBegin = 0xffff;
+    nso.fKey = _ObjectTypeToResp_Key;
+    Tape_Serializer(t, &nso, ctx);
+}
+
 void _ObjectTypeMemoryUsage(Node *n, void *ctx) {
     size_t *memory = (size_t *)ctx;
-
-    if (!n) {
-        // the null node takes no memory
-        return;
-    } else {
-        // account for the struct's size
-        *memory += sizeof(Node);
-        switch (n->type) {
-            case N_BOOLEAN:
-            case N_INTEGER:
-            case N_NUMBER:
-            case N_NULL:  // keeps the compiler from complaining
-                // these are stored in the node itself
-                return;
-            case N_STRING:
-                *memory += n->value.strval.len;
-                return;
-            case N_KEYVAL:
-                *memory += strlen(n->value.kvval.key);
-                return;
-            case N_DICT:
-                *memory += n->value.dictval.cap * sizeof(Node *);
-                return;
-            case N_ARRAY:
-                *memory += n->value.arrval.cap * sizeof(Node *);
-                return;
-        }
-    }
+    *memory += Node_MemoryUsage(n);
 }
 
 size_t ObjectTypeMemoryUsage(const void *value) {
@@ -263,7 +309,7 @@ size_t ObjectTypeMemoryUsage(const void *value) {
     size_t memory = 0;
 
     nso.fBegin = _ObjectTypeMemoryUsage;
-    nso.xBegin = 0xff;  // mask for all basic types
+    nso.xBegin = 0xffff;  // mask for all basic types
     Node_Serializer(node, &nso, &memory);
 
     return memory;
@@ -20,18 +20,28 @@
 
 #include <string.h>
 #include <vector.h>
+#include "compact.h"
 #include "object.h"
+#include "tape.h"
 #include "valkeymodule.h"
 
 /* Custom Valkey data type API. */
 void *ObjectTypeRdbLoad(ValkeyModuleIO *rdb);
 void ObjectTypeRdbSave(ValkeyModuleIO *rdb, void *value);
+void ObjectTypeRdbSaveCompact(ValkeyModuleIO *rdb, const char *c);
+void ObjectTypeRdbSaveTape(ValkeyModuleIO *rdb, const uint64_t *t);
 void ObjectTypeFree(void *value);
 
 /* Replies with a RESP representation of the node. */
 void ObjectTypeToRespReply(ValkeyModuleCtx *ctx, const Node *node);
 
-/* Reports the memory usage (in bytes) of the node. */
+/* Replies with a RESP representation of a compactly encoded value, the same as its nodes'. */
+void ObjectTypeCompactToRespReply(ValkeyModuleCtx *ctx, const char *c);
+
+/* Replies with a RESP representation of a tape encoded value, the same as its nodes'. */
+void ObjectTypeTapeToRespReply(ValkeyModuleCtx *ctx, const uint64_t *t);
+
+/* Reports the memory usage (in bytes) of the node and its descendants by visiting all of them. */
 size_t ObjectTypeMemoryUsage(const void *value);
 
 #endif
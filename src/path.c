@@ -28,7 +28,7 @@ Node *__pathNode_eval(PathNode *pn, Node *n, PathError *err) {
         if (NT_INDEX == pn->type) {
             int index = pn->value.index;
             // translate negative values
-            if (index < 0) index = n->value.arrval.len + index;            
+            if (index < 0) index = n->value.arrval->len + index;            
             int rc = Node_ArrayItem(n, index, &rn);
             if (rc != OBJ_OK) {
                 *err = E_NOINDEX;
@@ -0,0 +1,187 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "shape.h"
+#include "valkeymodule.h"
+
+// Extern
+ShapeTable jsonShapeTable_g = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* The root of all transitions, which isn't in the table and is never freed */
+static t_shape emptyShape = {0};
+
+static inline uint32_t transitionHash(const t_shape *parent, const t_key *k) {
+    return (uint32_t)((uintptr_t)parent >> 4) * 2654435761u ^ k->hash;
+}
+
+int Shape_Find(const t_shape *s, const t_key *k) {
+    if (s->index) {
+        uint32_t mask = s->icap - 1;
+        uint32_t slot = k->hash & mask;
+        uint8_t pos;
+        while ((pos = s->index[slot])) {
+            if (s->keys[pos - 1] == k) return pos - 1;
+            slot = (slot + 1) & mask;
+        }
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < s->len; i++) {
+        if (s->keys[i] == k) return i;
+    }
+    return -1;
+}
+
+// Rehash the shapes to twice the buckets (or the initial number of buckets)
+static void growTable(ShapeTable *st) {
+    size_t nbuckets = st->nbuckets ? st->nbuckets * 2 : SHAPETABLE_INITIAL_BUCKETS;
+    t_shape **buckets = ValkeyModule_Calloc(nbuckets, sizeof(t_shape *));
+
+    for (size_t i = 0; i < st->nbuckets; i++) {
+        t_shape *s = st->buckets[i];
+        while (s) {
+            t_shape *next = s->next;
+            size_t b = s->hash & (nbuckets - 1);
+            s->next = buckets[b];
+            buckets[b] = s;
+            s = next;
+        }
+    }
+
+    if (st->buckets) ValkeyModule_Free(st->buckets);
+    st->buckets = buckets;
+    st->nbuckets = nbuckets;
+}
+
+// Index the positions of the keys at a load factor of at most 1/2
+static void indexShape(t_shape *s) {
+    s->icap = 16;
+    while (s->icap < s->len * 2) s->icap <<= 1;
+    s->index = ValkeyModule_Calloc(s->icap, sizeof(uint8_t));
+
+    uint32_t mask = s->icap - 1;
+    for (uint32_t i = 0; i < s->len; i++) {
+        uint32_t slot = s->keys[i]->hash & mask;
+        while (s->index[slot]) slot = (slot + 1) & mask;
+        s->index[slot] = i + 1;
+    }
+}
+
+// Drop a reference to a shape, and free the shapes that are no longer used
+static void releaseShape(ShapeTable *st, t_shape *s) {
+    while (s != &emptyShape && !--s->refcount) {
+        // unlink the shape from its bucket
+        t_shape **ps = &st->buckets[s->hash & (st->nbuckets - 1)];
+        while (*ps != s) ps = &(*ps)->next;
+        *ps = s->next;
+
+        t_shape *parent = s->parent;
+        st->numShapes--;
+        st->numBytes -= SHAPE_ALLOC_SIZE(s);
+        KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, s->keys[s->len - 1]);
+        if (s->index) ValkeyModule_Free(s->index);
+        ValkeyModule_Free(s);
+        s = parent;
+    }
+}
+
+static t_shape *retainShape(ShapeTable *st, t_shape *s) {
+    st->numUses++;
+    if (s != &emptyShape) s->refcount++;
+    return s;
+}
+
+static t_shape *addShape(ShapeTable *st, t_shape *s, t_key *k) {
+    uint32_t hash = transitionHash(s, k);
+
+    st->transitions++;
+    st->numUses++;
+    if (st->nbuckets) {
+        for (t_shape *c = st->buckets[hash & (st->nbuckets - 1)]; c; c = c->next) {
+            if (c->hash == hash && c->parent == s && c->keys[c->len - 1] == k) {
+                st->hits++;
+                c->refcount++;
+                KeyTable_Release(VALKEYJSON_KEYTABLE_GLOBAL, k);
+                return c;
+            }
+        }
+    }
+
+    // keep the load factor under 1
+    if (st->numShapes >= st->nbuckets) growTable(st);
+
+    t_shape *c = ValkeyModule_Calloc(1, sizeof(t_shape) + (s->len + 1) * sizeof(t_key *));
+    c->parent = s;
+    if (s != &emptyShape) s->refcount++;
+    c->refcount = 1;
+    c->hash = hash;
+    c->len = s->len + 1;
+    memcpy(c->keys, s->keys, s->len * sizeof(t_key *));
+    c->keys[s->len] = k;
+    if (c->len >= SHAPE_INDEX_THRESHOLD) indexShape(c);
+
+    size_t b = hash & (st->nbuckets - 1);
+    c->next = st->buckets[b];
+    st->buckets[b] = c;
+    st->numShapes++;
+    st->numBytes += SHAPE_ALLOC_SIZE(c);
+
+    return c;
+}
+
+t_shape *ShapeTable_Empty(ShapeTable *st) { return ShapeTable_Retain(st, &emptyShape); }
+
+t_shape *ShapeTable_Add(ShapeTable *st, t_shape *s, t_key *k) {
+    pthread_mutex_lock(&st->lock);
+    t_shape *ret = addShape(st, s, k);
+    pthread_mutex_unlock(&st->lock);
+    return ret;
+}
+
+t_shape *ShapeTable_Remove(ShapeTable *st, t_shape *s, uint32_t pos) {
+    // go back to the shape before the key, and add the keys that follow it from there
+    t_shape *p = s;
+    while (p->len > pos) p = p->parent;
+
+    pthread_mutex_lock(&st->lock);
+    t_shape *ret = retainShape(st, p);
+    for (uint32_t i = pos + 1; i < s->len; i++) {
+        t_key *k = KeyTable_Retain(VALKEYJSON_KEYTABLE_GLOBAL, s->keys[i]);
+        t_shape *next = addShape(st, ret, k);
+        st->numUses--;
+        releaseShape(st, ret);
+        ret = next;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return ret;
+}
+
+t_shape *ShapeTable_Retain(ShapeTable *st, t_shape *s) {
+    pthread_mutex_lock(&st->lock);
+    retainShape(st, s);
+    pthread_mutex_unlock(&st->lock);
+    return s;
+}
+
+void ShapeTable_Release(ShapeTable *st, t_shape *s) {
+    pthread_mutex_lock(&st->lock);
+    st->numUses--;
+    releaseShape(st, s);
+    pthread_mutex_unlock(&st->lock);
+}
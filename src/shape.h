@@ -0,0 +1,95 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHAPE_H__
+#define __SHAPE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "keytable.h"
+
+/*
+* The shape of an object, its ordered list of interned keys.
+* Shapes are shared by all the objects, in all documents, that have the same keys in the same order,
+* so these only need to store their values. Shapes form a tree of transitions that is rooted at the
+* empty shape: every other shape is its parent plus one more key. Shapes with many keys also keep an
+* open-addressing index of key positions, which is shared by all of their objects.
+*/
+typedef struct t_shape {
+    struct t_shape *next;    // next shape in the table's bucket
+    struct t_shape *parent;  // the shape without the last key
+    uint32_t refcount;       // number of objects, tables and transitions that use the shape
+    uint32_t hash;           // hash of the transition from the parent
+    uint32_t len;            // number of keys
+    uint32_t icap;           // index capacity, always a power of 2, or 0 for small shapes
+    uint8_t *index;          // a slot holds the position of the key plus one, 0 marks an empty slot
+    t_key *keys[];
+} t_shape;
+
+/* The allocation size of a shape and its index */
+#define SHAPE_ALLOC_SIZE(s) (sizeof(t_shape) + (s)->len * sizeof(t_key *) + (s)->icap)
+
+/* Objects with at least this many keys have keys of their own instead of a shape */
+#define SHAPE_MAX_KEYS 32
+
+/* Shapes with at least this many keys are indexed */
+#define SHAPE_INDEX_THRESHOLD 8
+
+/*
+* A refcounted table of shapes, implemented as a chained hash table of transitions.
+*/
+typedef struct {
+    t_shape **buckets;
+    size_t nbuckets;   // always a power of 2
+    size_t numShapes;  // number of shapes in the table, sans the empty one
+    size_t numBytes;   // number of bytes used by the shapes
+    size_t numUses;    // number of objects and tables that use a shape
+
+    // statistics
+    size_t transitions;  // number of transitions made by adding keys
+    size_t hits;         // number of transitions to an existing shape
+    // documents are also freed by background threads, which release their shapes
+    pthread_mutex_t lock;
+} ShapeTable;
+
+#define SHAPETABLE_INITIAL_BUCKETS 256
+
+extern ShapeTable jsonShapeTable_g;
+#define VALKEYJSON_SHAPETABLE_GLOBAL (&jsonShapeTable_g)
+
+/* Returns the position of an interned key in a shape, or -1 if the shape doesn't have the key. */
+int Shape_Find(const t_shape *s, const t_key *k);
+
+/* Returns a reference to the empty shape. */
+t_shape *ShapeTable_Empty(ShapeTable *st);
+
+/* Returns a reference to the shape that adds a key to a shape, adding it to the table if needed.
+ * Takes over the caller's reference to the key. */
+t_shape *ShapeTable_Add(ShapeTable *st, t_shape *s, t_key *k);
+
+/* Returns a reference to the shape that removes the key at pos from a shape. */
+t_shape *ShapeTable_Remove(ShapeTable *st, t_shape *s, uint32_t pos);
+
+/* Returns another reference to a shape. */
+t_shape *ShapeTable_Retain(ShapeTable *st, t_shape *s);
+
+/* Releases a reference to a shape, the last one removes it (and unused parents) from the table. */
+void ShapeTable_Release(ShapeTable *st, t_shape *s);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tape.h"
+
+#define TAPE_WORD(tag, payload) ((uint64_t)(tag) << 56 | (uint64_t)(payload))
+
+/* Number of words that a string's bytes are padded to */
+#define TAPE_STRWORDS(len) (((len) + 7) / 8)
+
+/* === Encoding === */
+
+typedef struct {
+    uint64_t *words;
+    size_t len;
+    size_t cap;
+} _TapeEncoder;
+
+/* Appends n words to the tape, and returns the first one's position. */
+static size_t encoderReserve(_TapeEncoder *e, size_t n) {
+    if (e->len + n > e->cap) {
+        while (e->len + n > e->cap) e->cap *= 2;
+        e->words = ValkeyModule_Realloc(e->words, e->cap * sizeof(uint64_t));
+    }
+    size_t at = e->len;
+    e->len += n;
+    return at;
+}
+
+static void encodeString(_TapeEncoder *e, int tag, const char *s, size_t len) {
+    size_t at = encoderReserve(e, 1 + TAPE_STRWORDS(len));
+    e->words[at] = TAPE_WORD(tag, len);
+    if (len) {
+        e->words[at + TAPE_STRWORDS(len)] = 0;  // zero the padding
+        memcpy(&e->words[at + 1], s, len);
+    }
+}
+
+static void encodeValue(_TapeEncoder *e, const Node *n) {
+    size_t at;
+    if (!n) {
+        at = encoderReserve(e, 1);
+        e->words[at] = TAPE_WORD(TAPE_NULL, 0);
+        return;
+    }
+
+    switch (n->type) {
+        case N_BOOLEAN:
+            at = encoderReserve(e, 1);
+            e->words[at] = TAPE_WORD(n->value.boolval ? TAPE_TRUE : TAPE_FALSE, 0);
+            break;
+        case N_INTEGER:
+            at = encoderReserve(e, 2);
+            e->words[at] = TAPE_WORD(TAPE_INTEGER, 0);
+            memcpy(&e->words[at + 1], &n->value.intval, sizeof(uint64_t));
+            break;
+        case N_NUMBER:
+            at = encoderReserve(e, 2);
+            e->words[at] = TAPE_WORD(TAPE_NUMBER, 0);
+            memcpy(&e->words[at + 1], &n->value.numval, sizeof(uint64_t));
+            break;
+        case N_STRING:
+        case N_BINARY:
+            encodeString(e, N_STRING == n->type ? TAPE_STRING : TAPE_BINARY, NODE_STRDATA(n),
+                         NODE_STRLEN(n));
+            break;
+        case N_ARRAY: {
+            int len = Node_Length(n);
+            at = encoderReserve(e, 2);
+            for (int i = 0; i < len; i++) {
+                Node *item;
+                Node_ArrayItem((Node *)n, i, &item);
+                encodeValue(e, item);
+            }
+            // the array's size is known once its items are in
+            e->words[at] = TAPE_WORD(TAPE_ARRAY, e->len - at);
+            e->words[at + 1] = len;
+        } break;
+        case N_DICT: {
+            int len = Node_Length(n);
+            at = encoderReserve(e, 2);
+            for (int i = 0; i < len; i++) {
+                const char *key;
+                uint32_t keylen;
+                Node *val;
+                Node_DictItem(n, i, &key, &keylen, &val);
+                encodeString(e, TAPE_STRING, key, keylen);
+                encodeValue(e, val);
+            }
+            e->words[at] = TAPE_WORD(TAPE_DICT, e->len - at);
+            e->words[at + 1] = len;
+        } break;
+    }
+}
+
+uint64_t *Tape_Encode(const Node *n, size_t *len) {
+    _TapeEncoder e = {.cap = 64};
+    e.words = ValkeyModule_Alloc(e.cap * sizeof(uint64_t));
+    encodeValue(&e, n);
+
+    *len = e.len;
+    return e.len < e.cap ? ValkeyModule_Realloc(e.words, e.len * sizeof(uint64_t)) : e.words;
+}
+
+/* === Decoding === */
+
+size_t Tape_Size(const uint64_t *t) {
+    switch (TAPE_TAG(*t)) {
+        case TAPE_INTEGER:
+        case TAPE_NUMBER:
+            return 2;
+        case TAPE_STRING:
+        case TAPE_BINARY:
+            return 1 + TAPE_STRWORDS(TAPE_PAYLOAD(*t));
+        case TAPE_ARRAY:
+        case TAPE_DICT:
+            return TAPE_PAYLOAD(*t);
+        default:  // nulls and booleans are just their tag
+            return 1;
+    }
+}
+
+Node *Tape_Decode(const uint64_t *t) {
+    const uint64_t *p = t + 2;
+    Node *ret = NULL;
+
+    switch (TAPE_TAG(*t)) {
+        case TAPE_FALSE:
+        case TAPE_TRUE:
+            ret = NewBoolNode(TAPE_TRUE == TAPE_TAG(*t));
+            break;
+        case TAPE_INTEGER: {
+            int64_t i;
+            memcpy(&i, &t[1], sizeof(int64_t));
+            ret = NewIntNode(i);
+        } break;
+        case TAPE_NUMBER: {
+            double d;
+            memcpy(&d, &t[1], sizeof(double));
+            ret = NewDoubleNode(d);
+        } break;
+        case TAPE_STRING:
+            ret = NewStringNode((const char *)&t[1], TAPE_PAYLOAD(*t));
+            break;
+        case TAPE_BINARY:
+            ret = NewBinaryNode((const char *)&t[1], TAPE_PAYLOAD(*t));
+            break;
+        case TAPE_ARRAY:
+            ret = NewArrayNode(t[1]);
+            for (uint64_t i = 0; i < t[1]; i++, p += Tape_Size(p)) {
+                Node_ArrayAppend(ret, Tape_Decode(p));
+            }
+            // arrays of objects with the same keys are stored as tables
+            Node_ArrayTabulate(ret);
+            break;
+        case TAPE_DICT:
+            ret = NewDictNode(t[1]);
+            for (uint64_t i = 0; i < t[1]; i++) {
+                const char *key = (const char *)&p[1];
+                size_t keylen = TAPE_PAYLOAD(*p);
+                p += 1 + TAPE_STRWORDS(keylen);
+                Node_DictSetLen(ret, key, keylen, Tape_Decode(p));
+                p += Tape_Size(p);
+            }
+            break;
+        default:  // nulls are NULL nodes
+            break;
+    }
+
+    return ret;
+}
+
+NodeType Tape_Type(const uint64_t *t) {
+    switch (TAPE_TAG(*t)) {
+        case TAPE_FALSE:
+        case TAPE_TRUE:
+            return N_BOOLEAN;
+        case TAPE_INTEGER:
+            return N_INTEGER;
+        case TAPE_NUMBER:
+            return N_NUMBER;
+        case TAPE_STRING:
+            return N_STRING;
+        case TAPE_BINARY:
+            return N_BINARY;
+        case TAPE_ARRAY:
+            return N_ARRAY;
+        case TAPE_DICT:
+            return N_DICT;
+        default:
+            return N_NULL;
+    }
+}
+
+int Tape_Length(const uint64_t *t) {
+    switch (TAPE_TAG(*t)) {
+        case TAPE_STRING:
+        case TAPE_BINARY:
+            return TAPE_PAYLOAD(*t);
+        case TAPE_ARRAY:
+        case TAPE_DICT:
+            return t[1];
+        default:
+            return 0;
+    }
+}
+
+/* === Lookup === */
+
+PathError Tape_Find(const SearchPath *path, const uint64_t *root, const uint64_t **t,
+                    int *errlevel) {
+    const uint64_t *cur = root;
+    PathError err = E_OK;
+
+    for (int i = 0; i < path->len && E_OK == err; i++) {
+        PathNode *pn = &path->nodes[i];
+        int tag = TAPE_TAG(*cur);
+        if (TAPE_ARRAY == tag && NT_INDEX == pn->type) {
+            // translate negative indices
+            int64_t len = cur[1];
+            int64_t index = pn->value.index < 0 ? len + pn->value.index : pn->value.index;
+            if (index < 0 || index >= len) {
+                err = E_NOINDEX;
+            } else {
+                for (cur += 2; index--; cur += Tape_Size(cur))
+                    ;
+            }
+        } else if (TAPE_DICT == tag && NT_KEY == pn->type) {
+            size_t keylen = strlen(pn->value.key);
+            uint64_t len = cur[1];
+            err = E_NOKEY;
+            for (cur += 2; len--;) {
+                size_t l = TAPE_PAYLOAD(*cur);
+                const char *key = (const char *)&cur[1];
+                cur += 1 + TAPE_STRWORDS(l);
+                if (l == keylen && !memcmp(key, pn->value.key, l)) {
+                    err = E_OK;
+                    break;
+                }
+                cur += Tape_Size(cur);
+            }
+        } else {
+            err = E_BADTYPE;
+        }
+        if (E_OK != err) *errlevel = i;
+    }
+
+    *t = E_OK == err ? cur : NULL;
+    return err;
+}
+
+/* === Serialization === */
+
+#define _maskenabled(t, x) ((int)(t) & (x))
+
+void Tape_Serializer(const uint64_t *t, const NodeSerializerOpt *o, void *ctx) {
+    NodeType type = Tape_Type(t);
+
+    // containers are viewed through a header with just their length
+    t_array arr = {0};
+    t_dict dict = {0};
+    Node view = {.type = type};
+    Node *n = &view;
+
+    switch (TAPE_TAG(*t)) {
+        case TAPE_FALSE:
+        case TAPE_TRUE:
+            view.value.boolval = TAPE_TRUE == TAPE_TAG(*t);
+            break;
+        case TAPE_INTEGER:
+            memcpy(&view.value.intval, &t[1], sizeof(int64_t));
+            break;
+        case TAPE_NUMBER:
+            memcpy(&view.value.numval, &t[1], sizeof(double));
+            break;
+        case TAPE_STRING:
+        case TAPE_BINARY:
+            view.value.strval = (char *)&t[1];
+            view.len = TAPE_PAYLOAD(*t);
+            break;
+        case TAPE_ARRAY:
+            arr.len = t[1];
+            view.value.arrval = &arr;
+            break;
+        case TAPE_DICT:
+            dict.len = t[1];
+            view.value.dictval = &dict;
+            break;
+        default:
+            n = NULL;
+            break;
+    }
+
+    if (_maskenabled(type, o->xBegin)) o->fBegin(n, ctx);
+    if (N_ARRAY == type || N_DICT == type) {
+        const uint64_t *p = t + 2;
+        for (uint64_t i = 0; i < t[1]; i++) {
+            if (i && _maskenabled(type, o->xDelim)) o->fDelim(ctx);
+            if (N_DICT == type) {
+                size_t keylen = TAPE_PAYLOAD(*p);
+                if (o->fKey) o->fKey((const char *)&p[1], keylen, ctx);
+                p += 1 + TAPE_STRWORDS(keylen);
+            }
+            Tape_Serializer(p, o, ctx);
+            p += Tape_Size(p);
+        }
+    }
+    if (_maskenabled(type, o->xEnd)) o->fEnd(n, ctx);
+}
@@ -0,0 +1,82 @@
+/*
+ * ValkeyJSON - a JSON data type for Valkey
+ * Copyright (C) 2017 Redis Labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TAPE_H__
+#define __TAPE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "object.h"
+#include "path.h"
+
+/*
+* The tape encoding of a value is an array of 64 bit words, in which the value is written in
+* pre-order much like simdjson's tape. Every value starts with a word that has a tag in its top byte
+* and a payload in the rest:
+*   - nulls and booleans are just that word
+*   - integers and other numbers are followed by a word with their 64 bits
+*   - strings and binary values have their length as the payload, and are followed by their bytes
+*     padded to a word
+*   - arrays and objects have the number of words that they take as the payload, and are followed by
+*     a word with their count and then by their items, or by each entry's key (as a string) and value
+* Any value can be skipped in constant time, so lookups only visit the values along the path and
+* their preceding siblings, and serializing never looks up anything. The encoding is meant for big
+* documents that are read much more than they are written.
+*/
+#define TAPE_NULL 'n'
+#define TAPE_FALSE 'f'
+#define TAPE_TRUE 't'
+#define TAPE_INTEGER 'l'
+#define TAPE_NUMBER 'd'
+#define TAPE_STRING '"'
+#define TAPE_ARRAY '['
+#define TAPE_DICT '{'
+#define TAPE_BINARY 'b'
+
+#define TAPE_TAG(w) ((int)((w) >> 56))
+#define TAPE_PAYLOAD(w) ((w) & (((uint64_t)1 << 56) - 1))
+
+/** Encodes a value, and returns the tape and its size in words */
+uint64_t *Tape_Encode(const Node *n, size_t *len);
+
+/** Returns the number of words that an encoded value takes */
+size_t Tape_Size(const uint64_t *t);
+
+/** Creates the nodes of an encoded value, allocated according to the current arena */
+Node *Tape_Decode(const uint64_t *t);
+
+/** Returns the type of an encoded value */
+NodeType Tape_Type(const uint64_t *t);
+
+/** Returns the length of an encoded string, array or object, like Node_Length */
+int Tape_Length(const uint64_t *t);
+
+/**
+* Finds an encoded value by a path that isn't the root's, like SearchPath_FindEx: t is set to the
+* value that the path matches, or the error's level in the path is set to errlevel.
+*/
+PathError Tape_Find(const SearchPath *path, const uint64_t *root, const uint64_t **t,
+                    int *errlevel);
+
+/**
+* Walks an encoded value with callbacks like Node_Serializer does. The callbacks get nodes that are
+* views of the encoded values, like those of Compact_Serializer.
+*/
+void Tape_Serializer(const uint64_t *t, const NodeSerializerOpt *o, void *ctx);
+
+#endif
@@ -18,6 +18,7 @@
 
 #include "valkeyjson.h"
 #include "cache.h"
+#include "daemon.h"
 
 // A struct to keep module the module context
 typedef struct {
@@ -28,11 +29,16 @@ static ModuleCtx JSONCtx;
 // == Helpers ==
 #define NODEVALUE_AS_DOUBLE(n) (N_INTEGER == n->type ? (double)n->value.intval : n->value.numval)
 #define NODETYPE(n) (n ? n->type : N_NULL)
+#define JPNTYPE(jpn)                                                                               \
+    ((jpn)->c ? Compact_Type((jpn)->c) : (jpn)->t ? Tape_Type((jpn)->t) : NODETYPE((jpn)->n))
+#define JPNLENGTH(jpn)                                                                             \
+    ((jpn)->c ? Compact_Length((jpn)->c) : (jpn)->t ? Tape_Length((jpn)->t) : Node_Length((jpn)->n))
 struct JSONPathNode_t;
 static void maybeClearPathCache(JSONType_t *jt, const struct JSONPathNode_t *pn);
 /* Returns the string representation of a the node's type. */
 static inline char *NodeTypeStr(const NodeType nt) {
-    static char *types[] = {"null", "boolean", "integer", "number", "string", "object", "array"};
+    static char *types[] = {"null",   "boolean", "integer", "number",
+                            "string", "object",  "array",   "binary"};
     switch (nt) {
         case N_NULL:
             return types[0];
@@ -48,6 +54,8 @@ static inline char *NodeTypeStr(const NodeType nt) {
             return types[5];
         case N_ARRAY:
             return types[6];
+        case N_BINARY:
+            return types[7];
         case N_KEYVAL:
             return NULL;  // this **should** never be reached
     }
@@ -65,6 +73,8 @@ typedef struct JSONPathNode_t {
     size_t spathlen;     // the path's string length
     Node *n;             // the referenced node
     Node *p;             // its parent
+    const char *c;       // the referenced value instead of n and p, if the document is compact
+    const uint64_t *t;   // or if the document is a tape
     SearchPath sp;       // the search path
     char *sperrmsg;      // the search path error message
     size_t sperroffset;  // the search path error offset
@@ -80,11 +90,8 @@ void JSONPathNode_Free(JSONPathNode_t *jpn) {
     }
 }
 
-/* Sets n to the target node by path.
- * p is n's parent, errors are set into err and level is the error's depth
- * Returns PARSE_OK if parsing successful
- */
-int NodeFromJSONPath(Node *root, const ValkeyModuleString *path, JSONPathNode_t **jpn) {
+/* Parses a path into a new JSONPathNode_t, returns PARSE_OK if parsing successful */
+static int parseJSONPath(const ValkeyModuleString *path, JSONPathNode_t **jpn) {
     // initialize everything
     JSONPathNode_t *_jpn = ValkeyModule_Calloc(1, sizeof(JSONPathNode_t));
     _jpn->errlevel = -1;
@@ -102,6 +109,18 @@ int NodeFromJSONPath(Node *root, const ValkeyModuleString *path, JSONPathNode_t
         return PARSE_ERR;
     }
 
+    *jpn = _jpn;
+    return PARSE_OK;
+}
+
+/* Sets n to the target node by path.
+ * p is n's parent, errors are set into err and level is the error's depth
+ * Returns PARSE_OK if parsing successful
+ */
+int NodeFromJSONPath(Node *root, const ValkeyModuleString *path, JSONPathNode_t **jpn) {
+    if (PARSE_OK != parseJSONPath(path, jpn)) return PARSE_ERR;
+    JSONPathNode_t *_jpn = *jpn;
+
     // if there are any errors return them
     if (!SearchPath_IsRootPath(&_jpn->sp)) {
         _jpn->err = SearchPath_FindEx(&_jpn->sp, root, &_jpn->n, &_jpn->p, &_jpn->errlevel);
@@ -109,11 +128,48 @@ int NodeFromJSONPath(Node *root, const ValkeyModuleString *path, JSONPathNode_t
         // deal with edge case of setting root's parent
         _jpn->n = root;
     }
+    return PARSE_OK;
+}
 
-    *jpn = _jpn;
+/* Finds the target value of a path in an encoded document, in place */
+static void findEncodedValue(const JSONType_t *jt, JSONPathNode_t *jpn) {
+    if (SearchPath_IsRootPath(&jpn->sp)) {
+        jpn->err = E_OK;
+        jpn->c = jt->compact;
+        jpn->t = jt->tape;
+    } else if (jt->compact) {
+        jpn->err = Compact_Find(&jpn->sp, jt->compact, &jpn->c, &jpn->errlevel);
+    } else {
+        jpn->err = Tape_Find(&jpn->sp, jt->tape, &jpn->t, &jpn->errlevel);
+    }
+}
+
+/* Like NodeFromJSONPath, but sets c or t to the target value instead if the document is encoded,
+ * which is only good for reading it.
+ */
+int ValueFromJSONPath(const JSONType_t *jt, const ValkeyModuleString *path, JSONPathNode_t **jpn) {
+    if (!jt->compact && !jt->tape) return NodeFromJSONPath(jt->root, path, jpn);
+    if (PARSE_OK != parseJSONPath(path, jpn)) return PARSE_ERR;
+    findEncodedValue(jt, *jpn);
     return PARSE_OK;
 }
 
+/* Serializes the target value of a path */
+static void serializePathValue(const JSONPathNode_t *jpn, const JSONSerializeOpt *opt, sds *json) {
+    if (jpn->c) {
+        SerializeCompactToJSON(jpn->c, opt, json);
+    } else if (jpn->t) {
+        SerializeTapeToJSON(jpn->t, opt, json);
+    } else {
+        SerializeNodeToJSON(jpn->n, opt, json);
+    }
+}
+
+/* Returns new nodes of the target value of a path in an encoded document */
+static Node *decodePathValue(const JSONPathNode_t *jpn) {
+    return jpn->c ? Compact_Decode(jpn->c) : Tape_Decode(jpn->t);
+}
+
 /* Replies with an error about a search path */
 void ReplyWithSearchPathError(ValkeyModuleCtx *ctx, JSONPathNode_t *jpn) {
     sds err = sdscatfmt(sdsempty(), "ERR Search path error at offset %I: %s",
@@ -211,13 +267,19 @@ int JSONResp_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (3 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != ValueFromJSONPath(jt, spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
 
     if (E_OK == jpn->err) {
-        ObjectTypeToRespReply(ctx, jpn->n);
+        if (jpn->c) {
+            ObjectTypeCompactToRespReply(ctx, jpn->c);
+        } else if (jpn->t) {
+            ObjectTypeTapeToRespReply(ctx, jpn->t);
+        } else {
+            ObjectTypeToRespReply(ctx, jpn->n);
+        }
     } else {
         ReplyWithPathError(ctx, jpn);
         goto error;
@@ -237,11 +299,14 @@ error:
  *
  * Supported subcommands are:
  *   `MEMORY <key> [path]` - report the memory usage in bytes of a value. `path` defaults to root if
- *   not provided.
+ *   not provided. The root's total is kept up to date by every change to the document.
+ *   `KEYTABLE` - report the statistics of the interned object keys table
+ *   `SHAPES` - report the statistics of the shared object shapes table
  *  `HELP` - replies with a helpful message
  *
  * Reply: depends on the subcommand used:
  *   `MEMORY` returns an integer, specifically the size in bytes of the value
+ *   `KEYTABLE` and `SHAPES` return an array of statistic names and values
  *   `HELP` returns an array, specifically with the help message
  */
 int JSONDebug_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int argc) {
@@ -278,19 +343,33 @@ int JSONDebug_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
             return VALKEYMODULE_ERR;
         }
 
-        // validate path
+        // validate path, and deduct the values that have been freed in the background
         JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
+        JSONTypeSettle(jt);
         JSONPathNode_t *jpn = NULL;
         ValkeyModuleString *spath =
             (4 == argc ? argv[3] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-        if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+        if (PARSE_OK != ValueFromJSONPath(jt, spath, &jpn)) {
             ReplyWithSearchPathError(ctx, jpn);
             JSONPathNode_Free(jpn);
             return VALKEYMODULE_ERR;
         }
 
-        if (E_OK == jpn->err) {
+        // values in encoded documents are measured by the nodes they take once decoded
+        if (E_OK == jpn->err && (jpn->c || jpn->t) && !SearchPath_IsRootPath(&jpn->sp)) {
+            jpn->n = decodePathValue(jpn);
             ValkeyModule_ReplyWithLongLong(ctx, (long long)ObjectTypeMemoryUsage(jpn->n));
+            Node_Free(jpn->n);
+            JSONPathNode_Free(jpn);
+            return VALKEYMODULE_OK;
+        }
+
+        if (E_OK == jpn->err) {
+            // the document keeps its total up to date, other values are visited
+            size_t memory = SearchPath_IsRootPath(&jpn->sp)
+                                ? JSONTypeMemoryUsage(jt) - sizeof(JSONType_t)
+                                : ObjectTypeMemoryUsage(jpn->n);
+            ValkeyModule_ReplyWithLongLong(ctx, (long long)memory);
             JSONPathNode_Free(jpn);
             return VALKEYMODULE_OK;
         } else {
@@ -298,8 +377,57 @@ int JSONDebug_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
             JSONPathNode_Free(jpn);
             return VALKEYMODULE_ERR;
         }
+    } else if (!strncasecmp("keytable", subcmd, subcmdlen)) {
+        if (argc != 2) {
+            ValkeyModule_WrongArity(ctx);
+            return VALKEYMODULE_ERR;
+        }
+
+        // no keys are involved
+        if (ValkeyModule_IsKeysPositionRequest(ctx)) return VALKEYMODULE_OK;
+
+        const KeyTable *kt = VALKEYJSON_KEYTABLE_GLOBAL;
+        ValkeyModule_ReplyWithArray(ctx, 10);
+        ValkeyModule_ReplyWithSimpleString(ctx, "keys");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)kt->numKeys);
+        ValkeyModule_ReplyWithSimpleString(ctx, "bytes");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)(kt->numBytes + kt->nbuckets * sizeof(t_key *)));
+        ValkeyModule_ReplyWithSimpleString(ctx, "lookups");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)kt->lookups);
+        ValkeyModule_ReplyWithSimpleString(ctx, "hits");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)kt->hits);
+        ValkeyModule_ReplyWithSimpleString(ctx, "hit_ratio");
+        ValkeyModule_ReplyWithDouble(ctx, kt->lookups ? (double)kt->hits / kt->lookups : 0);
+        return VALKEYMODULE_OK;
+    } else if (!strncasecmp("shapes", subcmd, subcmdlen)) {
+        if (argc != 2) {
+            ValkeyModule_WrongArity(ctx);
+            return VALKEYMODULE_ERR;
+        }
+
+        // no keys are involved
+        if (ValkeyModule_IsKeysPositionRequest(ctx)) return VALKEYMODULE_OK;
+
+        const ShapeTable *st = VALKEYJSON_SHAPETABLE_GLOBAL;
+        ValkeyModule_ReplyWithArray(ctx, 12);
+        ValkeyModule_ReplyWithSimpleString(ctx, "shapes");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)st->numShapes);
+        ValkeyModule_ReplyWithSimpleString(ctx, "bytes");
+        ValkeyModule_ReplyWithLongLong(ctx,
+                                       (long long)(st->numBytes + st->nbuckets * sizeof(t_shape *)));
+        ValkeyModule_ReplyWithSimpleString(ctx, "objects");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)st->numUses);
+        ValkeyModule_ReplyWithSimpleString(ctx, "sharing_ratio");
+        ValkeyModule_ReplyWithDouble(ctx, st->numShapes ? (double)st->numUses / st->numShapes : 0);
+        ValkeyModule_ReplyWithSimpleString(ctx, "transitions");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)st->transitions);
+        ValkeyModule_ReplyWithSimpleString(ctx, "hits");
+        ValkeyModule_ReplyWithLongLong(ctx, (long long)st->hits);
+        return VALKEYMODULE_OK;
     } else if (!strncasecmp("help", subcmd, subcmdlen)) {
         const char *help[] = {"MEMORY <key> [path] - reports memory usage",
+                              "KEYTABLE            - reports interned keys statistics",
+                              "SHAPES              - reports object shapes statistics",
                               "HELP                - this message", NULL};
 
         ValkeyModule_ReplyWithArray(ctx, VALKEYMODULE_POSTPONED_ARRAY_LEN);
@@ -348,7 +476,7 @@ int JSONType_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (3 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != ValueFromJSONPath(jt, spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         JSONPathNode_Free(jpn);
         return VALKEYMODULE_ERR;
@@ -356,7 +484,7 @@ int JSONType_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
 
     // make the type-specifc reply, or deal with path errors
     if (E_OK == jpn->err) {
-        ValkeyModule_ReplyWithSimpleString(ctx, NodeTypeStr(NODETYPE(jpn->n)));
+        ValkeyModule_ReplyWithSimpleString(ctx, NodeTypeStr(JPNTYPE(jpn)));
     } else {
         // reply with null if there are **any** non-existing elements along the path
         ValkeyModule_ReplyWithNull(ctx);
@@ -404,7 +532,7 @@ int JSONLen_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (3 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != ValueFromJSONPath(jt, spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -416,7 +544,7 @@ int JSONLen_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
     }
 
     // determine the type of target value based on command name
-    NodeType expected, actual = NODETYPE(jpn->n);
+    NodeType expected, actual = JPNTYPE(jpn);
     if (!strcasecmp("json.arrlen", cmd))
         expected = N_ARRAY;
     else if (!strcasecmp("json.objlen", cmd))
@@ -426,7 +554,7 @@ int JSONLen_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
 
     // reply with the length per type, or with an error if the wrong type is encountered
     if (actual == expected) {
-        ValkeyModule_ReplyWithLongLong(ctx, Node_Length(jpn->n));
+        ValkeyModule_ReplyWithLongLong(ctx, JPNLENGTH(jpn));
     } else {
         ReplyWithPathTypeError(ctx, expected, actual);
         goto error;
@@ -474,7 +602,7 @@ int JSONObjKeys_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, i
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (3 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != ValueFromJSONPath(jt, spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -490,16 +618,20 @@ int JSONObjKeys_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, i
     }
 
     // reply with the object's keys if it is a dictionary, error otherwise
-    if (N_DICT == NODETYPE(jpn->n)) {
-        int len = Node_Length(jpn->n);
+    if (N_DICT == JPNTYPE(jpn)) {
+        // objects of encoded documents are decoded just for the reply, the document stays encoded
+        Node *n = jpn->c || jpn->t ? decodePathValue(jpn) : jpn->n;
+        int len = Node_Length(n);
         ValkeyModule_ReplyWithArray(ctx, len);
         for (int i = 0; i < len; i++) {
-            // TODO: need an iterator for keys in dict
-            const char *k = jpn->n->value.dictval.entries[i]->value.kvval.key;
-            ValkeyModule_ReplyWithStringBuffer(ctx, k, strlen(k));
+            const char *k;
+            uint32_t klen;
+            Node_DictItem(n, i, &k, &klen, NULL);
+            ValkeyModule_ReplyWithStringBuffer(ctx, k, klen);
         }
+        if (n != jpn->n) Node_Free(n);
     } else {
-        ReplyWithPathTypeError(ctx, N_DICT, NODETYPE(jpn->n));
+        ReplyWithPathTypeError(ctx, N_DICT, JPNTYPE(jpn));
         goto error;
     }
 
@@ -512,80 +644,20 @@ error:
     return VALKEYMODULE_ERR;
 }
 
-/**
- * JSON.SET <key> <path> <json> [NX|XX]
- * Sets the JSON value at `path` in `key`
- *
- * For new Valkey keys the `path` must be the root. For existing keys, when the entire `path` exists,
- * the value that it contains is replaced with the `json` value.
- *
- * A key (with its respective value) is added to a JSON Object (in a Valkey JSON data type key) if
- * and only if it is the last child in the `path`. The optional subcommands modify this behavior for
- * both new Valkey JSON data type keys as well as JSON Object keys in them:
- *   `NX` - only set the key if it does not already exists
- *   `XX` - only set the key if it already exists
- *
- * Reply: Simple String `OK` if executed correctly, or Null Bulk if the specified `NX` or `XX`
- * conditions were not met.
- */
-int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int argc) {
-    // check args
-    if ((argc < 4) || (argc > 5)) {
-        ValkeyModule_WrongArity(ctx);
-        return VALKEYMODULE_ERR;
-    }
-    ValkeyModule_AutoMemory(ctx);
-
-    // key must be empty or a JSON type
-    ValkeyModuleKey *key = ValkeyModule_OpenKey(ctx, argv[1], VALKEYMODULE_READ | VALKEYMODULE_WRITE);
+/* Sets a value at a path of a key that is either empty or holds a document, with the NX and XX
+ * conditions of JSON.SET, and replies. The value and its arena (if any) are taken over. If tape is
+ * set the value must be the whole document, and it is kept in the tape encoding. */
+static int setValue(ValkeyModuleCtx *ctx, ValkeyModuleKey *key, ValkeyModuleString *path,
+                    Object *jo, Arena *arena, int subnx, int subxx, int tape) {
     int type = ValkeyModule_KeyType(key);
-    if (VALKEYMODULE_KEYTYPE_EMPTY != type && ValkeyModule_ModuleTypeGetType(key) != JSONType) {
-        ValkeyModule_ReplyWithError(ctx, VALKEYMODULE_ERRORMSG_WRONGTYPE);
-        return VALKEYMODULE_ERR;
-    }
-
     JSONPathNode_t *jpn = NULL;
-    Object *jo = NULL;
-    char *jerr = NULL;
-
-    // subcommand for key creation behavior modifiers NX and XX
-    int subnx = 0, subxx = 0;
-    if (argc > 4) {
-        const char *subcmd = ValkeyModule_StringPtrLen(argv[4], NULL);
-        if (!strcasecmp("nx", subcmd)) {
-            subnx = 1;
-        } else if (!strcasecmp("xx", subcmd)) {
-            // new keys can be created only if the XX flag is off
-            if (VALKEYMODULE_KEYTYPE_EMPTY == type) goto null;
-            subxx = 1;
-        } else {
-            ValkeyModule_ReplyWithError(ctx, VKM_ERRORMSG_SYNTAX);
-            return VALKEYMODULE_ERR;
-        }
-    }
-
-    // JSON must be valid
-    size_t jsonlen;
-    const char *json = ValkeyModule_StringPtrLen(argv[3], &jsonlen);
-    if (!jsonlen) {
-        ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_EMPTY_STRING);
-        return VALKEYMODULE_ERR;
-    }
+    JSONType_t *jt = NULL;
+    int decoded = 0;
 
-    // Create object from json
-    if (JSONOBJECT_OK != CreateNodeFromJSON(JSONCtx.joctx, json, jsonlen, &jo, &jerr)) {
-        if (jerr) {
-            ValkeyModule_ReplyWithError(ctx, jerr);
-            ValkeyModule_Free(jerr);
-        } else {
-            VKM_LOG_WARNING(ctx, "%s", VALKEYJSON_ERROR_JSONOBJECT_ERROR);
-            ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_JSONOBJECT_ERROR);
-        }
-        return VALKEYMODULE_ERR;
-    }
+    // new keys can be created only if the XX flag is off
+    if (subxx && VALKEYMODULE_KEYTYPE_EMPTY == type) goto null;
 
     // initialize or get JSON type container
-    JSONType_t *jt = NULL;
     if (VALKEYMODULE_KEYTYPE_EMPTY == type) {
         jt = ValkeyModule_Calloc(1, sizeof(JSONType_t));
         jt->root = jo;
@@ -597,12 +669,29 @@ int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
      * if the key is empty. This will be caught immediately afterwards because new keys must be
      * created at the root.
      */
-    if (PARSE_OK != NodeFromJSONPath(jt->root, argv[2], &jpn)) {
+    if (PARSE_OK != ValueFromJSONPath(jt, path, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
     int isRootPath = SearchPath_IsRootPath(&jpn->sp);
 
+    // only whole documents are encoded
+    if (tape && !isRootPath) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_ENCODING_NOT_ROOT);
+        goto error;
+    }
+
+    /* Encoded documents are decoded only to set a value in them, and a new root just replaces
+     * them. Decoding updates the document, which counts the new value as its own until it is
+     * either set or freed and the document is updated again.
+     */
+    if (!isRootPath && (jt->compact || jt->tape)) {
+        JSONPathNode_Free(jpn);
+        jpn = NULL;
+        NodeFromJSONPath(JSONTypeTree(jt), path, &jpn);
+        decoded = 1;
+    }
+
     // handle an empty key
     if (VALKEYMODULE_KEYTYPE_EMPTY == type) {
         // new keys must be created at the root
@@ -610,6 +699,8 @@ int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
             ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_NEW_NOT_ROOT);
             goto error;
         }
+        jt->arena = arena;
+        arena = NULL;
         ValkeyModule_ModuleTypeSetValue(key, JSONType, jt);
         goto ok;
     }
@@ -642,10 +733,13 @@ int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
         }
 
         if (isRootPath) {
-            // replacing the root is easy
+            // replacing the root is easy, and the old one is freed in the background if it is big
+            JSONTypeClear(jt);
             ValkeyModule_DeleteKey(key);
             jt = ValkeyModule_Calloc(1, sizeof(JSONType_t));
             jt->root = jo;
+            jt->arena = arena;
+            arena = NULL;
             ValkeyModule_ModuleTypeSetValue(key, JSONType, jt);
         } else if (N_DICT == NODETYPE(jpn->p)) {
             if (OBJ_OK != Node_DictSet(jpn->p, jpn->sp.nodes[jpn->sp.len - 1].value.key, jo)) {
@@ -661,8 +755,6 @@ int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
                 ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_ARRAY_SET);
                 goto error;
             }
-            // unlike DictSet, ArraySet does not free so we need to call it explicitly
-            Node_Free(jpn->n);
         }
     } else {  // must be E_NOKEY
         // new keys in the dictionary can be created only if the XX flag is off
@@ -677,7 +769,22 @@ int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
     }
 
 ok:
+    // a value that was set in an existing document brings its arena along
+    if (arena) {
+        if (jt->arena) {
+            Arena_Merge(jt->arena, arena);
+        } else {
+            jt->arena = arena;
+        }
+    }
+    JSONTypeUpdate(jt);
     maybeClearPathCache(jt, jpn);
+    // whole documents are kept encoded until they are changed, compact if they are small enough
+    if (tape) {
+        JSONTypeTape(jt);
+    } else if (SearchPath_IsRootPath(&jpn->sp)) {
+        JSONTypeCompact(jt);
+    }
     ValkeyModule_ReplyWithSimpleString(ctx, "OK");
     JSONPathNode_Free(jpn);
     ValkeyModule_ReplicateVerbatim(ctx);
@@ -687,6 +794,11 @@ null:
     ValkeyModule_ReplyWithNull(ctx);
     JSONPathNode_Free(jpn);
     if (jo) Node_Free(jo);
+    if (arena) {
+        Node_ArenaReleased();
+        Arena_Free(arena);
+    }
+    if (decoded) JSONTypeUpdate(jt);
     return VALKEYMODULE_OK;
 
 error:
@@ -695,9 +807,240 @@ error:
         ValkeyModule_Free(jt);
     }
     if (jo) Node_Free(jo);
+    if (arena) {
+        Node_ArenaReleased();
+        Arena_Free(arena);
+    }
+    // the decoded document counted the value that was just freed
+    if (decoded) JSONTypeUpdate(jt);
     return VALKEYMODULE_ERR;
 }
 
+/**
+ * JSON.SET <key> <path> <json> [NX|XX] [ENCODING TAPE]
+ * Sets the JSON value at `path` in `key`
+ *
+ * For new Valkey keys the `path` must be the root. For existing keys, when the entire `path` exists,
+ * the value that it contains is replaced with the `json` value.
+ *
+ * A key (with its respective value) is added to a JSON Object (in a Valkey JSON data type key) if
+ * and only if it is the last child in the `path`. The optional subcommands modify this behavior for
+ * both new Valkey JSON data type keys as well as JSON Object keys in them:
+ *   `NX` - only set the key if it does not already exists
+ *   `XX` - only set the key if it already exists
+ *
+ * `ENCODING TAPE` keeps the document in a read-optimized encoding until it is changed, and requires
+ * `path` to be the root.
+ *
+ * Reply: Simple String `OK` if executed correctly, or Null Bulk if the specified `NX` or `XX`
+ * conditions were not met.
+ */
+int JSONSet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int argc) {
+    // check args
+    if ((argc < 4) || (argc > 7)) {
+        ValkeyModule_WrongArity(ctx);
+        return VALKEYMODULE_ERR;
+    }
+    ValkeyModule_AutoMemory(ctx);
+
+    // key must be empty or a JSON type
+    ValkeyModuleKey *key = ValkeyModule_OpenKey(ctx, argv[1], VALKEYMODULE_READ | VALKEYMODULE_WRITE);
+    int type = ValkeyModule_KeyType(key);
+    if (VALKEYMODULE_KEYTYPE_EMPTY != type && ValkeyModule_ModuleTypeGetType(key) != JSONType) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYMODULE_ERRORMSG_WRONGTYPE);
+        return VALKEYMODULE_ERR;
+    }
+
+    Object *jo = NULL;
+    Arena *arena = NULL;
+    char *jerr = NULL;
+
+    // subcommands for key creation behavior modifiers NX and XX, and for the encoding
+    int subnx = 0, subxx = 0, tape = 0;
+    for (int i = 4; i < argc; i++) {
+        const char *subcmd = ValkeyModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp("nx", subcmd) && !subnx && !subxx) {
+            subnx = 1;
+        } else if (!strcasecmp("xx", subcmd) && !subnx && !subxx) {
+            subxx = 1;
+        } else if (!strcasecmp("encoding", subcmd) && i + 1 < argc && !tape &&
+                   !strcasecmp("tape", ValkeyModule_StringPtrLen(argv[i + 1], NULL))) {
+            tape = 1;
+            i++;
+        } else {
+            ValkeyModule_ReplyWithError(ctx, VKM_ERRORMSG_SYNTAX);
+            return VALKEYMODULE_ERR;
+        }
+    }
+
+    // new keys can be created only if the XX flag is off
+    if (subxx && VALKEYMODULE_KEYTYPE_EMPTY == type) {
+        ValkeyModule_ReplyWithNull(ctx);
+        return VALKEYMODULE_OK;
+    }
+
+    // JSON must be valid
+    size_t jsonlen;
+    const char *json = ValkeyModule_StringPtrLen(argv[3], &jsonlen);
+    if (!jsonlen) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_EMPTY_STRING);
+        return VALKEYMODULE_ERR;
+    }
+
+    // Create object from json, big values are built in an arena that the document adopts
+    if (jsonlen >= JSONTYPE_ARENA_MIN_SIZE) arena = NewArena(jsonlen * 2);
+    Node_SetArena(arena);
+    int rc = CreateNodeFromJSON(JSONCtx.joctx, json, jsonlen, &jo, &jerr);
+    Node_SetArena(NULL);
+    if (JSONOBJECT_OK != rc) {
+        if (jerr) {
+            ValkeyModule_ReplyWithError(ctx, jerr);
+            ValkeyModule_Free(jerr);
+        } else {
+            VKM_LOG_WARNING(ctx, "%s", VALKEYJSON_ERROR_JSONOBJECT_ERROR);
+            ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_JSONOBJECT_ERROR);
+        }
+        if (arena) {
+            Node_ArenaReleased();
+            Arena_Free(arena);
+        }
+        return VALKEYMODULE_ERR;
+    }
+
+    return setValue(ctx, key, argv[2], jo, arena, subnx, subxx, tape);
+}
+
+/**
+ * JSON.SETBIN <key> <path> <bytes> [NX|XX]
+ * Sets a binary value at `path` in `key`, like JSON.SET sets a JSON value
+ *
+ * The value is stored as the raw `bytes`, which JSON.RESP replies with as they are. Commands that
+ * reply with JSON, e.g. JSON.GET, have it as a base64 string, and JSON.TYPE reports it as "binary".
+ *
+ * Reply: Simple String `OK` if executed correctly, or Null Bulk if the specified `NX` or `XX`
+ * conditions were not met.
+ */
+int JSONSetBin_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int argc) {
+    // check args
+    if ((argc < 4) || (argc > 5)) {
+        ValkeyModule_WrongArity(ctx);
+        return VALKEYMODULE_ERR;
+    }
+    ValkeyModule_AutoMemory(ctx);
+
+    // key must be empty or a JSON type
+    ValkeyModuleKey *key = ValkeyModule_OpenKey(ctx, argv[1], VALKEYMODULE_READ | VALKEYMODULE_WRITE);
+    int type = ValkeyModule_KeyType(key);
+    if (VALKEYMODULE_KEYTYPE_EMPTY != type && ValkeyModule_ModuleTypeGetType(key) != JSONType) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYMODULE_ERRORMSG_WRONGTYPE);
+        return VALKEYMODULE_ERR;
+    }
+
+    int subnx = 0, subxx = 0;
+    if (5 == argc) {
+        const char *subcmd = ValkeyModule_StringPtrLen(argv[4], NULL);
+        if (!strcasecmp("nx", subcmd)) {
+            subnx = 1;
+        } else if (!strcasecmp("xx", subcmd)) {
+            subxx = 1;
+        } else {
+            ValkeyModule_ReplyWithError(ctx, VKM_ERRORMSG_SYNTAX);
+            return VALKEYMODULE_ERR;
+        }
+    }
+
+    size_t len;
+    const char *bytes = ValkeyModule_StringPtrLen(argv[3], &len);
+    if (len > UINT32_MAX) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_BINARY_TOO_BIG);
+        return VALKEYMODULE_ERR;
+    }
+
+    return setValue(ctx, key, argv[2], NewBinaryNode(bytes, len), NULL, subnx, subxx, 0);
+}
+
+/**
+ * JSON.COPY <src> <srcpath> <dst> <dstpath> [NX|XX]
+ * Copies the value at `srcpath` in `src` to `dstpath` in `dst`
+ *
+ * The value is copied as it is stored, without serializing and parsing it again. The destination
+ * follows the rules of JSON.SET, including those of its optional `NX` and `XX` subcommands. The
+ * keys may be the same.
+ *
+ * Reply: Simple String `OK` if executed correctly, or Null Bulk if `src` doesn't exist or the
+ * specified `NX` or `XX` conditions were not met.
+ */
+int JSONCopy_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int argc) {
+    // check args
+    if ((argc < 5) || (argc > 6)) {
+        ValkeyModule_WrongArity(ctx);
+        return VALKEYMODULE_ERR;
+    }
+    ValkeyModule_AutoMemory(ctx);
+
+    // source key must be empty (reply with null) or a JSON type
+    ValkeyModuleKey *srckey = ValkeyModule_OpenKey(ctx, argv[1], VALKEYMODULE_READ);
+    int type = ValkeyModule_KeyType(srckey);
+    if (VALKEYMODULE_KEYTYPE_EMPTY == type) {
+        ValkeyModule_ReplyWithNull(ctx);
+        return VALKEYMODULE_OK;
+    } else if (ValkeyModule_ModuleTypeGetType(srckey) != JSONType) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYMODULE_ERRORMSG_WRONGTYPE);
+        return VALKEYMODULE_ERR;
+    }
+
+    // destination key must be empty or a JSON type
+    ValkeyModuleKey *key =
+        ValkeyModule_OpenKey(ctx, argv[3], VALKEYMODULE_READ | VALKEYMODULE_WRITE);
+    type = ValkeyModule_KeyType(key);
+    if (VALKEYMODULE_KEYTYPE_EMPTY != type && ValkeyModule_ModuleTypeGetType(key) != JSONType) {
+        ValkeyModule_ReplyWithError(ctx, VALKEYMODULE_ERRORMSG_WRONGTYPE);
+        return VALKEYMODULE_ERR;
+    }
+
+    // subcommand for key creation behavior modifiers NX and XX
+    int subnx = 0, subxx = 0;
+    if (argc > 5) {
+        const char *subcmd = ValkeyModule_StringPtrLen(argv[5], NULL);
+        if (!strcasecmp("nx", subcmd)) {
+            subnx = 1;
+        } else if (!strcasecmp("xx", subcmd)) {
+            subxx = 1;
+        } else {
+            ValkeyModule_ReplyWithError(ctx, VKM_ERRORMSG_SYNTAX);
+            return VALKEYMODULE_ERR;
+        }
+    }
+
+    // validate the source path
+    JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(srckey);
+    JSONPathNode_t *jpn = NULL;
+    if (PARSE_OK != ValueFromJSONPath(jt, argv[2], &jpn)) {
+        ReplyWithSearchPathError(ctx, jpn);
+        JSONPathNode_Free(jpn);
+        return VALKEYMODULE_ERR;
+    }
+    if (E_OK != jpn->err) {
+        ReplyWithPathError(ctx, jpn);
+        JSONPathNode_Free(jpn);
+        return VALKEYMODULE_ERR;
+    }
+
+    // copy the value, big values are copied to an arena that the destination adopts, and values of
+    // encoded documents are decoded instead (values of tapes take about twice their size as nodes,
+    // and compact documents are small)
+    size_t size = jpn->t   ? Tape_Size(jpn->t) * sizeof(uint64_t) * 2
+                  : jpn->n ? ObjectTypeMemoryUsage(jpn->n)
+                           : 0;
+    Arena *arena = size >= JSONTYPE_ARENA_MIN_SIZE ? NewArena(size) : NULL;
+    Node_SetArena(arena);
+    Object *jo = jpn->c || jpn->t ? decodePathValue(jpn) : Node_Clone(jpn->n);
+    Node_SetArena(NULL);
+    JSONPathNode_Free(jpn);
+
+    return setValue(ctx, key, argv[4], jo, arena, subnx, subxx, 0);
+}
+
 static void maybeClearPathCache(JSONType_t *jt, const JSONPathNode_t *pn) {
     if (!jt->lruEntries) {
         return;
@@ -732,8 +1075,8 @@ static sds getSerializedJson(JSONType_t *jt, const JSONPathNode_t *pathInfo,
         pathLen--;
     }
 
-    if (pathInfo->n) {
-        switch (pathInfo->n->type) {
+    if (pathInfo->n || pathInfo->c || pathInfo->t) {
+        switch (JPNTYPE(pathInfo)) {
             // Don't store trivial types in the cache - i.e. those which aren't
             // costly to serialize.
             case N_NULL:
@@ -767,7 +1110,7 @@ static sds getSerializedJson(JSONType_t *jt, const JSONPathNode_t *pathInfo,
     } else {
         ret = sdsempty();
     }
-    SerializeNodeToJSON(pathInfo->n, opts, &ret);
+    serializePathValue(pathInfo, opts, &ret);
     if (shouldCache) {
         LruCache_AddValue(VALKEYJSON_LRUCACHE_GLOBAL, jt, pathStr, pathLen, ret, sdslen(ret));
     }
@@ -789,7 +1132,7 @@ static void sendSingleResponse(ValkeyModuleCtx *ctx, JSONType_t *jt, const JSONP
     sds json = NULL;
     if (!isCachableOptions(options)) {
         json = sdsempty();
-        SerializeNodeToJSON(pn->n, options, &json);
+        serializePathValue(pn, options, &json);
         ValkeyModule_ReplyWithStringBuffer(ctx, json, sdslen(json));
         sdsfree(json);
         return;
@@ -812,21 +1155,22 @@ static void sendMultiResponse(ValkeyModuleCtx *ctx, JSONType_t *jt, JSONPathNode
         json = sdsempty();
         Node *objReply = NewDictNode(npns);
         for (int i = 0; i < npns; i++) {
-            // add the path to the reply only if it isn't there already
+            // add the path to the reply only if it isn't there already, values of encoded
+            // documents are decoded for the reply
             Node *target;
             int ret = Node_DictGet(objReply, pns[i]->spath, &target);
             if (OBJ_ERR == ret) {
-                Node_DictSet(objReply, pns[i]->spath, pns[i]->n);
+                Node_DictSet(objReply, pns[i]->spath,
+                             pns[i]->c || pns[i]->t ? decodePathValue(pns[i]) : pns[i]->n);
             }
         }
         SerializeNodeToJSON(objReply, options, &json);
         ValkeyModule_ReplyWithStringBuffer(ctx, json, sdslen(json));
         sdsfree(json);
 
-        // avoid removing the actual data by resetting the reply dict
-        // TODO: need a non-freeing Del
-        for (int i = 0; i < objReply->value.dictval.len; i++) {
-            objReply->value.dictval.entries[i]->value.kvval.val = NULL;
+        // avoid removing the actual data by taking it out of the reply dict
+        for (int i = 0; i < npns && !jt->compact && !jt->tape; i++) {
+            Node_DictTake(objReply, pns[i]->spath);
         }
         Node_Free(objReply);
         return;
@@ -923,13 +1267,14 @@ int JSONGet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
     int npaths = argc - pathpos;
     int jpnslen = 0;
     JSONPathNode_t **jpns = ValkeyModule_Calloc(MAX(npaths, 1), sizeof(JSONPathNode_t *));
+
     if (!npaths) {  // default to root
-        NodeFromJSONPath(jt->root, ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1), &jpns[0]);
+        ValueFromJSONPath(jt, ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1), &jpns[0]);
         jpnslen = 1;
     } else {
         while (jpnslen < npaths) {
             // validate path correctness
-            if (PARSE_OK != NodeFromJSONPath(jt->root, argv[pathpos + jpnslen], &jpns[jpnslen])) {
+            if (PARSE_OK != ValueFromJSONPath(jt, argv[pathpos + jpnslen], &jpns[jpnslen])) {
                 ReplyWithSearchPathError(ctx, jpns[jpnslen]);
                 jpnslen++;
                 goto error;
@@ -1019,7 +1364,12 @@ int JSONMGet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
 
         // follow the path to the target node in the key
         JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
-        if (isRootPath) {
+        jpn.n = NULL;
+        jpn.c = NULL;
+        jpn.t = NULL;
+        if (jt->compact || jt->tape) {
+            findEncodedValue(jt, &jpn);
+        } else if (isRootPath) {
             jpn.err = E_OK;
             jpn.n = jt->root;
         } else {
@@ -1031,7 +1381,7 @@ int JSONMGet_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
 
         // serialize it
         sds json = sdsempty();
-        SerializeNodeToJSON(jpn.n, &jsopt, &json);
+        serializePathValue(&jpn, &jsopt, &json);
 
         // check whether serialization had succeeded
         if (!sdslen(json)) {
@@ -1091,7 +1441,7 @@ int JSONDel_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (3 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1109,24 +1459,27 @@ int JSONDel_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int a
     // Delete from the LRU cache, if needed
     maybeClearPathCache(jt, jpn);
 
-    // if it is the root then delete the key, otherwise delete the target from parent container
+    // if it is the root then delete the key, otherwise take the target from parent container, big
+    // values are freed in the background and arrays give back the room they no longer need
     if (SearchPath_IsRootPath(&jpn->sp)) {
+        JSONTypeClear(jt);
         ValkeyModule_DeleteKey(key);
     } else if (N_DICT == NODETYPE(jpn->p)) {  // delete from a dict
         const char *dictkey = jpn->sp.nodes[jpn->sp.len - 1].value.key;
-        if (OBJ_OK != Node_DictDel(jpn->p, dictkey)) {
+        Node *val;
+        // a taken value can be a null, so the key is looked up first
+        if (OBJ_OK != Node_DictGet(jpn->p, dictkey, &val)) {
             VKM_LOG_WARNING(ctx, "%s", VALKEYJSON_ERROR_DICT_DEL);
             ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_DICT_DEL);
             goto error;
         }
+        JSONTypeFreeValue(jt, Node_DictTake(jpn->p, dictkey));
     } else {  // container must be an array
         int index = jpn->sp.nodes[jpn->sp.len - 1].value.index;
-        if (OBJ_OK != Node_ArrayDelRange(jpn->p, index, 1)) {
-            VKM_LOG_WARNING(ctx, "%s", VALKEYJSON_ERROR_ARRAY_DEL);
-            ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_ARRAY_DEL);
-            goto error;
-        }
+        JSONTypeFreeValue(jt, Node_ArrayTakeRange(jpn->p, index, 1));
+        Node_ShrinkToFit(jpn->p);
     }  // if (N_DICT)
+    if (!SearchPath_IsRootPath(&jpn->sp)) JSONTypeUpdate(jt);
 
     ValkeyModule_ReplyWithLongLong(ctx, (long long)argc - 2);
 
@@ -1174,7 +1527,7 @@ int JSONNum_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (4 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1252,6 +1605,8 @@ int JSONNum_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
             ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_DICT_SET);
             goto error;
         }
+        // rows of tables store a copy of the result
+        Node_DictGet(jpn->p, jpn->sp.nodes[jpn->sp.len - 1].value.key, &orz);
     } else {  // container must be an array
         int index = jpn->sp.nodes[jpn->sp.len - 1].value.index;
         if (index < 0) index = Node_Length(jpn->p) + index;
@@ -1260,8 +1615,8 @@ int JSONNum_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
             ValkeyModule_ReplyWithError(ctx, VALKEYJSON_ERROR_ARRAY_SET);
             goto error;
         }
-        // unlike DictSet, ArraySet does not free so we need to call it explicitly
-        Node_Free(jpn->n);
+        // packed arrays store a copy of the result
+        Node_ArrayItem(jpn->p, index, &orz);
     }
     jpn->n = orz;
 
@@ -1276,6 +1631,7 @@ int JSONNum_GenericCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, int
 
     Node_Free(joval);
     JSONPathNode_Free(jpn);
+    JSONTypeUpdate(jt);
 
     ValkeyModule_ReplicateVerbatim(ctx);
     return VALKEYMODULE_OK;
@@ -1313,7 +1669,7 @@ int JSONStrAppend_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (4 == argc ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1365,6 +1721,7 @@ int JSONStrAppend_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     ValkeyModule_ReplyWithLongLong(ctx, (long long)Node_Length(jpn->n));
     Node_Free(jo);
     JSONPathNode_Free(jpn);
+    JSONTypeUpdate(jt);
 
     ValkeyModule_ReplicateVerbatim(ctx);
     return VALKEYMODULE_OK;
@@ -1402,7 +1759,7 @@ int JSONArrInsert_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     // validate path
     JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
     JSONPathNode_t *jpn = NULL;
-    if (PARSE_OK != NodeFromJSONPath(jt->root, argv[2], &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), argv[2], &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1483,6 +1840,7 @@ int JSONArrInsert_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     ValkeyModule_ReplyWithLongLong(ctx, Node_Length(jpn->n));
     maybeClearPathCache(jt, jpn);
     JSONPathNode_Free(jpn);
+    JSONTypeUpdate(jt);
     ValkeyModule_ReplicateVerbatim(ctx);
     return VALKEYMODULE_OK;
 
@@ -1514,7 +1872,7 @@ int JSONArrAppend_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     // validate path
     JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
     JSONPathNode_t *jpn = NULL;
-    if (PARSE_OK != NodeFromJSONPath(jt->root, argv[2], &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), argv[2], &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1579,6 +1937,7 @@ int JSONArrAppend_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     ValkeyModule_ReplyWithLongLong(ctx, Node_Length(jpn->n));
     maybeClearPathCache(jt, jpn);
     JSONPathNode_Free(jpn);
+    JSONTypeUpdate(jt);
     ValkeyModule_ReplicateVerbatim(ctx);
     return VALKEYMODULE_OK;
 
@@ -1619,7 +1978,7 @@ int JSONArrIndex_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
     JSONPathNode_t *jpn = NULL;
     Object *jo = NULL;
-    if (PARSE_OK != NodeFromJSONPath(jt->root, argv[2], &jpn)) {
+    if (PARSE_OK != ValueFromJSONPath(jt, argv[2], &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1631,8 +1990,8 @@ int JSONArrIndex_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
     }
 
     // verify that the target's type is an array
-    if (N_ARRAY != NODETYPE(jpn->n)) {
-        ReplyWithPathTypeError(ctx, N_ARRAY, NODETYPE(jpn->n));
+    if (N_ARRAY != JPNTYPE(jpn)) {
+        ReplyWithPathTypeError(ctx, N_ARRAY, JPNTYPE(jpn));
         goto error;
     }
 
@@ -1672,7 +2031,10 @@ int JSONArrIndex_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv,
         }
     }
 
-    ValkeyModule_ReplyWithLongLong(ctx, Node_ArrayIndex(jpn->n, jo, (int)start, (int)stop));
+    // arrays of encoded documents are decoded just for the search, the document stays encoded
+    Node *arr = jpn->c || jpn->t ? decodePathValue(jpn) : jpn->n;
+    ValkeyModule_ReplyWithLongLong(ctx, Node_ArrayIndex(arr, jo, (int)start, (int)stop));
+    if (arr != jpn->n) Node_Free(arr);
 
     JSONPathNode_Free(jpn);
     Node_Free(jo);
@@ -1715,7 +2077,7 @@ int JSONArrPop_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, in
     JSONPathNode_t *jpn = NULL;
     ValkeyModuleString *spath =
         (argc > 2 ? argv[2] : ValkeyModule_CreateString(ctx, OBJECT_ROOT_PATH, 1));
-    if (PARSE_OK != NodeFromJSONPath(jt->root, spath, &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), spath, &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1766,8 +2128,10 @@ int JSONArrPop_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, in
         goto error;
     }
 
-    // delete the item from the array
+    // delete the item from the array, and give back the room it no longer needs
     Node_ArrayDelRange(jpn->n, index, 1);
+    Node_ShrinkToFit(jpn->n);
+    JSONTypeUpdate(jt);
 
     // reply with the serialization
     ValkeyModule_ReplyWithStringBuffer(ctx, json, sdslen(json));
@@ -1813,7 +2177,7 @@ int JSONArrTrim_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, i
     // validate path
     JSONType_t *jt = ValkeyModule_ModuleTypeGetValue(key);
     JSONPathNode_t *jpn = NULL;
-    if (PARSE_OK != NodeFromJSONPath(jt->root, argv[2], &jpn)) {
+    if (PARSE_OK != NodeFromJSONPath(JSONTypeTree(jt), argv[2], &jpn)) {
         ReplyWithSearchPathError(ctx, jpn);
         goto error;
     }
@@ -1856,13 +2220,15 @@ int JSONArrTrim_ValkeyCommand(ValkeyModuleCtx *ctx, ValkeyModuleString **argv, i
         right = len - stop - 1;
     }
 
-    // trim the array
-    Node_ArrayDelRange(jpn->n, 0, left);
-    Node_ArrayDelRange(jpn->n, -right, right);
+    // trim the array, many trimmed items are freed in the background
+    JSONTypeFreeValue(jt, Node_ArrayTakeRange(jpn->n, 0, left));
+    JSONTypeFreeValue(jt, Node_ArrayTakeRange(jpn->n, -right, right));
+    Node_ShrinkToFit(jpn->n);
 
     ValkeyModule_ReplyWithLongLong(ctx, (long long)Node_Length(jpn->n));
     maybeClearPathCache(jt, jpn);
     JSONPathNode_Free(jpn);
+    JSONTypeUpdate(jt);
     ValkeyModule_ReplicateVerbatim(ctx);
     return VALKEYMODULE_OK;
 
@@ -1937,6 +2303,10 @@ int Module_CreateCommands(ValkeyModuleCtx *ctx) {
                                   1) == VALKEYMODULE_ERR)
         return VALKEYMODULE_ERR;
 
+    if (ValkeyModule_CreateCommand(ctx, "json.setbin", JSONSetBin_ValkeyCommand, "write deny-oom",
+                                  1, 1, 1) == VALKEYMODULE_ERR)
+        return VALKEYMODULE_ERR;
+
     if (ValkeyModule_CreateCommand(ctx, "json.get", JSONGet_ValkeyCommand, "readonly", 1, 1, 1) ==
         VALKEYMODULE_ERR)
         return VALKEYMODULE_ERR;
@@ -1953,6 +2323,10 @@ int Module_CreateCommands(ValkeyModuleCtx *ctx) {
         VALKEYMODULE_ERR)
         return VALKEYMODULE_ERR;
 
+    if (ValkeyModule_CreateCommand(ctx, "json.copy", JSONCopy_ValkeyCommand, "write deny-oom", 1, 3,
+                                  2) == VALKEYMODULE_ERR)
+        return VALKEYMODULE_ERR;
+
     /* JSON number commands. */
     if (ValkeyModule_CreateCommand(ctx, "json.numincrby", JSONNum_GenericCommand, "write", 1, 1,
                                   1) == VALKEYMODULE_ERR)
@@ -2017,6 +2391,43 @@ int Module_CreateCommands(ValkeyModuleCtx *ctx) {
     return VALKEYMODULE_OK;
 }
 
+/* Numeric configs are plain variables, which privdata points to */
+static long long getNumericConfig(const char *name, void *privdata) {
+    return *(long long *)privdata;
+}
+
+static int setNumericConfig(const char *name, long long val, void *privdata,
+                            ValkeyModuleString **err) {
+    *(long long *)privdata = val;
+    return VALKEYMODULE_OK;
+}
+
+/* Registers the module's configs, and loads their values */
+static int Module_CreateConfigs(ValkeyModuleCtx *ctx) {
+    // servers without module configs use the defaults
+    if (!ValkeyModule_RegisterNumericConfig) return VALKEYMODULE_OK;
+
+    if (ValkeyModule_RegisterNumericConfig(ctx, "compact-max-size", JSONTYPE_COMPACT_MAX_SIZE,
+                                           VALKEYMODULE_CONFIG_MEMORY, 0, 1 << 20, getNumericConfig,
+                                           setNumericConfig, NULL,
+                                           &jsonCompactMaxSize_g) == VALKEYMODULE_ERR)
+        return VALKEYMODULE_ERR;
+
+    if (ValkeyModule_RegisterNumericConfig(ctx, "daemon-interval", DAEMON_DEFAULT_INTERVAL,
+                                           VALKEYMODULE_CONFIG_DEFAULT, 0, 60000, getNumericConfig,
+                                           setNumericConfig, NULL,
+                                           &jsonDaemonInterval_g) == VALKEYMODULE_ERR)
+        return VALKEYMODULE_ERR;
+
+    if (ValkeyModule_RegisterNumericConfig(ctx, "daemon-budget", DAEMON_DEFAULT_BUDGET,
+                                           VALKEYMODULE_CONFIG_DEFAULT, 0, 1000000,
+                                           getNumericConfig, setNumericConfig, NULL,
+                                           &jsonDaemonBudget_g) == VALKEYMODULE_ERR)
+        return VALKEYMODULE_ERR;
+
+    return ValkeyModule_LoadConfigs(ctx);
+}
+
 int ValkeyModule_OnLoad(ValkeyModuleCtx *ctx) {
     // Register the module
     if (ValkeyModule_Init(ctx, VKMODULE_NAME, VALKEYJSON_MODULE_VERSION, VALKEYMODULE_APIVER_1) ==
@@ -2029,9 +2440,15 @@ int ValkeyModule_OnLoad(ValkeyModuleCtx *ctx) {
                                  .rdb_save = JSONTypeRdbSave,
                                  .aof_rewrite = JSONTypeAofRewrite,
                                  .mem_usage = JSONTypeMemoryUsage,
-                                 .free = JSONTypeFree};
+                                 .free = JSONTypeFree,
+                                 .free_effort = JSONTypeFreeEffort,
+                                 .unlink = JSONTypeUnlink,
+                                 .defrag = JSONTypeDefrag};
     JSONType = ValkeyModule_CreateDataType(ctx, JSONTYPE_NAME, JSONTYPE_ENCODING_VERSION, &tm);
     if (NULL == JSONType) return VALKEYMODULE_ERR;
+    if (ValkeyModule_RegisterDefragFunc) {
+        ValkeyModule_RegisterDefragFunc(ctx, JSONTypeDefragGlobals);
+    }
 
     // Initialize the module's context
     JSONCtx = (ModuleCtx){0};
@@ -2040,6 +2457,13 @@ int ValkeyModule_OnLoad(ValkeyModuleCtx *ctx) {
     // Create the commands
     if (VALKEYMODULE_ERR == Module_CreateCommands(ctx)) return VALKEYMODULE_ERR;
 
+    // Register the configs
+    if (VALKEYMODULE_ERR == Module_CreateConfigs(ctx)) return VALKEYMODULE_ERR;
+
+    // Start optimizing documents in the background
+    Daemon_Start(ctx, JSONType);
+    if (ValkeyModule_RegisterInfoFunc) ValkeyModule_RegisterInfoFunc(ctx, Daemon_Info);
+
     VKM_LOG_WARNING(ctx, "%s v%d.%d.%d [encver %d]", VKMODULE_DESC, VALKEYJSON_VERSION_MAJOR,
                     VALKEYJSON_VERSION_MINOR, VALKEYJSON_VERSION_PATCH, JSONTYPE_ENCODING_VERSION);
 
@@ -39,6 +39,8 @@
 #define VALKEYJSON_ERROR_JSONOBJECT_ERROR "ERR unspecified json_object error (probably OOM)"
 #define VALKEYJSON_ERROR_SERIALIZE "ERR object serialization to JSON failed"
 #define VALKEYJSON_ERROR_NEW_NOT_ROOT "ERR new objects must be created at the root"
+#define VALKEYJSON_ERROR_ENCODING_NOT_ROOT "ERR only whole documents can be encoded"
+#define VALKEYJSON_ERROR_BINARY_TOO_BIG "ERR binary values are limited to 4GB"
 #define VALKEYJSON_ERROR_PATH_NANTYPE "ERR wrong type of path value - expected a number but found %s"
 #define VALKEYJSON_ERROR_PATH_WRONGTYPE "ERR wrong type of path value - expected %s but found %s"
 #define VALKEYJSON_ERROR_PATH_NONTERMINAL_KEY "ERR missing key at non-terminal path level"
@@ -0,0 +1,123 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <alloc.h>
+#include "../src/json_object.h"
+#include "../deps/jsonsl/perf/documents.h"
+
+/* Parses the documents of jsonsl's (and yajl's) performance test, and converts their numbers with
+ * the parser's conversions and with strtoll/strtod. */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns a document's chunks joined together */
+static char *joinDocument(int i, size_t *len) {
+    const char **chunk = get_doc(i);
+    char *doc = malloc(doc_size(i) + 1);
+    *len = 0;
+    for (; *chunk; chunk++) {
+        size_t l = strlen(*chunk);
+        memcpy(doc + *len, *chunk, l);
+        *len += l;
+    }
+    doc[*len] = '\0';
+    return doc;
+}
+
+/* The numbers of a document, which start with a minus or a digit outside strings */
+typedef struct {
+    const char *s;
+    size_t len;
+    int integer;
+} number;
+
+static int findNumbers(const char *doc, size_t len, number *nums, int max) {
+    int n = 0, instring = 0;
+    for (size_t i = 0; i < len && n < max; i++) {
+        if (instring) {
+            if ('\\' == doc[i]) i++;
+            else if ('"' == doc[i]) instring = 0;
+        } else if ('"' == doc[i]) {
+            instring = 1;
+        } else if ('-' == doc[i] || isdigit((unsigned char)doc[i])) {
+            size_t j = i;
+            while (j < len && strchr("-+.eE0123456789", doc[j])) j++;
+            nums[n].s = doc + i;
+            nums[n].len = j - i;
+            nums[n].integer = !memchr(doc + i, '.', j - i) && !memchr(doc + i, 'e', j - i) &&
+                              !memchr(doc + i, 'E', j - i);
+            n++;
+            i = j - 1;
+        }
+    }
+    return n;
+}
+
+static void benchDocument(int d, int iterations) {
+    size_t len;
+    char *doc = joinDocument(d, &len);
+    JSONObjectCtx *ctx = NewJSONObjectCtx(0);
+
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        Node *n;
+        if (JSONOBJECT_OK != CreateNodeFromJSON(ctx, doc, len, &n, NULL)) {
+            printf("document %d: parse error\n", d);
+            exit(1);
+        }
+        Node_Free(n);
+    }
+    double parse = now() - start;
+
+    // numbers are converted a lot more often to measure them
+    static number nums[1 << 16];
+    int count = findNumbers(doc, len, nums, sizeof(nums) / sizeof(*nums));
+    int rounds = iterations * 10;
+    double sum = 0;
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            char *eptr;
+            sum += nums[i].integer ? strtoll(nums[i].s, &eptr, 10) : strtod(nums[i].s, &eptr);
+        }
+    }
+    double libc = now() - start;
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            int64_t ival;
+            double dval;
+            if (nums[i].integer) {
+                JSONNumber_ParseInt(nums[i].s, nums[i].len, &ival);
+                sum += ival;
+            } else {
+                JSONNumber_ParseDouble(nums[i].s, nums[i].len, &dval);
+                sum += dval;
+            }
+        }
+    }
+    double own = now() - start;
+
+    printf("document %d: %zu bytes, parsed at %.1f MB/s", d, len, len * iterations / parse / 1e6);
+    if (count)
+        printf("; %d numbers, %.1f ns each with strtoll/strtod and %.1f ns with JSONNumber "
+               "(checksum %g)",
+               count, libc * 1e9 / ((double)count * rounds), own * 1e9 / ((double)count * rounds),
+               sum);
+    printf("\n");
+
+    FreeJSONObjectCtx(ctx);
+    free(doc);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    VKMUtil_InitAlloc();
+    for (int d = 0; d < num_docs(); d++) benchDocument(d, iterations);
+    return 0;
+}
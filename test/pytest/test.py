@@ -5,6 +5,7 @@ import redis
 import unittest
 import json
 import os
+import time
 
 # Path to JSON test case files
 json_path = os.path.abspath(os.path.join(os.getcwd(), '../files'))
@@ -178,6 +179,104 @@ class ValkeyJSONTestCase(ModuleTestCase('../../src/valkeyjson.so')):
             with self.assertRaises(redis.exceptions.ResponseError) as cm:
                 r.execute_command('JSON.SET', 'test', '.foo[1]', 'null', 'XX')
 
+    def testSetEncodingTape(self):
+        """Test JSON.SET's ENCODING TAPE subcommand"""
+
+        with self.redis() as r:
+            r.client_setname(self._testMethodName)
+            r.flushdb()
+
+            basic = json.dumps(docs['basic'])
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', basic, 'ENCODING', 'TAPE'))
+            self.assertOk(r.execute_command('JSON.SET', 'tree', '.', basic))
+            for args in [('JSON.GET', '{}', '.arr', '.dict'),
+                         ('JSON.GET', '{}', 'INDENT', '  ', '.arr', '.dict'),
+                         ('JSON.RESP', '{}'),
+                         ('JSON.TYPE', '{}', '.arr[-1]'),
+                         ('JSON.ARRLEN', '{}', '.arr'),
+                         ('JSON.STRLEN', '{}', '.string'),
+                         ('JSON.OBJKEYS', '{}', '.dict'),
+                         ('JSON.ARRINDEX', '{}', '.arr', '-1.2')]:
+                self.assertEqual(r.execute_command(*[a.format('test') for a in args]),
+                                 r.execute_command(*[a.format('tree') for a in args]))
+            self.assertListEqual(r.execute_command('JSON.MGET', 'test', 'tree', '.dict.b'),
+                                 ['"2"', '"2"'])
+
+            # reads leave the document encoded
+            tape = r.execute_command('JSON.DEBUG', 'MEMORY', 'test')
+            self.assertListEqual(['string', 'none', 'bool', 'int', 'num', 'arr', 'dict'],
+                                 r.execute_command('JSON.OBJKEYS', 'test'))
+            self.assertEqual(3, r.execute_command('JSON.ARRINDEX', 'test', '.arr', 'false'))
+            self.assertEqual(tape, r.execute_command('JSON.DEBUG', 'MEMORY', 'test'))
+
+            # a change decodes the document, and the encoding is set again along with it
+            r.execute_command('JSON.NUMINCRBY', 'test', '.int', 1)
+            self.assertEqual(43, json.loads(r.execute_command('JSON.GET', 'test', '.int')))
+            self.assertIsNone(r.execute_command('JSON.SET', 'test', '.', '[]', 'NX', 'ENCODING',
+                                                'TAPE'))
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', '[]', 'XX', 'ENCODING',
+                                            'TAPE'))
+            self.assertEqual('[]', r.execute_command('JSON.GET', 'test'))
+
+            # a big document that replaces a tape takes as much memory as one that is set afresh
+            big = json.dumps({'arr': list(range(2000)),
+                              'dict': {str(i): 'x' * 20 for i in range(200)}})
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', big, 'ENCODING', 'TAPE'))
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', big))
+            self.assertOk(r.execute_command('JSON.SET', 'fresh', '.', big))
+            memory = r.execute_command('JSON.DEBUG', 'MEMORY', 'fresh')
+            self.assertEqual(memory, r.execute_command('JSON.DEBUG', 'MEMORY', 'test'))
+            # ...and its accounting doesn't wrap around when values are removed
+            self.assertEqual(1, r.execute_command('JSON.DEL', 'test', '.dict'))
+            self.assertGreater(r.execute_command('JSON.DEBUG', 'MEMORY', 'test'), 0)
+            self.assertLessEqual(r.execute_command('JSON.DEBUG', 'MEMORY', 'test'), memory)
+            # values that aren't set in a decoded document leave no trace in anyone's accounting
+            self.assertOk(r.execute_command('JSON.SET', 'rejected', '.', big, 'ENCODING', 'TAPE'))
+            self.assertIsNone(r.execute_command('JSON.SET', 'rejected', '.none', big, 'XX'))
+            with self.assertRaises(redis.exceptions.ResponseError):
+                r.execute_command('JSON.SET', 'rejected', '.arr[0]', big, 'NX')
+            with self.assertRaises(redis.exceptions.ResponseError):
+                r.execute_command('JSON.SET', 'rejected', '.no.such', big)
+            self.assertOk(r.execute_command('JSON.SET', 'other', '.', big))
+            self.assertEqual(memory, r.execute_command('JSON.DEBUG', 'MEMORY', 'other'))
+            self.assertEqual(1, r.execute_command('JSON.DEL', 'rejected', '.dict'))
+            self.assertGreater(r.execute_command('JSON.DEBUG', 'MEMORY', 'rejected'), 0)
+            self.assertLessEqual(r.execute_command('JSON.DEBUG', 'MEMORY', 'rejected'), memory)
+
+            # only whole documents are encoded
+            with self.assertRaises(redis.exceptions.ResponseError) as cm:
+                r.execute_command('JSON.SET', 'tree', '.foo', '1', 'ENCODING', 'TAPE')
+            with self.assertRaises(redis.exceptions.ResponseError) as cm:
+                r.execute_command('JSON.SET', 'tree', '.', '1', 'ENCODING', 'LIST')
+            with self.assertRaises(redis.exceptions.ResponseError) as cm:
+                r.execute_command('JSON.SET', 'tree', '.', '1', 'NX', 'XX')
+
+    def testSetBinCommand(self):
+        """Test JSON.SETBIN command"""
+
+        with self.redis() as r:
+            r.client_setname(self._testMethodName)
+            r.flushdb()
+
+            blob = '\x00\x01binary\x7f'
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', '{"arr":[1,2]}'))
+            self.assertOk(r.execute_command('JSON.SETBIN', 'test', '.blob', blob))
+            self.assertOk(r.execute_command('JSON.SETBIN', 'test', '.arr[0]', blob, 'XX'))
+            self.assertIsNone(r.execute_command('JSON.SETBIN', 'test', '.blob', 'x', 'NX'))
+            self.assertEqual('binary', r.execute_command('JSON.TYPE', 'test', '.blob'))
+
+            # the bytes are raw in RESP and base64 in JSON
+            self.assertEqual(blob, r.execute_command('JSON.RESP', 'test', '.blob'))
+            self.assertEqual('"AAFiaW5hcnl/"', r.execute_command('JSON.GET', 'test', '.blob'))
+            self.assertEqual('{"arr":["AAFiaW5hcnl/",2],"blob":"AAFiaW5hcnl/"}',
+                             r.execute_command('JSON.GET', 'test'))
+
+            # and they can be a whole document
+            self.assertOk(r.execute_command('JSON.SETBIN', 'bin', '.', blob))
+            self.assertEqual(blob, r.execute_command('JSON.RESP', 'bin'))
+            with self.assertRaises(redis.exceptions.ResponseError) as cm:
+                r.execute_command('JSON.SETBIN', 'test', '.blob', blob, 'ENCODING')
+
     def testGetNonExistantPathsFromBasicDocumentShouldFail(self):
         """Test failure of getting non-existing values"""
 
@@ -479,6 +578,119 @@ class ValkeyJSONTestCase(ModuleTestCase('../../src/valkeyjson.so')):
             self.assertEqual('3', r.execute_command('JSON.ARRPOP', 'test'))
             self.assertIsNone(r.execute_command('JSON.ARRPOP', 'test'))
 
+    def testCopyCommand(self):
+        """Test JSON.COPY command"""
+
+        with self.redis() as r:
+            r.client_setname(self._testMethodName)
+            r.flushdb()
+
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', json.dumps(docs['basic'])))
+            self.assertOk(r.execute_command('JSON.COPY', 'test', '.', 'copy', '.'))
+            self.assertEqual(json.loads(r.execute_command('JSON.GET', 'copy')), docs['basic'])
+            self.assertOk(r.execute_command('JSON.COPY', 'test', '.arr', 'copy', '.dict.arr'))
+            self.assertListEqual(json.loads(r.execute_command(
+                'JSON.GET', 'copy', '.dict.arr')), docs['basic']['arr'])
+            self.assertOk(r.execute_command('JSON.COPY', 'test', '.dict', 'test', '.arr[1]'))
+            self.assertEqual(json.loads(r.execute_command(
+                'JSON.GET', 'test', '.arr[1]')), docs['basic']['dict'])
+
+            # the copy doesn't change along with its source
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.arr[0]', '"changed"'))
+            self.assertEqual(json.loads(r.execute_command('JSON.GET', 'copy', '.arr[0]')), 42)
+
+            # the destination follows the rules of JSON.SET
+            self.assertIsNone(r.execute_command('JSON.COPY', 'test', '.', 'copy', '.', 'NX'))
+            self.assertIsNone(r.execute_command('JSON.COPY', 'test', '.', 'none', '.', 'XX'))
+            self.assertIsNone(r.execute_command('JSON.COPY', 'none', '.', 'copy', '.'))
+            with self.assertRaises(redis.exceptions.ResponseError) as cm:
+                r.execute_command('JSON.COPY', 'test', '.foo', 'copy', '.')
+            with self.assertRaises(redis.exceptions.ResponseError) as cm:
+                r.execute_command('JSON.COPY', 'test', '.', 'none', '.foo')
+
+    def testCompactDocuments(self):
+        """Test that small documents read the same before and after they are changed"""
+
+        with self.redis() as r:
+            r.client_setname(self._testMethodName)
+            r.flushdb()
+
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', json.dumps(docs['basic'])))
+            compact = r.execute_command('JSON.DEBUG', 'MEMORY', 'test')
+            before = [r.execute_command('JSON.GET', 'test', 'INDENT', '  ', '.arr', '.dict'),
+                      r.execute_command('JSON.RESP', 'test'),
+                      r.execute_command('JSON.TYPE', 'test', '.arr[-1]'),
+                      r.execute_command('JSON.OBJLEN', 'test', '.dict'),
+                      r.execute_command('JSON.MGET', 'test', '.arr[4][1]'),
+                      r.execute_command('JSON.OBJKEYS', 'test', '.dict'),
+                      r.execute_command('JSON.ARRINDEX', 'test', '.arr[4]', '"array"')]
+            self.assertIsNone(r.execute_command('JSON.TYPE', 'test', '.arr[6]'))
+            self.assertEqual(compact, r.execute_command('JSON.DEBUG', 'MEMORY', 'test'))
+
+            # a change decodes the document
+            self.assertEqual(3, r.execute_command('JSON.ARRAPPEND', 'test', '.arr[4]', '1'))
+            self.assertEqual('1', r.execute_command('JSON.ARRPOP', 'test', '.arr[4]'))
+            self.assertGreater(r.execute_command('JSON.DEBUG', 'MEMORY', 'test'), compact)
+            after = [r.execute_command('JSON.GET', 'test', 'INDENT', '  ', '.arr', '.dict'),
+                     r.execute_command('JSON.RESP', 'test'),
+                     r.execute_command('JSON.TYPE', 'test', '.arr[-1]'),
+                     r.execute_command('JSON.OBJLEN', 'test', '.dict'),
+                     r.execute_command('JSON.MGET', 'test', '.arr[4][1]'),
+                     r.execute_command('JSON.OBJKEYS', 'test', '.dict'),
+                     r.execute_command('JSON.ARRINDEX', 'test', '.arr[4]', '"array"')]
+            self.assertListEqual(before, after)
+
+    def testDaemonCompactsDocuments(self):
+        """Test that documents that were changed are compacted again in the background"""
+
+        with self.redis() as r:
+            r.client_setname(self._testMethodName)
+            r.flushdb()
+
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', json.dumps(docs['basic'])))
+            compact = r.execute_command('JSON.DEBUG', 'MEMORY', 'test')
+            self.assertEqual(3, r.execute_command('JSON.ARRAPPEND', 'test', '.arr[4]', '1'))
+            self.assertEqual('1', r.execute_command('JSON.ARRPOP', 'test', '.arr[4]'))
+            self.assertGreater(r.execute_command('JSON.DEBUG', 'MEMORY', 'test'), compact)
+
+            r.execute_command('CONFIG', 'SET', 'ValkeyJSON.daemon-interval', '1')
+            try:
+                for _ in range(100):
+                    if r.execute_command('JSON.DEBUG', 'MEMORY', 'test') == compact:
+                        break
+                    time.sleep(0.05)
+            finally:
+                r.execute_command('CONFIG', 'SET', 'ValkeyJSON.daemon-interval', '100')
+            self.assertEqual(compact, r.execute_command('JSON.DEBUG', 'MEMORY', 'test'))
+            info = {k.lower(): v for k, v in r.info('ValkeyJSON_daemon').items()}
+            self.assertGreater(info['valkeyjson_documents_compacted'], 0)
+
+    def testDaemonIdles(self):
+        """Test that the daemon's ticks end after a pass over a small keyspace"""
+
+        with self.redis() as r:
+            r.client_setname(self._testMethodName)
+            r.flushdb()
+
+            self.assertOk(r.execute_command('JSON.SET', 'test', '.', json.dumps(docs['basic'])))
+            before = {k.lower(): v for k, v in r.info('ValkeyJSON_daemon').items()}
+            r.execute_command('CONFIG', 'SET', 'ValkeyJSON.daemon-budget', '100000')
+            r.execute_command('CONFIG', 'SET', 'ValkeyJSON.daemon-interval', '1')
+            try:
+                time.sleep(0.5)
+            finally:
+                r.execute_command('CONFIG', 'SET', 'ValkeyJSON.daemon-interval', '100')
+                r.execute_command('CONFIG', 'SET', 'ValkeyJSON.daemon-budget', '1000')
+            after = {k.lower(): v for k, v in r.info('ValkeyJSON_daemon').items()}
+
+            # every tick makes a single pass instead of rescanning until its budget runs out
+            ticks = after['valkeyjson_ticks'] - before['valkeyjson_ticks']
+            passes = after['valkeyjson_passes'] - before['valkeyjson_passes']
+            self.assertGreater(ticks, 5)
+            self.assertLessEqual(passes, ticks)
+            self.assertLess(after['valkeyjson_time_us'] - before['valkeyjson_time_us'],
+                            ticks * 10000)
+
     def testTypeCommand(self):
         """Test JSON.TYPE command"""
 
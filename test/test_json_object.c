@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <string.h>
 #include <dirent.h>
+#include <math.h>
 #include "minunit.h"
 #include "../src/json_object.h"
 #include <alloc.h>
@@ -127,7 +128,7 @@ MU_TEST(test_jo_create_literal_string) {
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
     mu_check(NULL != n);
     mu_check(N_STRING == n->type);
-    mu_check(0 == strncmp("foo", n->value.strval.data, n->value.strval.len));
+    mu_check(0 == strncmp("foo", NODE_STRDATA(n), NODE_STRLEN(n)));
     Node_Free(n);
 
     // TODO: more weird chars
@@ -143,14 +144,14 @@ MU_TEST(test_jo_create_literal_dict) {
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
     mu_check(NULL != n);
     mu_check(N_DICT == n->type);
-    mu_assert_int_eq(0, n->value.dictval.len);
+    mu_assert_int_eq(0, n->value.dictval->len);
     Node_Free(n);
 
     json = "{" _JSTR(foo) ": " _JSTR(bar) "}";
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
     mu_check(NULL != n);
     mu_check(N_DICT == n->type);
-    mu_assert_int_eq(1, n->value.dictval.len);
+    mu_assert_int_eq(1, n->value.dictval->len);
     Node_Free(n);
 
     json = "{"
@@ -160,7 +161,7 @@ MU_TEST(test_jo_create_literal_dict) {
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
     mu_check(NULL != n);
     mu_check(N_DICT == n->type);
-    mu_assert_int_eq(2, n->value.dictval.len);
+    mu_assert_int_eq(2, n->value.dictval->len);
     Node_Free(n);
 
     FreeJSONObjectCtx(joctx);
@@ -174,14 +175,14 @@ MU_TEST(test_jo_create_literal_array) {
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
     mu_check(NULL != n);
     mu_check(N_ARRAY == n->type);
-    mu_assert_int_eq(0, n->value.arrval.len);
+    mu_assert_int_eq(0, n->value.arrval->len);
     Node_Free(n);
 
     json = "[" _JSTR(foo) ", " _JSTR(bar) ", 42]";
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
     mu_check(NULL != n);
     mu_check(N_ARRAY == n->type);
-    mu_assert_int_eq(3, n->value.dictval.len);
+    mu_assert_int_eq(3, n->value.dictval->len);
     Node_Free(n);
 
     FreeJSONObjectCtx(joctx);
@@ -207,40 +208,252 @@ MU_TEST(test_jo_create_object) {
     mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, SampleJSON, strlen(SampleJSON), &n1, NULL));
     mu_check(n1);
     mu_check(N_DICT == n1->type);
-    mu_check(1 == n1->value.dictval.len);
+    mu_check(1 == n1->value.dictval->len);
 
     mu_check(OBJ_ERR == Node_DictGet(n1, "f00", &n2));
     mu_check(OBJ_ERR == Node_DictGet(n1, "bar", &n2));
     mu_check(OBJ_ERR == Node_DictGet(n1, "baz", &n2));
     mu_check(OBJ_OK == Node_DictGet(n1, "foo", &n2));
     mu_check(N_DICT == n2->type);
-    mu_assert_int_eq(2, n2->value.dictval.len);
+    mu_assert_int_eq(2, n2->value.dictval->len);
 
     mu_check(OBJ_OK == Node_DictGet(n2, "bar", &n3));
     mu_check(N_ARRAY == n3->type);
-    mu_assert_int_eq(2, n3->value.arrval.len);
+    mu_assert_int_eq(2, n3->value.arrval->len);
 
     mu_check(OBJ_OK == Node_ArrayItem(n3, 0, &n4));
     mu_check(N_STRING == n4->type);
-    mu_check(0 == strncmp("element0", n4->value.strval.data, n4->value.strval.len));
+    mu_check(0 == strncmp("element0", NODE_STRDATA(n4), NODE_STRLEN(n4)));
 
     mu_check(OBJ_OK == Node_ArrayItem(n3, 1, &n4));
     mu_check(N_STRING == n4->type);
-    mu_check(0 == strncmp("element1", n4->value.strval.data, n4->value.strval.len));
+    mu_check(0 == strncmp("element1", NODE_STRDATA(n4), NODE_STRLEN(n4)));
 
     mu_check(OBJ_OK == Node_DictGet(n2, "inner object", &n3));
     mu_check(N_DICT == n3->type);
-    mu_assert_int_eq(1, n3->value.dictval.len);
+    mu_assert_int_eq(1, n3->value.dictval->len);
 
     mu_check(OBJ_OK == Node_DictGet(n3, "baz", &n4));
     mu_check(N_STRING == n4->type);
-    mu_check(0 == strncmp("qux", n4->value.strval.data, n4->value.strval.len));
+    mu_check(0 == strncmp("qux", NODE_STRDATA(n4), NODE_STRLEN(n4)));
 
     Node_Free(n1);
 
     FreeJSONObjectCtx(joctx);
 }
 
+MU_TEST(test_jo_structural_index) {
+    // the escapes and the string go over the first block's end
+    char json[] = "{\"a\\\\\": [1, true, null, \"x\\\"y\"], "
+                  "\"padding to the block's end...\\\\\\\"\": \"\\\\\", \"b\": -1.5e3}";
+    const uint32_t expected[] = {0,  1,  5,  6,  8,  9,  10, 12, 16, 18, 22, 24, 29,
+                                 30, 31, 33, 67, 68, 70, 73, 74, 76, 78, 79, 81, 87};
+    size_t len = strlen(json), n;
+
+    for (int impl = JSONINDEX_SCALAR; impl <= JSONINDEX_BEST; impl++) {
+        uint32_t *idx = JSONIndex_Build(json, len, impl, &n);
+        mu_check(idx);
+        mu_assert_int_eq(sizeof(expected) / sizeof(*expected), n);
+        mu_check(!memcmp(expected, idx, sizeof(expected)));
+        ValkeyModule_Free(idx);
+    }
+
+    // control characters in strings and unterminated strings are left to jsonsl
+    mu_check(!JSONIndex_Build("[\"\t\"]", 5, JSONINDEX_BEST, &n));
+    mu_check(!JSONIndex_Build("[\"\\\"]", 5, JSONINDEX_BEST, &n));
+
+    // what's parsed from the index is the same as what jsonsl parses, and so are the errors
+    const char *samples[] = {
+        json,
+        " [[1, 2.5, -0, 1E2], {\"k\": {}, \"\": []}, [{\"x\": 1}, {\"x\": 2}], \"\\u00e9\"] ",
+        "[\"\\ud83d\\ude00\", 9223372036854775807, false]",
+        "{\"a\": 1,}",
+        "[1 2]",
+        "[01]",
+        "[1.]",
+        "{\"a\" 1}",
+        "[\"\\q\"]",
+        "[\"\\ud800\"]",
+        "[99999999999999999999]",
+        "[1e400]",
+        "[tru]",
+        "{\"a\": [1}",
+        "[[]",
+    };
+    JSONSerializeOpt opt = {"", "", ""};
+    for (int i = 0; i < sizeof(samples) / sizeof(*samples); i++) {
+        sds ref = NULL;
+        for (int impl = JSONINDEX_NONE; impl <= JSONINDEX_BEST; impl++) {
+            JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+            Node *node = NULL;
+            char *err = NULL;
+            sds str = sdsempty();
+            joctx->index = impl;
+            if (JSONOBJECT_OK == CreateNodeFromJSON(joctx, samples[i], strlen(samples[i]), &node,
+                                                    &err)) {
+                SerializeNodeToJSON(node, &opt, &str);
+                Node_Free(node);
+            } else {
+                str = sdscat(str, err);
+                free(err);
+            }
+            if (ref) {
+                mu_assert(!strcmp(ref, str), samples[i]);
+                sdsfree(str);
+            } else {
+                ref = str;
+            }
+            FreeJSONObjectCtx(joctx);
+        }
+        sdsfree(ref);
+    }
+}
+
+MU_TEST(test_jo_exact_capacity) {
+    const char *json = "[[1, 2, 3], {\"a\": [], \"b\": [\"x\", \"y\"]}, [{}]]";
+    Node *n, *item, *val;
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+
+    // containers are created with room for exactly their items
+    mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
+    mu_assert_int_eq(3, n->value.arrval->cap);
+    mu_check(OBJ_OK == Node_ArrayItem(n, 0, &item));
+    mu_assert_int_eq(3, item->value.arrval->cap);
+    mu_check(OBJ_OK == Node_ArrayItem(n, 1, &item));
+    mu_assert_int_eq(2, item->value.sdictval->cap);
+    mu_check(OBJ_OK == Node_DictGet(item, "a", &val));
+    mu_assert_int_eq(0, val->value.arrval->cap);
+    mu_check(OBJ_OK == Node_DictGet(item, "b", &val));
+    mu_assert_int_eq(2, val->value.arrval->cap);
+    mu_check(OBJ_OK == Node_ArrayItem(n, 2, &item));
+    mu_assert_int_eq(1, item->value.arrval->cap);
+    mu_check(OBJ_OK == Node_ArrayItem(item, 0, &val));
+    mu_assert_int_eq(0, val->value.sdictval->cap);
+
+    Node_Free(n);
+    FreeJSONObjectCtx(joctx);
+}
+
+MU_TEST(test_jo_unescape) {
+    // a long key, a short one, and values that unescape to inline and heap strings
+    const char *json = "{\"C:\\\\Windows\\\\System32\\\\drivers\\\\etc\\\\hosts\": "
+                       "\"\\u00e9\\u00e9\", \"k\\u00e9y\": \"\\ud83d\\ude00\", "
+                       "\"s\\t\": \"\\u20ac12345678\\n\"}";
+    const char *key;
+    uint32_t len;
+    Node *n, *val;
+
+    for (int impl = JSONINDEX_NONE; impl <= JSONINDEX_BEST; impl++) {
+        JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+        joctx->index = impl;
+        mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
+
+        mu_check(OBJ_OK == Node_DictItem(n, 0, &key, &len, &val));
+        mu_assert_int_eq(37, len);
+        mu_check(!memcmp("C:\\Windows\\System32\\drivers\\etc\\hosts", key, len));
+        mu_check(val->flags & NODE_F_INLINE);
+        mu_assert_int_eq(4, NODE_STRLEN(val));
+        mu_check(!strcmp("\xc3\xa9\xc3\xa9", NODE_STRDATA(val)));
+
+        mu_check(OBJ_OK == Node_DictItem(n, 1, &key, &len, &val));
+        mu_assert_int_eq(4, len);
+        mu_check(!memcmp("k\xc3\xa9y", key, len));
+        mu_check(!strcmp("\xf0\x9f\x98\x80", NODE_STRDATA(val)));
+
+        mu_check(OBJ_OK == Node_DictItem(n, 2, &key, &len, &val));
+        mu_check(2 == len && !memcmp("s\t", key, len));
+        mu_check(!(val->flags & NODE_F_INLINE));
+        mu_assert_int_eq(12, NODE_STRLEN(val));
+        mu_check(!strcmp("\xe2\x82\xac" "12345678\n", NODE_STRDATA(val)));
+
+        Node_Free(n);
+        FreeJSONObjectCtx(joctx);
+    }
+}
+
+MU_TEST(test_jo_trailing_values) {
+    const char *bad[] = {"{},{\"a\":1},5", "{\"a\":1},{\"b\":2}", "[1],2", "5,6", "\"a\",{}"};
+    const char *good = "{\"a\":[1,{\"b\":2}]}";
+    const char *key;
+    uint32_t len;
+    char *err;
+    Node *n, *val;
+
+    // nothing may follow the root, and a failed parse leaves the context reusable
+    for (int impl = JSONINDEX_NONE; impl <= JSONINDEX_BEST; impl++) {
+        JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+        joctx->index = impl;
+        for (int i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+            err = NULL;
+            mu_check(JSONOBJECT_ERROR == CreateNodeFromJSON(joctx, bad[i], strlen(bad[i]), &n,
+                                                            &err));
+            mu_check(NULL != strstr(err, "GARBAGE_TRAILING"));
+            free(err);
+        }
+
+        mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, good, strlen(good), &n, NULL));
+        mu_assert_int_eq(1, Node_Length(n));
+        mu_check(OBJ_OK == Node_DictItem(n, 0, &key, &len, &val));
+        mu_check(1 == len && 'a' == *key);
+        mu_assert_int_eq(2, Node_Length(val));
+
+        Node_Free(n);
+        FreeJSONObjectCtx(joctx);
+    }
+}
+
+MU_TEST(test_jo_numbers) {
+    int64_t i;
+    double d;
+
+#define PARSE_INT(s) JSONNumber_ParseInt(s, strlen(s), &i)
+#define PARSE_DOUBLE(s) JSONNumber_ParseDouble(s, strlen(s), &d)
+
+    // integers are in the range of int64_t
+    mu_check(PARSE_INT("9223372036854775807") && INT64_MAX == i);
+    mu_check(PARSE_INT("-9223372036854775808") && INT64_MIN == i);
+    mu_check(!PARSE_INT("9223372036854775808"));
+    mu_check(!PARSE_INT("-9223372036854775809"));
+    mu_check(!PARSE_INT("10000000000000000000"));
+    mu_check(PARSE_INT("-0") && 0 == i);
+
+    // 19 significant digits take the fast path, 20 are left to strtod
+    mu_check(PARSE_DOUBLE("1234567890123456789") && 0x1.12210f47de981p+60 == d);
+    mu_check(PARSE_DOUBLE("12345678901234567891") && 0x1.56a95319d63e1p+63 == d);
+
+    // halfway cases round to even
+    mu_check(PARSE_DOUBLE("9007199254740993") && 0x1p+53 == d);
+    mu_check(PARSE_DOUBLE("9007199254740993e0") && 0x1p+53 == d);
+    mu_check(PARSE_DOUBLE("9007199254740995") && 0x1.0000000000002p+53 == d);
+    mu_check(PARSE_DOUBLE("0.1") && 0x1.999999999999ap-4 == d);
+
+    // numbers that underflow to 0 or overflow are out of range, subnormals aren't
+    mu_check(!PARSE_DOUBLE("1e-400"));
+    mu_check(!PARSE_DOUBLE("2.4703282292062327e-324"));
+    mu_check(PARSE_DOUBLE("2.4703282292062328e-324") && 0x0.0000000000001p-1022 == d);
+    mu_check(PARSE_DOUBLE("4.9406564584124654e-324") && 0x0.0000000000001p-1022 == d);
+    mu_check(PARSE_DOUBLE("2.2250738585072011e-308") && 0x0.fffffffffffffp-1022 == d);
+    mu_check(PARSE_DOUBLE("2.2250738585072014e-308") && 0x1p-1022 == d);
+    mu_check(PARSE_DOUBLE("1.7976931348623157e308") && 0x1.fffffffffffffp+1023 == d);
+    mu_check(!PARSE_DOUBLE("1.7976931348623159e308"));
+    mu_check(!PARSE_DOUBLE("1e309"));
+
+    // negative zero keeps its sign
+    mu_check(PARSE_DOUBLE("-0.0") && 0 == d && signbit(d));
+
+#undef PARSE_INT
+#undef PARSE_DOUBLE
+
+    // and out of range numbers are parsing errors
+    Node *n;
+    char *err = NULL;
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+    mu_check(JSONOBJECT_OK != CreateNodeFromJSON(joctx, "[1e-400]", 8, &n, &err));
+    mu_check(err);
+    free(err);
+    FreeJSONObjectCtx(joctx);
+}
+
 MU_TEST(test_oj_null) {
     Node *n;
     sds str = sdsempty();
@@ -326,15 +539,32 @@ MU_TEST(test_oj_keyval) {
     Node *n;
     sds str = sdsempty();
     JSONSerializeOpt opt = {"", "", ""};
-    char *json = _JSTR(foo) ":" _JSTR(bar);
+    char *json = "{" _JSTR(foo) ":" _JSTR(bar) ",\"f\\\"o\":1}";
+    const char *key;
+    uint32_t len;
 
-    n = NewKeyValNode("foo", 3, NewCStringNode("bar"));
+    n = NewDictNode(1);
     mu_check(n);
+    mu_check(OBJ_OK == Node_DictSetLen(n, "foobar", 3, NewCStringNode("bar")));
+    mu_check(OBJ_OK == Node_DictSetLen(n, "f\"o", 3, NewIntNode(1)));
+    mu_check(OBJ_OK == Node_DictItem(n, 1, &key, &len, NULL));
+    mu_assert_int_eq(3, len);
+    mu_check(!strcmp("f\"o", key));
+    mu_check(OBJ_ERR == Node_DictItem(n, 2, &key, &len, NULL));
     SerializeNodeToJSON(n, &opt, &str);
     mu_check(str);
-    mu_check(0 == strncmp(json, str, strlen(str)));
+    mu_check(0 == strcmp(json, str));
     sdsfree(str);
     Node_Free(n);
+
+    // escaped keys survive parsing
+    Node *v;
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+    mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &n, NULL));
+    mu_check(OBJ_OK == Node_DictGet(n, "f\"o", &v));
+    mu_check(N_INTEGER == v->type && 1 == v->value.intval);
+    Node_Free(n);
+    FreeJSONObjectCtx(joctx);
 }
 
 MU_TEST(test_oj_dict) {
@@ -368,6 +598,24 @@ MU_TEST(test_oj_array) {
     mu_check(0 == strncmp(json, str, strlen(str)));
     sdsfree(str);
     Node_Free(n);
+
+    // packed arrays are parsed and serialized as any other
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+    const char *packed[] = {"[1,-2,3.5,1234567890123]", "[true,false,false,true]",
+                            "[[1,2],[true],[1,true,null]]",
+                            "[{\"a\":1,\"b\":\"x\"},{\"a\":2.5,\"b\":null},{\"a\":[],\"b\":{}},"
+                            "{\"a\":true,\"b\":\"a long string value\"}]",
+                            "[{\"a\":1},{\"a\":2},{\"a\":3},{\"b\":4}]"};
+    for (int i = 0; i < sizeof(packed) / sizeof(packed[0]); i++) {
+        mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, packed[i], strlen(packed[i]), &n, NULL));
+        mu_check((3 == i) == (NODE_ENC_TABLE == NODE_ENCODING(n)));
+        str = sdsempty();
+        SerializeNodeToJSON(n, &opt, &str);
+        mu_check(0 == strcmp(packed[i], str));
+        sdsfree(str);
+        Node_Free(n);
+    }
+    FreeJSONObjectCtx(joctx);
 }
 
 MU_TEST(test_oj_special_characters) {
@@ -409,7 +657,14 @@ MU_TEST_SUITE(test_json_literals) {
     MU_RUN_TEST(test_jo_create_literal_array);
 }
 
-MU_TEST_SUITE(test_json_object) { MU_RUN_TEST(test_jo_create_object); }
+MU_TEST_SUITE(test_json_object) {
+    MU_RUN_TEST(test_jo_create_object);
+    MU_RUN_TEST(test_jo_structural_index);
+    MU_RUN_TEST(test_jo_exact_capacity);
+    MU_RUN_TEST(test_jo_unescape);
+    MU_RUN_TEST(test_jo_trailing_values);
+    MU_RUN_TEST(test_jo_numbers);
+}
 
 MU_TEST_SUITE(test_object_to_json) {
     MU_RUN_TEST(test_oj_null);
@@ -1,13 +1,22 @@
 #include <assert.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <string.h>
+#include "../src/compact.h"
+#include "../src/json_object.h"
 #include "../src/json_path.h"
+#include "../src/lazyfree.h"
 #include "../src/object.h"
+#include "../src/object_type.h"
 #include "../src/path.h"
+#include "../src/tape.h"
 #include "minunit.h"
 #include <alloc.h>
 
 MU_TEST(testNodeString) {
+    // Nodes are packed into 16 bytes
+    mu_assert_int_eq(16, sizeof(Node));
+
     // Test creation of an empty C string
     Node *n1 = NewCStringNode("");
     mu_check(NULL != n1);
@@ -30,9 +39,60 @@ MU_TEST(testNodeString) {
     mu_assert_int_eq(OBJ_OK, Node_StringAppend(n1, n2));
     mu_check(NULL != n1);
     mu_assert_int_eq(6, Node_Length(n1));
-    mu_check(!strncmp(n1->value.strval.data, "foobar", Node_Length(n1)));
+    mu_check(!strncmp(NODE_STRDATA(n1), "foobar", Node_Length(n1)));
+    mu_check(n1->flags & NODE_F_INLINE);
+
+    // Test appending past the inline capacity, and then to a heap string
+    mu_assert_int_eq(OBJ_OK, Node_StringAppend(n1, n2));
+    mu_assert_int_eq(OBJ_OK, Node_StringAppend(n1, n2));
+    mu_check(!(n1->flags & NODE_F_INLINE));
+    mu_assert_int_eq(12, Node_Length(n1));
+    mu_check(!strcmp(NODE_STRDATA(n1), "foobarbarbar"));
     Node_Free(n1);
     Node_Free(n2);
+
+    // Test that appending grows heap strings geometrically
+    n1 = NewCStringNode("a string that is not inline");
+    mu_assert_int_eq(28, STRING_ALLOC_SIZE(n1));
+    n2 = NewCStringNode("0123456789");
+    mu_assert_int_eq(OBJ_OK, Node_StringAppend(n1, n2));
+    mu_assert_int_eq(64, STRING_ALLOC_SIZE(n1));
+    const char *data = NODE_STRDATA(n1);
+    mu_assert_int_eq(OBJ_OK, Node_StringAppend(n1, n2));
+    mu_check(data == NODE_STRDATA(n1));
+    for (int i = 0; i < 1000; i++) mu_assert_int_eq(OBJ_OK, Node_StringAppend(n1, n2));
+    mu_assert_int_eq(10047, Node_Length(n1));
+    mu_assert_int_eq(16384, STRING_ALLOC_SIZE(n1));
+    mu_check(!strncmp(&NODE_STRDATA(n1)[10037], "0123456789", 11));
+    Node_Free(n1);
+    Node_Free(n2);
+
+    // Test the longest inline string
+    n1 = NewCStringNode("01234567890");
+    mu_assert_int_eq(NODE_INLINE_STRLEN, Node_Length(n1));
+    mu_check(n1->flags & NODE_F_INLINE);
+    mu_check(!strcmp(NODE_STRDATA(n1), "01234567890"));
+    Node_Free(n1);
+}
+
+MU_TEST(testNodeShared) {
+    // booleans and small integers are shared
+    mu_check(NewBoolNode(1) == NewBoolNode(42));
+    mu_check(NewBoolNode(0) != NewBoolNode(1));
+    mu_check(NewIntNode(7) == NewIntNode(7));
+    mu_check(NewIntNode(NODE_SHARED_INT_MIN)->value.intval == NODE_SHARED_INT_MIN);
+    mu_check(NewIntNode(NODE_SHARED_INT_MAX)->value.intval == NODE_SHARED_INT_MAX);
+
+    // freeing a shared node is a noop
+    Node *n = NewIntNode(-1);
+    Node_Free(n);
+    mu_check(N_INTEGER == n->type && -1 == n->value.intval);
+
+    // but bigger integers aren't
+    n = NewIntNode(NODE_SHARED_INT_MAX + 1);
+    mu_check(!(n->flags & NODE_F_STATIC));
+    mu_check(NODE_SHARED_INT_MAX + 1 == n->value.intval);
+    Node_Free(n);
 }
 
 MU_TEST(testNodeArray) {
@@ -155,6 +215,238 @@ MU_TEST(testNodeArray) {
     Node_Free(arr);
 }
 
+MU_TEST(testNodeArrayPacked) {
+    Node *arr, *sub, *n;
+
+    // arrays that start with a shared small integer point to it
+    arr = NewArrayNode(0);
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, NewIntNode(1)));
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, NewDoubleNode(1.5)));
+    mu_check(!NODE_ENCODING(arr));
+    Node_Free(arr);
+
+    // numbers are stored in the array itself
+    arr = NewArrayNode(0);
+    for (int i = 0; i < 100; i++) {
+        mu_check(OBJ_OK == Node_ArrayAppend(arr, NewIntNode((i + 2) * 1000)));
+    }
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, NewDoubleNode(0.5)));
+    mu_check(NODE_ENC_PACKNUM == NODE_ENCODING(arr));
+    mu_assert_int_eq(101, Node_Length(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 99, &n));
+    mu_check(n->flags & NODE_F_EMBEDDED);
+    mu_check(N_INTEGER == n->type && 101000 == n->value.intval);
+    Node_Free(n);  // a no-op for packed items
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 100, &n));
+    mu_check(N_NUMBER == n->type && 0.5 == n->value.numval);
+
+    // setting, deleting, inserting and searching keep the encoding
+    mu_check(OBJ_OK == Node_ArraySet(arr, 0, NewDoubleNode(-1.5)));
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, 1, 98));
+    sub = NewArrayNode(1);
+    mu_check(OBJ_OK == Node_ArrayAppend(sub, NewIntNode(7)));
+    mu_check(OBJ_OK == Node_ArrayInsert(arr, 1, sub));
+    mu_check(NODE_ENC_PACKNUM == NODE_ENCODING(arr));
+    // arr = [-1.5, 7, 101000, 0.5]
+    mu_assert_int_eq(4, Node_Length(arr));
+    n = NewIntNode(101000);
+    mu_assert_int_eq(2, Node_ArrayIndex(arr, n, 0, 0));
+    Node_Free(n);
+    mu_assert_int_eq(-1, Node_ArrayIndex(arr, NewBoolNode(1), 0, 0));
+    mu_assert_int_eq(-1, Node_ArrayIndex(arr, NULL, 0, 0));
+
+    // the first item of another type converts the array to pointers
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, NewCStringNode("foo")));
+    mu_check(!NODE_ENCODING(arr));
+    mu_assert_int_eq(5, Node_Length(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 0, &n));
+    mu_check(!(n->flags & NODE_F_EMBEDDED));
+    mu_check(-1.5 == n->value.numval);
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 1, &n));
+    mu_check(7 == n->value.intval);
+    Node_Free(arr);
+
+    // booleans are stored as a bitmap
+    arr = NewArrayNode(0);
+    for (int i = 0; i < 200; i++) mu_check(OBJ_OK == Node_ArrayAppend(arr, NewBoolNode(i % 3)));
+    mu_check(NODE_ENC_PACKBOOL == NODE_ENCODING(arr));
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, 0, 1));
+    mu_check(OBJ_OK == Node_ArrayPrepend(arr, NewBoolNode(0)));
+    mu_check(OBJ_OK == Node_ArraySet(arr, 199, NewBoolNode(0)));
+    for (int i = 0; i < 199; i++) {
+        mu_check(OBJ_OK == Node_ArrayItem(arr, i, &n));
+        mu_check(N_BOOLEAN == n->type && (i % 3 != 0) == n->value.boolval);
+    }
+    mu_assert_int_eq(3, Node_ArrayIndex(arr, NewBoolNode(0), 1, 0));
+    n = Node_ArrayTake(arr, 1);
+    mu_check(N_BOOLEAN == n->type && 1 == n->value.boolval);
+    mu_assert_int_eq(199, Node_Length(arr));
+
+    // a clone is packed too
+    Node *clone = Node_Clone(arr);
+    mu_check(NODE_ENC_PACKBOOL == NODE_ENCODING(clone));
+    mu_assert_int_eq(199, Node_Length(clone));
+    mu_check(OBJ_OK == Node_ArrayItem(clone, 2, &n));
+    mu_check(0 == n->value.boolval);
+    Node_Free(clone);
+
+    // numbers don't go in bitmaps
+    mu_check(OBJ_OK == Node_ArraySet(arr, 0, NewIntNode(1)));
+    mu_check(!NODE_ENCODING(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 0, &n));
+    mu_check(N_INTEGER == n->type);
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 2, &n));
+    mu_check(N_BOOLEAN == n->type && 0 == n->value.boolval);
+    Node_Free(arr);
+}
+
+MU_TEST(testNodeArrayTable) {
+    Node *arr, *obj, *n;
+
+    // arrays of objects with the same keys are tabulated
+    arr = NewArrayNode(0);
+    for (int i = 0; i < 10; i++) {
+        obj = NewDictNode(3);
+        mu_check(OBJ_OK == Node_DictSet(obj, "id", NewIntNode(i * 10000)));
+        n = NewCStringNode(i % 2 ? "a long string value" : "short");
+        mu_check(OBJ_OK == Node_DictSet(obj, "name", n));
+        mu_check(OBJ_OK == Node_DictSet(obj, "tags", i % 3 ? NewArrayNode(0) : NULL));
+        mu_check(OBJ_OK == Node_ArrayAppend(arr, obj));
+    }
+    mu_check(OBJ_OK == Node_ArrayTabulate(arr));
+    mu_check(NODE_ENC_TABLE == NODE_ENCODING(arr));
+    mu_assert_int_eq(10, Node_Length(arr));
+
+    // rows are looked up in place
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 3, &obj));
+    mu_check(NODE_IS_ROW(obj));
+    mu_assert_int_eq(3, Node_Length(obj));
+    mu_check(OBJ_OK == Node_DictGet(obj, "id", &n));
+    mu_check(N_INTEGER == n->type && 30000 == n->value.intval);
+    mu_check(OBJ_OK == Node_DictGet(obj, "name", &n));
+    mu_check(0 == strcmp("a long string value", NODE_STRDATA(n)));
+    mu_check(OBJ_OK == Node_DictGet(obj, "tags", &n));
+    mu_check(NULL == n);
+    mu_check(OBJ_ERR == Node_DictGet(obj, "nope", &n));
+    mu_check(OBJ_ERR == Node_DictDel(obj, "nope"));
+
+    // replacing values, appending, inserting and taking objects keep the table
+    mu_check(OBJ_OK == Node_DictSet(obj, "tags", NewArrayNode(0)));
+    mu_check(OBJ_OK == Node_DictGet(obj, "tags", &n));
+    mu_check(OBJ_OK == Node_ArrayAppend(n, NewCStringNode("x")));
+    mu_check(OBJ_OK == Node_DictSet(obj, "name", NewCStringNode("another long string value")));
+    obj = Node_Clone(obj);
+    mu_check(!NODE_IS_ROW(obj));
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, obj));
+    mu_check(OBJ_OK == Node_ArrayPrepend(arr, Node_ArrayTake(arr, 10)));
+    mu_check(NODE_ENC_TABLE == NODE_ENCODING(arr));
+    mu_assert_int_eq(11, Node_Length(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 0, &obj));
+    mu_check(OBJ_OK == Node_DictGet(obj, "name", &n));
+    mu_check(0 == strcmp("another long string value", NODE_STRDATA(n)));
+    mu_check(OBJ_OK == Node_DictGet(obj, "tags", &n));
+    mu_assert_int_eq(1, Node_Length(n));
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, 1, 2));
+    mu_assert_int_eq(9, Node_Length(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 1, &obj));
+    mu_check(OBJ_OK == Node_DictGet(obj, "id", &n));
+    mu_check(20000 == n->value.intval);
+
+    // a clone is a table too
+    Node *clone = Node_Clone(arr);
+    mu_check(NODE_ENC_TABLE == NODE_ENCODING(clone));
+    mu_check(OBJ_OK == Node_ArrayItem(clone, 0, &obj));
+    mu_check(OBJ_OK == Node_DictItem(obj, 1, NULL, NULL, &n));
+    mu_check(0 == strcmp("another long string value", NODE_STRDATA(n)));
+    Node_Free(clone);
+
+    // a new key turns the table back into objects
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 1, &obj));
+    mu_check(OBJ_OK == Node_DictSet(obj, "extra", NewBoolNode(1)));
+    mu_check(!NODE_ENCODING(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 1, &obj));
+    mu_check(!NODE_IS_ROW(obj));
+    mu_assert_int_eq(4, Node_Length(obj));
+    mu_check(OBJ_OK == Node_DictGet(obj, "id", &n));
+    mu_check(!(n->flags & NODE_F_EMBEDDED) && 20000 == n->value.intval);
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 0, &obj));
+    mu_check(OBJ_OK == Node_DictGet(obj, "tags", &n));
+    mu_assert_int_eq(1, Node_Length(n));
+
+    // and so do other shapes, or deleting a key
+    obj = Node_ArrayTake(arr, 1);
+    mu_check(OBJ_OK == Node_DictDel(obj, "extra"));
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, obj));
+    mu_check(OBJ_OK == Node_ArrayTabulate(arr));
+    mu_check(OBJ_OK == Node_ArrayAppend(arr, NewIntNode(1)));
+    mu_check(!NODE_ENCODING(arr));
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, -1, 1));
+    mu_check(OBJ_OK == Node_ArrayTabulate(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 4, &obj));
+    mu_check(OBJ_OK == Node_DictDel(obj, "id"));
+    mu_check(!NODE_ENCODING(arr));
+    mu_check(OBJ_ERR == Node_ArrayTabulate(arr));
+    Node_Free(arr);
+}
+
+MU_TEST(testNodeArrayDeque) {
+    Node *arr, *n;
+
+    // removing from the head doesn't move or reallocate the array
+    arr = NewArrayNode(0);
+    for (int i = 0; i < 1000; i++) mu_check(OBJ_OK == Node_ArrayAppend(arr, NewCStringNode("item")));
+    t_array *a = arr->value.arrval;
+    uint32_t cap = a->cap;
+    Node *last = a->entries[999];
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, 0, 10));
+    for (int i = 0; i < 489; i++) Node_Free(Node_ArrayTake(arr, 0));
+    mu_assert_int_eq(501, Node_Length(arr));
+    mu_check(a == arr->value.arrval && cap == a->cap);
+    mu_check(last == a->entries[999]);
+
+    // and so does adding to the head, while there's room before it
+    mu_check(OBJ_OK == Node_ArrayPrepend(arr, NewCStringNode("first")));
+    mu_check(a == arr->value.arrval && cap == a->cap);
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 0, &n));
+    mu_check(!strcmp("first", NODE_STRDATA(n)));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 501, &n));
+    mu_check(last == n);
+
+    // a queue reuses the room that was left at the head instead of growing
+    for (int i = 0; i < 100000; i++) {
+        mu_check(OBJ_OK == Node_ArrayAppend(arr, NewIntNode(i)));
+        Node_Free(Node_ArrayTake(arr, 0));
+    }
+    mu_assert_int_eq(502, Node_Length(arr));
+    mu_check(cap == arr->value.arrval->cap);
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 501, &n));
+    mu_check(99999 == n->value.intval);
+    Node_Free(arr);
+
+    // repeated prepends to packed arrays keep the items in order
+    arr = NewArrayNode(0);
+    for (int i = 0; i < 1000; i++) mu_check(OBJ_OK == Node_ArrayPrepend(arr, NewDoubleNode(i)));
+    mu_check(NODE_ENC_PACKNUM == NODE_ENCODING(arr));
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, 0, 500));
+    Node *sub = NewArrayNode(1);
+    mu_check(OBJ_OK == Node_ArrayAppend(sub, NewDoubleNode(-1)));
+    mu_check(OBJ_OK == Node_ArrayInsert(arr, 0, sub));
+    mu_check(OBJ_OK == Node_ArrayItem(arr, 0, &n));
+    mu_check(-1 == n->value.numval);
+    for (int i = 1; i < 501; i++) {
+        mu_check(OBJ_OK == Node_ArrayItem(arr, i, &n));
+        mu_check(500 - i == n->value.numval);
+    }
+
+    // copies start at their first entry
+    Node *clone = Node_Clone(arr);
+    mu_assert_int_eq(501, Node_Length(clone));
+    mu_check(OBJ_OK == Node_ArrayItem(clone, 500, &n));
+    mu_check(0 == n->value.numval);
+    Node_Free(clone);
+    Node_Free(arr);
+}
+
 MU_TEST(testObject) {
     Node *root = NewDictNode(1);
     mu_check(root != NULL);
@@ -186,6 +478,797 @@ MU_TEST(testObject) {
     Node_Free(root);
 }
 
+MU_TEST(testObjectIndexed) {
+    Node *root = NewDictNode(1);
+    Node *n;
+    char key[32];
+    const int count = 1000;
+
+    // grow the dictionary way past the index threshold
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mu_check(OBJ_OK == Node_DictSet(root, key, NewIntNode(i)));
+    }
+    mu_assert_int_eq(count, Node_Length(root));
+    mu_check(NULL != root->value.dictval->index);
+
+    // entries keep their insertion order
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mu_check(!strcmp(key, root->value.dictval->entries[i].key->data));
+        mu_check(OBJ_OK == Node_DictGet(root, key, &n));
+        mu_check(i == n->value.intval);
+    }
+    mu_check(OBJ_ERR == Node_DictGet(root, "nokey", &n));
+
+    // replacing a value doesn't add an entry
+    mu_check(OBJ_OK == Node_DictSet(root, "key42", NewIntNode(-42)));
+    mu_assert_int_eq(count, Node_Length(root));
+    mu_check(OBJ_OK == Node_DictGet(root, "key42", &n));
+    mu_check(-42 == n->value.intval);
+
+    // delete every other key and verify that the rest are still reachable
+    for (int i = 0; i < count; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mu_check(OBJ_OK == Node_DictDel(root, key));
+        mu_check(OBJ_ERR == Node_DictDel(root, key));
+    }
+    mu_assert_int_eq(count / 2, Node_Length(root));
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        if (i % 2) {
+            mu_check(OBJ_OK == Node_DictGet(root, key, &n));
+            mu_check((i == 42 ? -42 : i) == n->value.intval);
+        } else {
+            mu_check(OBJ_ERR == Node_DictGet(root, key, &n));
+        }
+    }
+
+    Node_Free(root);
+}
+
+MU_TEST(testObjectAppend) {
+    Node *root = NewDictNode(1);
+    Node *n;
+    char key[32];
+    const int count = 1000;
+
+    // every tenth key is appended again later, and the last value wins in the first position
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mu_check(OBJ_OK == Node_DictAppendLen(root, key, strlen(key), NewIntNode(i)));
+    }
+    for (int i = 0; i < count; i += 10) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mu_check(OBJ_OK == Node_DictAppendLen(root, key, strlen(key), NewIntNode(-i)));
+    }
+    mu_check(OBJ_OK == Node_DictAppendLen(root, "key1", 4, NULL));
+    mu_assert_int_eq(count + count / 10 + 1, root->value.dictval->len);
+
+    Node_DictDedupe(root);
+    mu_assert_int_eq(count, Node_Length(root));
+    mu_check(NULL != root->value.dictval->index);
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        mu_check(!strcmp(key, root->value.dictval->entries[i].key->data));
+        mu_check(OBJ_OK == Node_DictGet(root, key, &n));
+        if (1 == i) {
+            mu_check(NULL == n);
+        } else {
+            mu_check((i % 10 ? i : -i) == n->value.intval);
+        }
+    }
+
+    // small dictionaries are shaped, and have their keys checked right away
+    Node *small = NewDictNode(1);
+    mu_check(OBJ_OK == Node_DictAppendLen(small, "a", 1, NewIntNode(1)));
+    mu_check(OBJ_OK == Node_DictAppendLen(small, "a", 1, NewIntNode(2)));
+    Node_DictDedupe(small);
+    mu_assert_int_eq(1, Node_Length(small));
+    mu_check(OBJ_OK == Node_DictGet(small, "a", &n));
+    mu_check(2 == n->value.intval);
+
+    Node_Free(small);
+    Node_Free(root);
+}
+
+MU_TEST(testKeyTable) {
+    KeyTable *kt = VALKEYJSON_KEYTABLE_GLOBAL;
+    size_t keys = kt->numKeys;
+    Node *n;
+
+    // identical keys are stored once
+    Node *d1 = NewDictNode(1);
+    Node *d2 = NewDictNode(1);
+    mu_check(OBJ_OK == Node_DictSet(d1, "interned", NewIntNode(1)));
+    mu_check(OBJ_OK == Node_DictSet(d2, "interned", NewIntNode(2)));
+    mu_check(OBJ_OK == Node_DictSet(d2, "other", NewIntNode(3)));
+    mu_assert_int_eq(keys + 2, kt->numKeys);
+    const char *k1, *k2;
+    uint32_t l1, l2;
+    mu_check(OBJ_OK == Node_DictItem(d1, 0, &k1, &l1, &n));
+    mu_check(OBJ_OK == Node_DictItem(d2, 0, &k2, &l2, &n));
+    mu_check(k1 == k2);
+    // ...and referenced once, by the shape that both dictionaries share a prefix of
+    mu_assert_int_eq(1, KeyTable_Find(kt, "interned", 8)->refcount);
+    mu_check(OBJ_OK == Node_DictGet(d2, "interned", &n));
+    mu_check(2 == n->value.intval);
+
+    // lookups hold a reference while they use a key, and replacements don't keep one
+    t_key *k = KeyTable_FindRetain(kt, "interned", 8);
+    mu_assert_int_eq(2, k->refcount);
+    KeyTable_Release(kt, k);
+    mu_check(NULL == KeyTable_FindRetain(kt, "missing", 7));
+    mu_check(OBJ_OK == Node_DictSet(d2, "interned", NewIntNode(2)));
+    mu_assert_int_eq(1, k->refcount);
+
+    // keys are released with their last reference
+    Node_Free(d1);
+    mu_assert_int_eq(keys + 2, kt->numKeys);
+    mu_check(OBJ_OK == Node_DictDel(d2, "interned"));
+    mu_assert_int_eq(keys + 1, kt->numKeys);
+    mu_check(NULL == KeyTable_Find(kt, "interned", 8));
+    mu_check(OBJ_ERR == Node_DictGet(d2, "interned", &n));
+    Node_Free(d2);
+    mu_assert_int_eq(keys, kt->numKeys);
+}
+
+MU_TEST(testShapes) {
+    ShapeTable *st = VALKEYJSON_SHAPETABLE_GLOBAL;
+    size_t shapes = st->numShapes;
+    Node *n;
+
+    // objects with the same keys in the same order share a shape
+    Node *d1 = NewDictNode(2);
+    Node *d2 = NewDictNode(2);
+    Node *d3 = NewDictNode(2);
+    mu_check(NODE_ENC_SHAPED == NODE_ENCODING(d1));
+    mu_check(OBJ_OK == Node_DictSet(d1, "x", NewIntNode(1)));
+    mu_check(OBJ_OK == Node_DictSet(d1, "y", NewIntNode(2)));
+    mu_check(OBJ_OK == Node_DictSet(d2, "x", NewIntNode(3)));
+    mu_check(OBJ_OK == Node_DictSet(d2, "y", NewIntNode(4)));
+    mu_check(OBJ_OK == Node_DictSet(d3, "y", NewIntNode(5)));
+    mu_check(OBJ_OK == Node_DictSet(d3, "x", NewIntNode(6)));
+    t_shape *s = d1->value.sdictval->shape;
+    mu_check(s == d2->value.sdictval->shape);
+    mu_check(s != d3->value.sdictval->shape);
+    mu_assert_int_eq(2, s->refcount);
+    mu_assert_int_eq(shapes + 4, st->numShapes);
+
+    // replacing a value keeps the shape
+    mu_check(OBJ_OK == Node_DictSet(d2, "y", NewIntNode(7)));
+    mu_check(s == d2->value.sdictval->shape);
+    mu_check(OBJ_OK == Node_DictGet(d2, "y", &n));
+    mu_check(7 == n->value.intval);
+
+    // deleting a key moves to the shape of the remaining keys
+    mu_check(OBJ_OK == Node_DictDel(d3, "y"));
+    mu_check(s->parent == d3->value.sdictval->shape);
+    mu_check(OBJ_OK == Node_DictGet(d3, "x", &n));
+    mu_check(6 == n->value.intval);
+    mu_assert_int_eq(shapes + 2, st->numShapes);
+
+    // a taken value is detached from the object
+    n = Node_DictTake(d1, "x");
+    mu_check(n && 1 == n->value.intval);
+    Node_Free(n);
+    mu_check(NULL == Node_DictTake(d1, "x"));
+    mu_assert_int_eq(1, Node_Length(d1));
+    mu_check(OBJ_OK == Node_DictGet(d1, "y", &n));
+    mu_check(2 == n->value.intval);
+
+    // objects with many keys have keys of their own
+    char key[16];
+    for (int i = 0; i < SHAPE_MAX_KEYS + 1; i++) {
+        sprintf(key, "key%d", i);
+        mu_check(OBJ_OK == Node_DictSet(d2, key, NewIntNode(i)));
+    }
+    mu_check(NODE_ENC_SHAPED != NODE_ENCODING(d2));
+    mu_assert_int_eq(SHAPE_MAX_KEYS + 3, Node_Length(d2));
+    mu_check(OBJ_OK == Node_DictGet(d2, "x", &n));
+    mu_check(3 == n->value.intval);
+    mu_check(OBJ_OK == Node_DictGet(d2, "key32", &n));
+    mu_check(32 == n->value.intval);
+
+    // shapes are released with the objects that use them
+    Node_Free(d1);
+    Node_Free(d2);
+    Node_Free(d3);
+    mu_assert_int_eq(shapes, st->numShapes);
+}
+
+MU_TEST(testArena) {
+    Arena *a = NewArena(0);
+    Node *n, *m;
+
+    // nodes and their data are allocated from the active arena
+    Node_SetArena(a);
+    Node *root = NewDictNode(1);
+    Node *arr = NewArrayNode(0);
+    mu_check(OBJ_OK == Node_DictSet(root, "arr", arr));
+    mu_check(OBJ_OK == Node_DictSet(root, "str", NewCStringNode("a string that is not inline")));
+    for (int i = 0; i < 100; i++) mu_check(OBJ_OK == Node_ArrayAppend(arr, NewDoubleNode(i)));
+    Node_SetArena(NULL);
+    mu_check(root->flags & NODE_F_ARENA);
+    mu_check(root->flags & NODE_F_ARENADATA);
+    mu_check(a->used > 100 * sizeof(Node));
+    // the array's old buffers and the appended nodes were left behind
+    mu_check(Node_ArenaReleased() > 0);
+
+    // nodes created after the arena was deactivated come from the heap
+    mu_check(OBJ_OK == Node_DictSet(root, "heap", NewDoubleNode(1.5)));
+    mu_check(OBJ_OK == Node_DictGet(root, "heap", &n));
+    mu_check(!(n->flags & NODE_F_ARENA));
+    Node_ArenaReleased();  // the dictionary's entries moved to the heap as it grew
+
+    // releasing arena nodes is accounted
+    mu_check(OBJ_OK == Node_ArrayDelRange(arr, 0, 10));
+    mu_check(OBJ_OK == Node_DictSet(root, "str", NewDoubleNode(2.5)));
+    mu_assert_int_eq(sizeof(Node) + 28, Node_ArenaReleased());
+    mu_assert_int_eq(0, Node_ArenaReleased());
+
+    // a clone lives on the heap and outlives the arena
+    Node *clone = Node_Clone(root);
+    Node_Free(root);
+    Node_ArenaReleased();
+    Arena_Free(a);
+    mu_check(!(clone->flags & NODE_F_ARENA));
+    mu_check(OBJ_OK == Node_DictGet(clone, "arr", &n));
+    mu_assert_int_eq(90, Node_Length(n));
+    mu_check(OBJ_OK == Node_ArrayItem(n, 0, &m));
+    mu_check(10 == m->value.numval);
+    mu_check(OBJ_OK == Node_DictGet(clone, "str", &n));
+    mu_check(2.5 == n->value.numval);
+    Node_Free(clone);
+
+    // a big size hint doesn't make a chunk bigger than the maximum, so the unused tail is bounded
+    a = NewArena(1 << 20);
+    for (int i = 0; i < 10000; i++) Arena_Alloc(a, 24);
+    mu_check(a->chunks->size <= ARENA_MAX_CHUNK_SIZE);
+    mu_check(a->size - a->used < ARENA_MAX_CHUNK_SIZE);
+    Arena_Free(a);
+}
+
+MU_TEST(testMemoryAccounting) {
+    size_t base = Node_Allocated();
+    Arena *a = NewArena(0);
+
+    // build a document that uses every encoding, partly in an arena
+    Node_SetArena(a);
+    Node *root = NewDictNode(1);
+    Node *objs = NewArrayNode(0);
+    for (int i = 0; i < 10; i++) {
+        Node *o = NewDictNode(2);
+        mu_check(OBJ_OK == Node_DictSet(o, "id", NewIntNode(i)));
+        mu_check(OBJ_OK == Node_DictSet(o, "name", NewCStringNode("a name that is not inline")));
+        mu_check(OBJ_OK == Node_ArrayAppend(objs, o));
+    }
+    mu_check(OBJ_OK == Node_DictSet(root, "objs", objs));
+    Node_SetArena(NULL);
+    mu_check(OBJ_OK == Node_ArrayTabulate(objs));
+    Node *nums = NewArrayNode(0);
+    for (int i = 0; i < 100; i++) mu_check(OBJ_OK == Node_ArrayAppend(nums, NewIntNode(i)));
+    mu_check(OBJ_OK == Node_DictSet(root, "nums", nums));
+    Node *big = NewDictNode(0);
+    char k[16];
+    for (int i = 0; i < 100; i++) {
+        sprintf(k, "key%d", i);
+        mu_check(OBJ_OK == Node_DictSet(big, k, NewBoolNode(i % 2)));
+    }
+    mu_check(OBJ_OK == Node_DictSet(root, "big", big));
+    Node *str = NewCStringNode("");
+    Node *part = NewCStringNode("a part that is appended");
+    for (int i = 0; i < 10; i++) mu_check(OBJ_OK == Node_StringAppend(str, part));
+    Node_Free(part);
+    mu_check(OBJ_OK == Node_DictSet(root, "str", str));
+    Node_ArenaReleased();
+
+    // the running total matches what the document's nodes report
+    mu_assert_int_eq(ObjectTypeMemoryUsage(root), Node_Allocated() - base);
+    mu_check(OBJ_OK == Node_ArrayDelRange(nums, 0, 50));
+    mu_check(OBJ_OK == Node_DictDel(big, "key0"));
+    mu_assert_int_eq(ObjectTypeMemoryUsage(root), Node_Allocated() - base);
+    mu_assert_int_eq(ObjectTypeMemoryUsage(root), Node_MemoryUsageUpTo(root, SIZE_MAX));
+
+    Node_Free(root);
+    Node_ArenaReleased();
+    Arena_Free(a);
+    mu_assert_int_eq(base, Node_Allocated());
+}
+
+MU_TEST(testShrinkToFit) {
+    size_t base = Node_Allocated();
+    char k[16];
+
+    // small slack isn't worth a reallocation
+    Node *small = NewArrayNode(0);
+    for (int i = 0; i < 100; i++) mu_check(OBJ_OK == Node_ArrayAppend(small, NewCStringNode("s")));
+    mu_check(OBJ_OK == Node_ArrayDelRange(small, 0, 90));
+    Node_ShrinkToFit(small);
+    mu_assert_int_eq(128, small->value.arrval->cap);
+    Node_Free(small);
+
+    // pointer arrays move their items to the start of the entries
+    Node *ptrs = NewArrayNode(0);
+    for (int i = 0; i < 2000; i++) {
+        sprintf(k, "str%d", i);
+        mu_check(OBJ_OK == Node_ArrayAppend(ptrs, NewCStringNode(k)));
+    }
+    mu_check(OBJ_OK == Node_ArrayDelRange(ptrs, 0, 1990));
+    Node_ShrinkToFit(ptrs);
+    mu_assert_int_eq(16, ptrs->value.arrval->cap);
+    mu_assert_int_eq(10, Node_Length(ptrs));
+    for (int i = 0; i < 10; i++) {
+        Node *n;
+        sprintf(k, "str%d", 1990 + i);
+        mu_check(OBJ_OK == Node_ArrayItem(ptrs, i, &n));
+        mu_check(!strcmp(k, NODE_STRDATA(n)));
+    }
+    mu_check(OBJ_OK == Node_ArrayAppend(ptrs, NewCStringNode("last")));
+    mu_assert_int_eq(11, Node_Length(ptrs));
+
+    // packed arrays
+    Node *nums = NewArrayNode(0);
+    for (int i = 0; i < 2000; i++) mu_check(OBJ_OK == Node_ArrayAppend(nums, NewIntNode(i * 1000)));
+    mu_check(OBJ_OK == Node_ArrayDelRange(nums, 10, 1990));
+    Node_ShrinkToFit(nums);
+    mu_assert_int_eq(16, nums->value.arrval->cap);
+    for (int i = 0; i < 10; i++) {
+        Node *n;
+        mu_check(OBJ_OK == Node_ArrayItem(nums, i, &n));
+        mu_assert_int_eq(i * 1000, n->value.intval);
+    }
+
+    // tables gather their columns
+    Node *tbl = NewArrayNode(0);
+    for (int i = 0; i < 1000; i++) {
+        Node *o = NewDictNode(2);
+        mu_check(OBJ_OK == Node_DictSet(o, "id", NewIntNode(i)));
+        mu_check(OBJ_OK == Node_DictSet(o, "name", NewCStringNode("a name that is not inline")));
+        mu_check(OBJ_OK == Node_ArrayAppend(tbl, o));
+    }
+    mu_check(OBJ_OK == Node_ArrayTabulate(tbl));
+    mu_check(OBJ_OK == Node_ArrayDelRange(tbl, 0, 995));
+    Node_ShrinkToFit(tbl);
+    mu_assert_int_eq(NODE_ENC_TABLE, NODE_ENCODING(tbl));
+    mu_assert_int_eq(8, tbl->value.tblval->cap);
+    for (int i = 0; i < 5; i++) {
+        Node *o, *id, *name;
+        mu_check(OBJ_OK == Node_ArrayItem(tbl, i, &o));
+        mu_check(OBJ_OK == Node_DictGet(o, "id", &id));
+        mu_assert_int_eq(995 + i, id->value.intval);
+        mu_check(OBJ_OK == Node_DictGet(o, "name", &name));
+        mu_check(!strcmp("a name that is not inline", NODE_STRDATA(name)));
+    }
+
+    // dictionaries drop their index once they're small
+    Node *dict = NewDictNode(0);
+    for (int i = 0; i < 1000; i++) {
+        sprintf(k, "key%d", i);
+        mu_check(OBJ_OK == Node_DictSet(dict, k, NewIntNode(i)));
+    }
+    for (int i = 10; i < 1000; i++) {
+        sprintf(k, "key%d", i);
+        mu_check(OBJ_OK == Node_DictDel(dict, k));
+    }
+    Node_ShrinkToFit(dict);
+    mu_assert_int_eq(16, dict->value.dictval->cap);
+    mu_check(NULL == dict->value.dictval->index);
+    for (int i = 0; i < 10; i++) {
+        Node *n;
+        sprintf(k, "key%d", i);
+        mu_check(OBJ_OK == Node_DictGet(dict, k, &n));
+        mu_assert_int_eq(i, n->value.intval);
+    }
+
+    // the running total follows the shrunk containers
+    mu_assert_int_eq(ObjectTypeMemoryUsage(ptrs) + ObjectTypeMemoryUsage(nums) +
+                         ObjectTypeMemoryUsage(tbl) + ObjectTypeMemoryUsage(dict),
+                     Node_Allocated() - base);
+    Node_Free(ptrs);
+    Node_Free(nums);
+    Node_Free(tbl);
+    Node_Free(dict);
+    mu_assert_int_eq(base, Node_Allocated());
+}
+
+MU_TEST(testOptimize) {
+    size_t base = Node_Allocated();
+
+    // arrays that held a string before their other items can't be encoded as they were built
+    Node *root = NewDictNode(4);
+    const char *names[] = {"nums", "ints", "flags", "rows"};
+    for (int a = 0; a < 4; a++) {
+        Node *arr = NewArrayNode(0);
+        mu_check(OBJ_OK == Node_ArrayAppend(arr, NewCStringNode("first")));
+        for (int i = 0; i < 100; i++) {
+            Node *n = NULL;
+            if (0 == a) n = NewDoubleNode(i + 0.5);
+            if (1 == a) n = NewIntNode(i);
+            if (2 == a) n = NewBoolNode(i % 3);
+            if (3 == a) {
+                n = NewDictNode(2);
+                mu_check(OBJ_OK == Node_DictSet(n, "id", NewIntNode(i)));
+                mu_check(OBJ_OK == Node_DictSet(n, "name", NewCStringNode("name")));
+            }
+            mu_check(OBJ_OK == Node_ArrayAppend(arr, n));
+        }
+        mu_check(OBJ_OK == Node_ArrayDelRange(arr, 0, 1));
+        mu_check(OBJ_OK == Node_DictSet(root, names[a], arr));
+    }
+    size_t before = Node_Allocated() - base;
+
+    Node_Optimize(root);
+    Node *nums, *ints, *flags, *rows;
+    mu_check(OBJ_OK == Node_DictGet(root, "nums", &nums));
+    mu_check(OBJ_OK == Node_DictGet(root, "ints", &ints));
+    mu_check(OBJ_OK == Node_DictGet(root, "flags", &flags));
+    mu_check(OBJ_OK == Node_DictGet(root, "rows", &rows));
+    mu_assert_int_eq(NODE_ENC_PACKNUM, NODE_ENCODING(nums));
+    mu_assert_int_eq(NODE_ENC_PACKBOOL, NODE_ENCODING(flags));
+    mu_assert_int_eq(NODE_ENC_TABLE, NODE_ENCODING(rows));
+    // pointers to the shared small integers take less than packing them
+    mu_assert_int_eq(0, NODE_ENCODING(ints));
+
+    for (int i = 0; i < 100; i++) {
+        Node *n, *id;
+        mu_check(OBJ_OK == Node_ArrayItem(nums, i, &n));
+        mu_check(i + 0.5 == n->value.numval);
+        mu_check(OBJ_OK == Node_ArrayItem(ints, i, &n));
+        mu_assert_int_eq(i, n->value.intval);
+        mu_check(OBJ_OK == Node_ArrayItem(flags, i, &n));
+        mu_assert_int_eq(i % 3 != 0, n->value.boolval);
+        mu_check(OBJ_OK == Node_ArrayItem(rows, i, &n));
+        mu_check(OBJ_OK == Node_DictGet(n, "id", &id));
+        mu_assert_int_eq(i, id->value.intval);
+    }
+
+    // it takes less memory, which is accounted for
+    mu_check(Node_Allocated() - base < before);
+    mu_assert_int_eq(ObjectTypeMemoryUsage(root), Node_Allocated() - base);
+    Node_Free(root);
+    mu_assert_int_eq(base, Node_Allocated());
+}
+
+/* Returns an array of objects that is big enough to be freed in the background */
+static Node *testLazyValue(void) {
+    Node *arr = NewArrayNode(0);
+    for (int i = 0; i < 1000; i++) {
+        Node *o = NewDictNode(1);
+        Node_DictSet(o, "lazykey", NewCStringNode("a value that is not inline"));
+        Node_ArrayAppend(arr, o);
+    }
+    return arr;
+}
+
+MU_TEST(testLazyFree) {
+    Node *n;
+
+    // taking a range of items out of an array
+    Node *arr = NewArrayNode(0);
+    for (int i = 0; i < 10; i++) mu_check(OBJ_OK == Node_ArrayAppend(arr, NewCStringNode("item")));
+    mu_check(OBJ_OK == Node_ArraySet(arr, 3, NewCStringNode("third")));
+    Node *taken = Node_ArrayTakeRange(arr, 2, 3);
+    mu_assert_int_eq(3, Node_Length(taken));
+    mu_assert_int_eq(7, Node_Length(arr));
+    mu_check(OBJ_OK == Node_ArrayItem(taken, 1, &n));
+    mu_check(!strcmp("third", NODE_STRDATA(n)));
+    Node_Free(taken);
+    mu_check(NULL == Node_ArrayTakeRange(arr, 0, 0));
+    Node_Free(arr);
+
+    // packed arrays have nothing to take
+    arr = NewArrayNode(0);
+    for (int i = 0; i < 10; i++) mu_check(OBJ_OK == Node_ArrayAppend(arr, NewDoubleNode(i)));
+    mu_check(NULL == Node_ArrayTakeRange(arr, -4, 4));
+    mu_assert_int_eq(6, Node_Length(arr));
+    Node_Free(arr);
+
+    // big values are freed in the background, and their memory is handed off right away
+    size_t base = Node_Allocated();
+    arr = testLazyValue();
+    LazyFree_Free(arr, NULL, ObjectTypeMemoryUsage(arr));
+    mu_assert_int_eq(base, Node_Allocated());
+    LazyFree_Wait();
+    mu_assert_int_eq(0, LazyFree_Pending());
+    mu_check(NULL == KeyTable_Find(VALKEYJSON_KEYTABLE_GLOBAL, "lazykey", 7));
+
+    // small ones are freed right away
+    n = NewCStringNode("a value that is not inline");
+    LazyFree_Free(n, NULL, ObjectTypeMemoryUsage(n));
+    mu_assert_int_eq(0, LazyFree_Pending());
+    mu_assert_int_eq(base, Node_Allocated());
+
+    // values that weren't measured only look as far as telling that they're big
+    LazyFreeJob *jobs = NULL;
+    arr = testLazyValue();
+    size_t memory = ObjectTypeMemoryUsage(arr);
+    mu_check(Node_MemoryUsageUpTo(arr, 1024) < memory);
+    mu_check(Node_MemoryUsageUpTo(arr, 1024) >= 1024);
+
+    // ...and are measured as they're freed, to be settled by their document
+    LazyFree_FreeValue(arr, &jobs);
+    mu_check(NULL != jobs);
+    mu_assert_int_eq(base + memory, Node_Allocated());
+    LazyFree_Wait();
+    mu_assert_int_eq(memory, LazyFree_Settle(&jobs));
+    mu_check(NULL == jobs);
+    mu_assert_int_eq(base, Node_Allocated());
+    mu_assert_int_eq(0, LazyFree_Settle(&jobs));
+
+    // jobs that are let go of are freed by the thread
+    LazyFree_FreeValue(testLazyValue(), &jobs);
+    LazyFree_Abandon(&jobs);
+    mu_check(NULL == jobs);
+    LazyFree_Wait();
+    Node_HandOff(memory);
+    mu_assert_int_eq(base, Node_Allocated());
+
+    // small ones are freed right away
+    n = NewCStringNode("a value that is not inline");
+    LazyFree_FreeValue(n, &jobs);
+    mu_check(NULL == jobs);
+    mu_assert_int_eq(base, Node_Allocated());
+}
+
+/* Moves every allocation, so defragmentation leaves no pointer to the old ones behind */
+static void *testDefragMove(void *ctx, void *ptr) {
+    size_t size = malloc_usable_size(ptr);
+    void *ret = malloc(size);
+    memcpy(ret, ptr, size);
+    free(ptr);
+    (*(int *)ctx)++;
+    return ret;
+}
+
+static int testDefragStop(void *ctx) { return 1; }
+
+static int testDefragNever(void *ctx) { return 0; }
+
+MU_TEST(testDefrag) {
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+    JSONSerializeOpt opt = {"", "", ""};
+    sds json = sdsnew("{\"str\":\"a string that is not inline\",\"nums\":[1.5,2.5,3.5],\"rows\":[");
+    for (int i = 0; i < 200; i++) {
+        json = sdscatprintf(json, "%s{\"id\":%d,\"name\":\"a name that is not inline\",",
+                            i ? "," : "", i);
+        json = sdscat(json, "\"tags\":[\"t\"]}");
+    }
+    json = sdscat(json, "],\"big\":{");
+    for (int i = 0; i < 40; i++) json = sdscatprintf(json, "%s\"key%d\":[%d]", i ? "," : "", i, i);
+    json = sdscat(json, "},\"deep\":");
+    for (int i = 0; i < 20; i++) json = sdscat(json, "[\"a string that is not inline\",");
+    json = sdscat(json, "1");
+    for (int i = 0; i < 20; i++) json = sdscat(json, "]");
+    json = sdscat(json, "}");
+
+    Node *root, *n;
+    mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, sdslen(json), &root, NULL));
+    mu_check(OBJ_OK == Node_DictGet(root, "nums", &n));
+    mu_check(OBJ_OK == Node_ArrayPrepend(n, NewCStringNode("a head that is not inline")));
+
+    // stopping all the time still makes progress, and the tree may change between calls
+    NodeDefragCursor cursor = {0};
+    int moves = 0, calls = 1;
+    mu_check(!Node_Defrag(&root, &cursor, testDefragMove, testDefragStop, &moves));
+    mu_check(cursor.depth > 0);
+    mu_check(OBJ_OK == Node_DictGet(root, "rows", &n));
+    mu_check(NODE_ENC_TABLE == NODE_ENCODING(n));
+    mu_check(OBJ_OK == Node_ArrayDelRange(n, 0, 150));
+    while (!Node_Defrag(&root, &cursor, testDefragMove, testDefragStop, &moves)) calls++;
+    mu_check(calls > 2);
+    mu_assert_int_eq(0, cursor.depth);
+    mu_check(moves > 200);
+
+    // everything was moved and is still in place, including the rows of the table
+    sds before = sdsempty(), after = sdsempty();
+    SerializeNodeToJSON(root, &opt, &before);
+    moves = 0;
+    mu_check(Node_Defrag(&root, &cursor, testDefragMove, testDefragNever, &moves));
+    SerializeNodeToJSON(root, &opt, &after);
+    mu_check(!strcmp(before, after));
+    mu_check(OBJ_OK == Node_DictGet(root, "rows", &n));
+    mu_assert_int_eq(50, Node_Length(n));
+    mu_check(OBJ_OK == Node_ArrayItem(n, 0, &n));
+    mu_check(OBJ_OK == Node_DictGet(n, "id", &n));
+    mu_assert_int_eq(150, n->value.intval);
+
+    Node_Free(root);
+    sdsfree(before);
+    sdsfree(after);
+    sdsfree(json);
+    FreeJSONObjectCtx(joctx);
+}
+
+MU_TEST(testCompact) {
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+    JSONSerializeOpt opt = {"  ", "\n", " "};
+    const char *json =
+        "{\"n\":null,\"t\":true,\"f\":false,\"i\":-300,\"d\":1.5,\"s\":\"a string that is not "
+        "inline\",\"e\":{},\"a\":[1,[2,3],{\"x\":\"y\"}],"
+        "\"rows\":[{\"id\":1},{\"id\":2},{\"id\":3},{\"id\":4}]}";
+
+    Node *root, *n;
+    mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &root, NULL));
+
+    // the encoding is given up if it is too big
+    size_t len;
+    mu_check(NULL == Compact_Encode(root, 32, &len));
+    char *c = Compact_Encode(root, 512, &len);
+    mu_check(NULL != c);
+    mu_check(len < strlen(json));
+    mu_assert_int_eq(N_DICT, Compact_Type(c));
+    mu_assert_int_eq(9, Compact_Length(c));
+
+    // serializing the encoding is the same as serializing its nodes, and so is decoding it
+    sds before = sdsempty(), after = sdsempty(), decoded = sdsempty();
+    SerializeNodeToJSON(root, &opt, &before);
+    SerializeCompactToJSON(c, &opt, &after);
+    mu_check(!strcmp(before, after));
+    Node *copy = Compact_Decode(c);
+    SerializeNodeToJSON(copy, &opt, &decoded);
+    mu_check(!strcmp(before, decoded));
+    mu_check(OBJ_OK == Node_DictGet(copy, "rows", &n));
+    mu_check(NODE_ENC_TABLE == NODE_ENCODING(n));
+
+    // values are found in place
+    const char *paths[] = {"a[1][-1]", "a[2].x", "i", "d", "n"};
+    NodeType types[] = {N_INTEGER, N_STRING, N_INTEGER, N_NUMBER, N_NULL};
+    for (int i = 0; i < 5; i++) {
+        SearchPath sp = NewSearchPath(0);
+        JSONSearchPathError_t err = {0};
+        const char *v;
+        int errlevel = -1;
+        mu_check(PARSE_OK == ParseJSONPath(paths[i], strlen(paths[i]), &sp, &err));
+        mu_check(E_OK == Compact_Find(&sp, c, &v, &errlevel));
+        mu_assert_int_eq(types[i], Compact_Type(v));
+        SearchPath_Free(&sp);
+    }
+
+    const char *bad[] = {"a[3]", "a[1].x", "s[0]", "a[2].z"};
+    PathError errs[] = {E_NOINDEX, E_BADTYPE, E_BADTYPE, E_NOKEY};
+    int levels[] = {1, 2, 1, 2};
+    for (int i = 0; i < 4; i++) {
+        SearchPath sp = NewSearchPath(0);
+        JSONSearchPathError_t err = {0};
+        const char *v;
+        int errlevel = -1;
+        mu_check(PARSE_OK == ParseJSONPath(bad[i], strlen(bad[i]), &sp, &err));
+        mu_assert_int_eq(errs[i], Compact_Find(&sp, c, &v, &errlevel));
+        mu_assert_int_eq(levels[i], errlevel);
+        mu_check(NULL == v);
+        SearchPath_Free(&sp);
+    }
+
+    Node_Free(root);
+    Node_Free(copy);
+    ValkeyModule_Free(c);
+    sdsfree(before);
+    sdsfree(after);
+    sdsfree(decoded);
+    FreeJSONObjectCtx(joctx);
+}
+
+MU_TEST(testTape) {
+    JSONObjectCtx *joctx = NewJSONObjectCtx(0);
+    JSONSerializeOpt opt = {"  ", "\n", " "};
+    const char *json =
+        "{\"n\":null,\"t\":true,\"f\":false,\"i\":-300,\"d\":1.5,\"s\":\"exactly 16 bytes\","
+        "\"e\":\"\",\"a\":[1,[2,3],{\"x\":\"y\"}],\"o\":{}}";
+
+    Node *root;
+    mu_check(JSONOBJECT_OK == CreateNodeFromJSON(joctx, json, strlen(json), &root, NULL));
+    size_t len;
+    uint64_t *t = Tape_Encode(root, &len);
+    mu_assert_int_eq(len, Tape_Size(t));
+    mu_assert_int_eq(N_DICT, Tape_Type(t));
+    mu_assert_int_eq(9, Tape_Length(t));
+
+    // serializing the tape is the same as serializing its nodes, and so is decoding it
+    sds before = sdsempty(), after = sdsempty(), decoded = sdsempty();
+    SerializeNodeToJSON(root, &opt, &before);
+    SerializeTapeToJSON(t, &opt, &after);
+    mu_check(!strcmp(before, after));
+    Node *copy = Tape_Decode(t);
+    SerializeNodeToJSON(copy, &opt, &decoded);
+    mu_check(!strcmp(before, decoded));
+
+    // values are found by skipping over their siblings
+    const char *paths[] = {"a[1][-1]", "a[2].x", "s", "o", "n"};
+    NodeType types[] = {N_INTEGER, N_STRING, N_STRING, N_DICT, N_NULL};
+    for (int i = 0; i < 5; i++) {
+        SearchPath sp = NewSearchPath(0);
+        JSONSearchPathError_t err = {0};
+        const uint64_t *v;
+        int errlevel = -1;
+        mu_check(PARSE_OK == ParseJSONPath(paths[i], strlen(paths[i]), &sp, &err));
+        mu_check(E_OK == Tape_Find(&sp, t, &v, &errlevel));
+        mu_assert_int_eq(types[i], Tape_Type(v));
+        SearchPath_Free(&sp);
+    }
+
+    const char *bad[] = {"a[-4]", "a[1].x", "e[0]", "a[2].z"};
+    PathError errs[] = {E_NOINDEX, E_BADTYPE, E_BADTYPE, E_NOKEY};
+    int levels[] = {1, 2, 1, 2};
+    for (int i = 0; i < 4; i++) {
+        SearchPath sp = NewSearchPath(0);
+        JSONSearchPathError_t err = {0};
+        const uint64_t *v;
+        int errlevel = -1;
+        mu_check(PARSE_OK == ParseJSONPath(bad[i], strlen(bad[i]), &sp, &err));
+        mu_assert_int_eq(errs[i], Tape_Find(&sp, t, &v, &errlevel));
+        mu_assert_int_eq(levels[i], errlevel);
+        mu_check(NULL == v);
+        SearchPath_Free(&sp);
+    }
+
+    Node_Free(root);
+    Node_Free(copy);
+    ValkeyModule_Free(t);
+    sdsfree(before);
+    sdsfree(after);
+    sdsfree(decoded);
+    FreeJSONObjectCtx(joctx);
+}
+
+MU_TEST(testBinary) {
+    size_t base = Node_Allocated();
+    JSONSerializeOpt opt = {"", "", ""};
+    const char bytes[] = {'\0', '\xff', 'a', '"', '\n', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j'};
+
+    // binary values are stored like strings, inline when they are short
+    Node *root = NewDictNode(2);
+    Node *rows = NewArrayNode(0);
+    for (int i = 0; i < 4; i++) {
+        Node *o = NewDictNode(1);
+        mu_check(OBJ_OK == Node_DictSet(o, "b", NewBinaryNode(bytes, sizeof(bytes) - i)));
+        mu_check(OBJ_OK == Node_ArrayAppend(rows, o));
+    }
+    mu_check(OBJ_OK == Node_ArrayTabulate(rows));
+    mu_check(OBJ_OK == Node_DictSet(root, "rows", rows));
+    mu_check(OBJ_OK == Node_DictSet(root, "short", NewBinaryNode(bytes, 2)));
+    mu_assert_int_eq(ObjectTypeMemoryUsage(root), Node_Allocated() - base);
+
+    // JSON has them in base64, in all the encodings
+    const char *json = "{\"rows\":[{\"b\":\"AP9hIgpiY2RlZmdoaWo=\"},{\"b\":\"AP9hIgpiY2RlZmdoaQ==\"},"
+                       "{\"b\":\"AP9hIgpiY2RlZmdo\"},{\"b\":\"AP9hIgpiY2RlZmc=\"}],\"short\":\"AP8=\"}";
+    size_t len;
+    char *c = Compact_Encode(root, 512, &len);
+    uint64_t *t = Tape_Encode(root, &len);
+    sds fromNodes = sdsempty(), fromCompact = sdsempty(), fromTape = sdsempty();
+    SerializeNodeToJSON(root, &opt, &fromNodes);
+    SerializeCompactToJSON(c, &opt, &fromCompact);
+    SerializeTapeToJSON(t, &opt, &fromTape);
+    mu_check(!strcmp(json, fromNodes));
+    mu_check(!strcmp(json, fromCompact));
+    mu_check(!strcmp(json, fromTape));
+
+    // and they stay binary when they are decoded, copied or taken out of a table
+    Node *copies[] = {Compact_Decode(c), Tape_Decode(t), Node_Clone(root)};
+    for (int i = 0; i < 3; i++) {
+        Node *n, *row;
+        mu_check(OBJ_OK == Node_DictGet(copies[i], "short", &n));
+        mu_assert_int_eq(N_BINARY, n->type);
+        mu_assert_int_eq(2, NODE_STRLEN(n));
+        mu_check(OBJ_OK == Node_DictGet(copies[i], "rows", &rows));
+        row = Node_ArrayTake(rows, 0);
+        mu_check(OBJ_OK == Node_DictGet(row, "b", &n));
+        mu_assert_int_eq(N_BINARY, n->type);
+        mu_assert_int_eq(sizeof(bytes), NODE_STRLEN(n));
+        mu_check(!memcmp(bytes, NODE_STRDATA(n), sizeof(bytes)));
+        Node_Free(row);
+        Node_Free(copies[i]);
+    }
+
+    Node_Free(root);
+    mu_assert_int_eq(base, Node_Allocated());
+    ValkeyModule_Free(c);
+    ValkeyModule_Free(t);
+    sdsfree(fromNodes);
+    sdsfree(fromCompact);
+    sdsfree(fromTape);
+}
+
 MU_TEST(testPath) {
     Node *root = NewDictNode(1);
     mu_check(root != NULL);
@@ -210,7 +1293,7 @@ MU_TEST(testPath) {
     mu_check(n != NULL);
 
     mu_check(n->type == N_STRING);
-    mu_check(!strcmp(n->value.strval.data, "hello"));
+    mu_check(!strcmp(NODE_STRDATA(n), "hello"));
 
     SearchPath_Free(&sp);
     Node_Free(root);
@@ -250,7 +1333,7 @@ MU_TEST(testPathEx) {
     mu_check(arr == p);
     mu_check(n != NULL);
     mu_check(n->type == N_STRING);
-    mu_check(!strcmp(n->value.strval.data, "hello"));
+    mu_check(!strcmp(NODE_STRDATA(n), "hello"));
     SearchPath_Free(&sp);
 
     // check for non existing key in root
@@ -394,8 +1477,25 @@ MU_TEST_SUITE(test_object) {
     // MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
     MU_RUN_TEST(testNodeString);
+    MU_RUN_TEST(testNodeShared);
     MU_RUN_TEST(testNodeArray);
+    MU_RUN_TEST(testNodeArrayPacked);
+    MU_RUN_TEST(testNodeArrayTable);
+    MU_RUN_TEST(testNodeArrayDeque);
     MU_RUN_TEST(testObject);
+    MU_RUN_TEST(testObjectIndexed);
+    MU_RUN_TEST(testObjectAppend);
+    MU_RUN_TEST(testKeyTable);
+    MU_RUN_TEST(testShapes);
+    MU_RUN_TEST(testArena);
+    MU_RUN_TEST(testMemoryAccounting);
+    MU_RUN_TEST(testShrinkToFit);
+    MU_RUN_TEST(testOptimize);
+    MU_RUN_TEST(testLazyFree);
+    MU_RUN_TEST(testDefrag);
+    MU_RUN_TEST(testCompact);
+    MU_RUN_TEST(testTape);
+    MU_RUN_TEST(testBinary);
     MU_RUN_TEST(testPath);
     MU_RUN_TEST(testPathEx);
     MU_RUN_TEST(testPathArray);